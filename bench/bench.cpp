@@ -0,0 +1,405 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <sched.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+#include "args.hpp"
+#include "bvh.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "packed_spheres.h"
+#include "rand.h"
+#include "sampler.h"
+#include "sphere.h"
+#include "vec3.h"
+#include "warp.h"
+#include "wide_bvh.h"
+
+/*
+  Micro-benchmarks for the hot paths of the tracer.
+
+  Every benchmark builds its inputs up front from a fixed seed, so two runs (or two builds)
+  measure exactly the same work. Each one is run in batches until it has taken at least
+  `--min-time` ms, that is repeated `--repeats` times, and the fastest repeat is reported:
+  the minimum is the run with the least interference from the rest of the machine.
+*/
+
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::high_resolution_clock;
+
+static const uint64_t BENCH_SEED = 1234;
+static const int NUM_INPUTS = 4096;  // rays (etc.) per batch, cycled through
+
+// results get folded into this so the compiler can't throw the work away
+static volatile float sink;
+
+/**
+ * Runs `batch` (which does `opsPerBatch` operations) and returns the best ns per operation
+ **/
+double measure(const std::function<void()>& batch, int opsPerBatch, double minTimeMs, int repeats) {
+    // warm up caches and branch predictors
+    batch();
+
+    double best = 1e30;
+    for (int r = 0; r < repeats; ++r) {
+        long long batches = 0;
+        const high_resolution_clock::time_point start = high_resolution_clock::now();
+        double elapsedMs = 0;
+        do {
+            batch();
+            batches++;
+            elapsedMs = duration_cast<duration<double, std::milli>>(high_resolution_clock::now() - start).count();
+        } while (elapsedMs < minTimeMs);
+        best = std::min(best, elapsedMs * 1e6 / (double(batches) * opsPerBatch));
+    }
+    return best;
+}
+
+bool pinToCpu(int cpu) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+    return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) != 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+// --- inputs -------------------------------------------------------------------------------
+
+/**
+ * Uniform on the unit sphere by rejection: a point in the cube, kept if it's in the ball (and not
+ * too close to its center to normalize). The tracer samples with warp.h now, the inputs stay the
+ * same so results compare across versions, and it's the baseline of the warp benchmarks.
+ **/
+vec3 randomUnitVector() {
+    vec3 p;
+    do {
+        p = 2.0 * vec3(random_double(), random_double(), random_double()) - vec3(1, 1, 1);
+    } while (p.squaredLength() >= 1.0 || p.squaredLength() < 1e-4);
+    return unitVector(p);
+}
+
+/**
+ * Rays aimed at a unit sphere at the origin, `hitFraction` of them through it and the rest past it
+ **/
+std::vector<ray> sphereRays(float hitFraction) {
+    std::vector<ray> rays;
+    for (int k = 0; k < NUM_INPUTS; ++k) {
+        const vec3 origin = 5. * randomUnitVector();
+        const vec3 side = unitVector(cross(origin, vec3(0.3, 1, 0.1)));
+        // aim inside the silhouette for a hit, well outside it for a miss
+        const float offset = random_double() < hitFraction ? 0.9 * random_double() : 1.2 + random_double();
+        rays.push_back(ray(origin, offset * side - origin));
+    }
+    return rays;
+}
+
+/**
+ * Rays from inside a cloud of spheres in random directions, like secondary rays in a scene
+ **/
+std::vector<ray> sceneRays(float extent) {
+    std::vector<ray> rays;
+    for (int k = 0; k < NUM_INPUTS; ++k) {
+        const vec3 origin(extent * (random_double() - 0.5), extent * (random_double() - 0.5),
+                          extent * (random_double() - 0.5));
+        rays.push_back(ray(origin, randomUnitVector()));
+    }
+    return rays;
+}
+
+/**
+ * `n` small spheres spread over a cube of side `extent`
+ **/
+std::vector<std::unique_ptr<hittable>> sphereCloud(int n, float extent) {
+    std::vector<std::unique_ptr<hittable>> list;
+    for (int k = 0; k < n; ++k) {
+        const vec3 center(extent * (random_double() - 0.5), extent * (random_double() - 0.5),
+                          extent * (random_double() - 0.5));
+        list.push_back(std::make_unique<sphere>(center, 0.2, 0));  // material 0, intersection never looks at it
+    }
+    return list;
+}
+
+/**
+ * Hit records on a unit sphere at the origin, paired with the rays that produced them
+ **/
+void scatterInputs(std::vector<ray>& rays, std::vector<hit_record>& records) {
+    sphere target(vec3(0, 0, 0), 1., 0);
+    for (const ray& r : sphereRays(1.)) {
+        hit_record rec;
+        if (target.hit(r, 0.001, 1e30, rec)) {
+            rays.push_back(r);
+            records.push_back(rec);
+        }
+    }
+}
+
+// --- benchmarks ---------------------------------------------------------------------------
+
+int main(int argc, char** argv) {
+    args::ArgumentParser parser("Tracer micro-benchmarks", "Reports the best of several runs, in ns per operation.");
+    args::HelpFlag help(parser, "help", "Display this help menu", {"help"});
+    args::ValueFlag<int> cpu(parser, "cpu", "Pin the benchmark thread to this CPU", {"cpu"});
+    args::ValueFlag<double> minTime(parser, "min-time", "Minimum ms each repeat runs for (default 200)",
+                                    {"min-time"});
+    args::ValueFlag<int> repeats(parser, "repeats", "Repeats per benchmark, the best is reported (default 5)",
+                                 {"repeats"});
+    args::ValueFlag<std::string> filter(parser, "filter", "Only run benchmarks whose name contains this",
+                                        {"filter"});
+
+    try {
+        parser.ParseCLI(argc, argv);
+    } catch (const args::Help&) {
+        std::cout << parser;
+        return 0;
+    } catch (const args::Error& e) {
+        std::cerr << e.what() << std::endl;
+        std::cerr << parser;
+        return 1;
+    }
+
+    if (cpu) {
+        if (!pinToCpu(args::get(cpu))) {
+            std::cerr << "Could not pin to CPU " << args::get(cpu) << std::endl;
+            return 1;
+        }
+        std::cout << "Pinned to CPU " << args::get(cpu) << std::endl;
+    }
+
+    const double minTimeMs = minTime ? args::get(minTime) : 200.;
+    const int numRepeats = repeats ? args::get(repeats) : 5;
+    const std::string only = filter ? args::get(filter) : "";
+
+    // `unit` is what one op is, for the throughput column
+    auto run = [&](const std::string& name, const char* unit, int opsPerBatch, const std::function<void()>& batch) {
+        if (!only.empty() && name.find(only) == std::string::npos)
+            return;
+        double ns = measure(batch, opsPerBatch, minTimeMs, numRepeats);
+        printf("%-36s %10.2f ns/op %12.2f M%s/s\n", name.c_str(), ns, 1e3 / ns, unit);
+        fflush(stdout);
+    };
+
+    printf("%-36s %16s %18s\n", "benchmark", "time", "throughput");
+
+    // random number generation
+    seed_random(BENCH_SEED, 0);
+    run("random_double", "numbers", NUM_INPUTS, [&]() {
+        double acc = 0;
+        for (int k = 0; k < NUM_INPUTS; ++k)
+            acc += random_double();
+        sink = float(acc);
+    });
+
+    // sample numbers, a pixel's samples through a few bounces worth of slots
+    for (const sampling::Method method : {sampling::Method::RANDOM, sampling::Method::SOBOL, sampling::Method::HALTON,
+                                          sampling::Method::BLUE_NOISE}) {
+        seed_random(BENCH_SEED, 0);
+        sampling::prepare(method);
+        const uint32_t slots = 16;
+        run(std::string("sampler::get2D ") + sampling::name(method), "samples", NUM_INPUTS, [&]() {
+            float acc = 0;
+            for (int k = 0; k < NUM_INPUTS / int(slots); ++k) {
+                sampling::PixelSampler sampler(method, BENCH_SEED, k & 63, k >> 6, uint32_t(k));
+                for (uint32_t slot = 0; slot < slots; ++slot) {
+                    float u, v;
+                    sampler.get2D(slot, u, v);
+                    acc += u + v;
+                }
+            }
+            sink = acc;
+        });
+    }
+
+    // single sphere, hit / miss mix
+    for (float hitFraction : {0.f, 0.5f, 1.f}) {
+        seed_random(BENCH_SEED, 1);
+        const std::vector<ray> rays = sphereRays(hitFraction);
+        const sphere target(vec3(0, 0, 0), 1., 0);
+        run("sphere::hit " + std::to_string(int(hitFraction * 100)) + "% hits", "rays", NUM_INPUTS, [&]() {
+            hit_record rec;
+            int hits = 0;
+            for (const ray& r : rays)
+                hits += target.hit(r, 0.001, 1e30, rec);
+            sink = float(hits);
+        });
+    }
+
+    // whole worlds at growing sizes, the flat list against the acceleration structures
+    for (int n : {16, 128, 1024, 8192}) {
+        const float extent = 2. * cbrt(float(n));  // keep the density of spheres constant
+        for (const std::string accel : {"list", "packed", "bvh", "bvh4", "bvh8"}) {
+            if (accel == "list" && n > 1024)
+                continue;  // too slow to be interesting
+
+            seed_random(BENCH_SEED, 2);
+            std::vector<std::unique_ptr<hittable>> objects = sphereCloud(n, extent);
+            std::unique_ptr<hittable> world;
+            if (accel == "list")
+                world = std::make_unique<hittable_list>(std::move(objects));
+            else if (accel == "packed")
+                world = std::make_unique<packed_spheres>(std::move(objects));
+            else if (accel == "bvh4")
+                world = std::make_unique<bvh4>(std::move(objects));
+            else if (accel == "bvh8")
+                world = std::make_unique<bvh8>(std::move(objects));
+            else
+                world = std::make_unique<bvh>(std::move(objects));
+            const std::vector<ray> rays = sceneRays(extent);
+
+            run(accel + "::hit n=" + std::to_string(n), "rays", NUM_INPUTS, [&]() {
+                hit_record rec;
+                int hits = 0;
+                for (const ray& r : rays)
+                    hits += world->hit(r, 0.001, 1e30, rec);
+                sink = float(hits);
+            });
+            // shadow rays: any hit up to a light a few units away
+            run(accel + "::occluded n=" + std::to_string(n), "rays", NUM_INPUTS, [&]() {
+                int hits = 0;
+                for (const ray& r : rays)
+                    hits += world->occluded(r, 0.001, 4.);
+                sink = float(hits);
+            });
+        }
+    }
+
+    // materials
+    {
+        seed_random(BENCH_SEED, 3);
+        std::vector<ray> rays;
+        std::vector<hit_record> records;
+        scatterInputs(rays, records);
+
+        material_table table;
+        table.add(lambertian(vec3(0.5, 0.5, 0.5)));
+        table.add(metal(vec3(0.7, 0.6, 0.5), 0.3));
+        table.add(dielectric(1.5));
+        const std::vector<std::string> names = {"lambertian::scatter", "metal::scatter", "dielectric::scatter"};
+
+        // one material at a time, then all of them mixed up the way a scene's hits are
+        std::vector<uint32_t> mixed(records.size());
+        for (uint32_t& id : mixed)
+            id = std::min(uint32_t(2), uint32_t(random_double() * 3));
+        std::vector<float> samples(3 * records.size());
+        for (float& u : samples)
+            u = random_double();
+        for (size_t m = 0; m <= names.size(); ++m) {
+            for (size_t k = 0; k < records.size(); ++k)
+                records[k].material_id = m < names.size() ? uint32_t(m) : mixed[k];
+            const int ops = int(rays.size());
+            run(m < names.size() ? names[m] : std::string("material::scatter mixed"), "scatters", ops, [&]() {
+                vec3 attenuation;
+                ray scattered(vec3(0, 0, 0), vec3(0, 0, 0));  // lights don't scatter, and leave it as it is
+                float acc = 0;
+                for (size_t k = 0; k < rays.size(); ++k) {
+                    const float* u = &samples[3 * k];
+                    table[records[k].material_id].scatter(rays[k], records[k], u[0], u[1], u[2], attenuation,
+                                                          scattered);
+                    acc += scattered.B.x();
+                }
+                sink = acc;
+            });
+        }
+    }
+
+    // sample mappings, closed form (warp.h) against rejection from the cube / square
+    {
+        seed_random(BENCH_SEED, 5);
+        std::vector<float> samples(3 * NUM_INPUTS);
+        for (float& u : samples)
+            u = random_double();
+
+        run("warp::concentricDisk", "samples", NUM_INPUTS, [&]() {
+            float acc = 0;
+            for (int k = 0; k < NUM_INPUTS; ++k) {
+                float x, y;
+                warp::concentricDisk(samples[3 * k], samples[3 * k + 1], x, y);
+                acc += x + y;
+            }
+            sink = acc;
+        });
+        run("rejection unit disk", "samples", NUM_INPUTS, [&]() {
+            float acc = 0;
+            for (int k = 0; k < NUM_INPUTS; ++k) {
+                vec3 p;
+                do {
+                    p = 2.0 * vec3(random_double(), random_double(), 0) - vec3(1, 1, 0);
+                } while (dot(p, p) >= 1.0);
+                acc += p.x() + p.y();
+            }
+            sink = acc;
+        });
+        run("warp::cosineHemisphere", "samples", NUM_INPUTS, [&]() {
+            float acc = 0;
+            for (int k = 0; k < NUM_INPUTS; ++k)
+                acc += warp::cosineHemisphere(samples[3 * k], samples[3 * k + 1]).z();
+            sink = acc;
+        });
+        run("warp::uniformSphere", "samples", NUM_INPUTS, [&]() {
+            float acc = 0;
+            for (int k = 0; k < NUM_INPUTS; ++k)
+                acc += warp::uniformSphere(samples[3 * k], samples[3 * k + 1]).z();
+            sink = acc;
+        });
+        run("rejection unit vector", "samples", NUM_INPUTS, [&]() {
+            float acc = 0;
+            for (int k = 0; k < NUM_INPUTS; ++k)
+                acc += randomUnitVector().z();
+            sink = acc;
+        });
+        run("warp::uniformBall", "samples", NUM_INPUTS, [&]() {
+            float acc = 0;
+            for (int k = 0; k < NUM_INPUTS; ++k)
+                acc += warp::uniformBall(samples[3 * k], samples[3 * k + 1], samples[3 * k + 2]).z();
+            sink = acc;
+        });
+        run("rejection unit ball", "samples", NUM_INPUTS, [&]() {
+            float acc = 0;
+            for (int k = 0; k < NUM_INPUTS; ++k) {
+                vec3 p;
+                do {
+                    p = 2.0 * vec3(random_double(), random_double(), random_double()) - vec3(1, 1, 1);
+                } while (p.squaredLength() >= 1.0);
+                acc += p.z();
+            }
+            sink = acc;
+        });
+    }
+
+    // camera rays, with and without a lens
+    for (float aperture : {0.f, 0.1f}) {
+        seed_random(BENCH_SEED, 4);
+        const camera cam(vec3(7.8, 1.5, 1.95), vec3(0, 1, 0), vec3(0, 1, 0), 45, 1.5, aperture, 7.8);
+        std::vector<float> st(2 * NUM_INPUTS);
+        for (float& v : st)
+            v = random_double();
+
+        run(std::string("camera::get_ray aperture=") + (aperture > 0 ? "0.1" : "0"), "rays", NUM_INPUTS, [&]() {
+            float acc = 0;
+            for (int k = 0; k < NUM_INPUTS; ++k)
+                acc += cam.get_ray(st[2 * k], st[2 * k + 1]).B.x();
+            sink = acc;
+        });
+    }
+
+    return 0;
+}
@@ -0,0 +1,93 @@
+#ifndef AABBH
+#define AABBH
+
+#include <limits>
+
+#include "ray.h"
+
+/**
+ * Axis aligned bounding box, used by the acceleration structures to skip whole groups of
+ * objects a ray can't possibly hit.
+ *
+ * A default constructed box is "empty" (min = +inf, max = -inf) so that growing it by any
+ * point or box gives back exactly that point or box.
+ **/
+class aabb {
+    public:
+        aabb()
+            : pmin(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+                   std::numeric_limits<float>::max()),
+              pmax(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(),
+                   -std::numeric_limits<float>::max()) {}
+        aabb(const vec3& a, const vec3& b) : pmin(a), pmax(b) {}
+
+        inline void grow(const vec3& p);
+        inline void grow(const aabb& b);
+        inline vec3 centroid() const { return 0.5 * (pmin + pmax); }
+        inline vec3 extent() const { return pmax - pmin; }
+        inline bool isEmpty() const { return pmin.x() > pmax.x(); }
+        inline float surfaceArea() const;
+        inline int longestAxis() const;
+        inline bool hit(const vec3& origin, const vec3& invDirection, float t_min, float t_max) const;
+
+        vec3 pmin;
+        vec3 pmax;
+};
+
+inline void aabb::grow(const vec3& p) {
+    for (int a = 0; a < 3; ++a) {
+        if (p.e[a] < pmin.e[a]) pmin.e[a] = p.e[a];
+        if (p.e[a] > pmax.e[a]) pmax.e[a] = p.e[a];
+    }
+}
+
+inline void aabb::grow(const aabb& b) {
+    for (int a = 0; a < 3; ++a) {
+        if (b.pmin.e[a] < pmin.e[a]) pmin.e[a] = b.pmin.e[a];
+        if (b.pmax.e[a] > pmax.e[a]) pmax.e[a] = b.pmax.e[a];
+    }
+}
+
+inline float aabb::surfaceArea() const {
+    if (isEmpty())
+        return 0.;
+    const vec3 d = extent();
+    return 2. * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+}
+
+inline int aabb::longestAxis() const {
+    const vec3 d = extent();
+    if (d.x() > d.y() && d.x() > d.z())
+        return 0;
+    return d.y() > d.z() ? 1 : 2;
+}
+
+/**
+ * Slab test. `invDirection` is 1 / ray direction, computed once per ray by the caller.
+ *
+ * The comparisons are written so a NaN (0 * inf, when the ray lies exactly in a slab plane)
+ * keeps the previous interval instead of poisoning it.
+ **/
+inline bool aabb::hit(const vec3& origin, const vec3& invDirection, float t_min, float t_max) const {
+    for (int a = 0; a < 3; ++a) {
+        float t0 = (pmin.e[a] - origin.e[a]) * invDirection.e[a];
+        float t1 = (pmax.e[a] - origin.e[a]) * invDirection.e[a];
+        if (invDirection.e[a] < 0.) {
+            float tmp = t0;
+            t0 = t1;
+            t1 = tmp;
+        }
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+        if (t_max < t_min)
+            return false;
+    }
+    return true;
+}
+
+inline vec3 inverseDirection(const ray& r) {
+    const vec3 d = r.direction();
+    return vec3(1. / d.x(), 1. / d.y(), 1. / d.z());
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef ADAPTIVEH
+#define ADAPTIVEH
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "image.h"
+#include "vec3.h"
+
+namespace adaptive {
+
+    // two sided 95% confidence for the error estimate
+    static const float Z_95 = 1.96f;
+
+    // darkest mean the error is taken relative to, so black pixels don't divide by zero
+    static const float MIN_MEAN = 1e-4f;
+
+    // samples taken for every pixel (indexed like the image), filled in by adaptive renders
+    typedef std::vector<uint32_t> SampleCounts;
+
+    inline float luminance(const vec3& c) {
+        return 0.2126f * c.r() + 0.7152f * c.g() + 0.0722f * c.b();
+    }
+
+    /**
+     * Running mean and variance of the samples of one pixel (Welford's algorithm, so it's one pass
+     * and doesn't lose precision when the variance is tiny next to the mean).
+     *
+     * The color is averaged per channel, the variance is tracked on luminance only: noise shows as
+     * flickering brightness, and one number is all the stopping rule needs.
+     **/
+    struct PixelStats {
+        unsigned int count = 0;
+        vec3 mean = vec3(0, 0, 0);
+        float luminanceMean = 0;
+        float luminanceM2 = 0;  // sum of squared differences from the mean
+
+        void add(const vec3& sample) {
+            ++count;
+            mean += (sample - mean) / float(count);
+            const float y = luminance(sample);
+            const float delta = y - luminanceMean;
+            luminanceMean += delta / float(count);
+            luminanceM2 += delta * (y - luminanceMean);
+        }
+
+        /**
+         * Half width of the 95% confidence interval on the pixel, in display units (0 to 1).
+         * The framebuffer shows sqrt(linear), whose slope is 1 / (2 sqrt(linear)), so the same
+         * linear error is far more visible in the shadows than in the highlights.
+         **/
+        float error() const {
+            if (count < 2)
+                return std::numeric_limits<float>::max();
+            const float variance = luminanceM2 / float(count - 1);
+            const float standardError = std::sqrt(variance / float(count));
+            return Z_95 * standardError / (2.f * std::sqrt(std::max(luminanceMean, MIN_MEAN)));
+        }
+    };
+
+    /**
+     * Heatmap of `counts`, black for `minSamples` going through red and yellow to white at `maxSamples`
+     **/
+    Image heatmap(const SampleCounts& counts, int width, int height, unsigned int minSamples,
+                  unsigned int maxSamples) {
+        Image img(height, width);
+        const float range = std::max(1.f, float(maxSamples) - float(minSamples));
+        for (int j = 0; j < height; ++j) {
+            for (int i = 0; i < width; ++i) {
+                const float t = std::min(1.f, std::max(0.f, (float(counts[img.index(i, j)]) - minSamples) / range));
+                const vec3 display(std::min(1.f, 3.f * t), std::min(1.f, std::max(0.f, 3.f * t - 1.f)),
+                                   std::max(0.f, 3.f * t - 2.f));
+                img.setPixel(display * display, i, j);  // setPixel takes linear values, undo its gamma
+            }
+        }
+        return img;
+    }
+}
+
+#endif
@@ -0,0 +1,273 @@
+#ifndef BVHH
+#define BVHH
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "aabb.h"
+#include "bvh_builder.h"
+#include "lbvh.h"
+#include "hittable.h"
+#include "packed_spheres.h"
+#include "sphere.h"
+
+/**
+ * How to build the binary tree: binned SAH (best trees), LBVH (fastest, parallel) or HLBVH
+ * (LBVH with the top levels rebuilt with SAH)
+ **/
+enum class BuildMethod { SAH, LBVH, HLBVH };
+
+inline bool parseBuildMethod(const std::string& name, BuildMethod& method) {
+    if (name == "sah")
+        method = BuildMethod::SAH;
+    else if (name == "lbvh")
+        method = BuildMethod::LBVH;
+    else if (name == "hlbvh")
+        method = BuildMethod::HLBVH;
+    else
+        return false;
+    return true;
+}
+
+inline const char* buildMethodName(BuildMethod method) {
+    switch (method) {
+        case BuildMethod::LBVH: return "lbvh";
+        case BuildMethod::HLBVH: return "hlbvh";
+        default: return "sah";
+    }
+}
+
+/**
+ * Closest hit traversal over a node array, shared by everything built with bvh_builder.
+ *
+ * `leaf(node, closest_so_far)` tests the primitives of a leaf: it lowers `closest_so_far` and
+ * returns true when it finds a closer hit. Children are visited nearer first, and the shrinking
+ * `closest_so_far` culls boxes that lie behind what we've already hit.
+ *
+ * With `anyHit` the traversal returns as soon as any leaf reports a hit, for occlusion queries.
+ **/
+template <bool anyHit = false, typename LeafFunc>
+inline bool traverseBvh(const std::vector<bvh_node>& nodes, const ray& r, float t_min, float t_max, LeafFunc leaf) {
+    if (nodes.empty())
+        return false;
+
+    const vec3 origin = r.origin();
+    const vec3 invDirection = inverseDirection(r);
+    const bool negative[3] = {invDirection.x() < 0, invDirection.y() < 0, invDirection.z() < 0};
+
+    bool hit_anything = false;
+    float closest_so_far = t_max;
+
+    int stack[bvh_builder::MAX_DEPTH + 4];
+    int stackSize = 0;
+    int current = 0;
+
+    while (true) {
+        const bvh_node& node = nodes[current];
+        if (node.bounds.hit(origin, invDirection, t_min, closest_so_far)) {
+            if (node.isLeaf()) {
+                if (leaf(node, closest_so_far)) {
+                    if (anyHit)
+                        return true;
+                    hit_anything = true;
+                }
+            } else {
+                // descend into the child on the ray's side of the split first
+                if (negative[node.axis]) {
+                    stack[stackSize++] = current + 1;
+                    current = node.offset;
+                } else {
+                    stack[stackSize++] = node.offset;
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+
+        if (stackSize == 0)
+            break;
+        current = stack[--stackSize];
+    }
+
+    return hit_anything;
+}
+
+/**
+ * Bounding volume hierarchy over arbitrary hittables.
+ *
+ * Takes ownership of the objects (the same vector `hittable_list` holds) and reorders them so
+ * every leaf covers a contiguous range. Traversal visits the nearer child first and shrinks
+ * `t_max` as hits are found, so far away subtrees get culled by their boxes.
+ *
+ * When every object is a sphere they are moved into a packed_spheres store instead, and leaves
+ * test their whole range with one SIMD kernel call rather than a virtual call per sphere.
+ **/
+class bvh : public hittable {
+    public:
+        static const int MAX_LEAF_SIZE = 4;
+        static const int MAX_PACKED_LEAF_SIZE = 16;
+
+        bvh(std::vector<std::unique_ptr<hittable>> objects, BuildMethod method = BuildMethod::SAH);
+        // a tree built earlier (see `buildSphereHierarchy`) over spheres already stored in leaf order
+        bvh(std::vector<bvh_node> prebuilt, std::unique_ptr<packed_spheres> spheres)
+            : nodes(std::move(prebuilt)), packed(std::move(spheres)) {}
+        virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        virtual bool occluded(const ray& r, float t_min, float t_max) const;
+        virtual bool bounding_box(aabb& box) const;
+        virtual void hitPacket(const ray_packet& p, float t_min, packet_hit& hits) const;
+
+        std::vector<bvh_node> nodes;
+        std::vector<std::unique_ptr<hittable>> list;
+        std::unique_ptr<packed_spheres> packed;  // set instead of `list` for all-sphere scenes
+};
+
+/**
+ * Builds the node array and primitive order over `boxes` with the chosen method. `primCost` only
+ * matters to SAH, the linear builders make leaves of up to `leafSize` wherever the codes allow.
+ **/
+void buildHierarchy(const std::vector<aabb>& boxes, int leafSize, float primCost, BuildMethod method,
+                    std::vector<bvh_node>& nodes, std::vector<int>& order) {
+    if (method == BuildMethod::SAH)
+        bvh_builder(boxes, leafSize, primCost).build(nodes, order);
+    else
+        lbvh_builder(boxes, leafSize, method == BuildMethod::HLBVH).build(nodes, order);
+}
+
+/**
+ * Builds the hierarchy over the boxes of spheres that go in a packed_spheres store. Sphere leaves
+ * are tested with one SIMD kernel call, so on AVX2 they are made up to `maxPackedLeafSize`
+ * spheres large by telling the builder a sphere costs a vector lane.
+ **/
+void buildSphereHierarchy(const std::vector<aabb>& boxes, int maxLeafSize, int maxPackedLeafSize, BuildMethod method,
+                          std::vector<bvh_node>& nodes, std::vector<int>& order) {
+    if (simd::detect() >= simd::AVX2) {
+        const float vectorWidth = simd::detect() >= simd::AVX512 ? 16. : 8.;
+        buildHierarchy(boxes, maxPackedLeafSize, 1. / vectorWidth, method, nodes, order);
+    } else {
+        buildHierarchy(boxes, maxLeafSize, 1., method, nodes, order);
+    }
+}
+
+/**
+ * Builds a binary tree over `objects` and moves them, in leaf order, either into `packed` (when
+ * they're all spheres) or into `list`. Shared by `bvh` and the wide trees collapsed from it.
+ **/
+void buildBvhLeaves(std::vector<std::unique_ptr<hittable>>& objects, std::vector<bvh_node>& nodes,
+                    std::vector<std::unique_ptr<hittable>>& list, std::unique_ptr<packed_spheres>& packed,
+                    int maxLeafSize, int maxPackedLeafSize, BuildMethod method) {
+    std::vector<aabb> boxes(objects.size());
+    for (size_t i = 0; i < objects.size(); ++i) {
+        if (!objects[i]->bounding_box(boxes[i]))
+            boxes[i] = aabb(vec3(0, 0, 0), vec3(0, 0, 0));
+    }
+
+    bool allSpheres = !objects.empty();
+    for (const auto& object : objects)
+        allSpheres = allSpheres && dynamic_cast<sphere*>(object.get()) != nullptr;
+
+    std::vector<int> order;
+    if (allSpheres)
+        buildSphereHierarchy(boxes, maxLeafSize, maxPackedLeafSize, method, nodes, order);
+    else
+        buildHierarchy(boxes, maxLeafSize, 1., method, nodes, order);
+
+    if (allSpheres) {
+        packed = std::make_unique<packed_spheres>();
+        for (int index : order)
+            packed->add(static_cast<sphere&>(*objects[index]));
+        packed->finalize();
+    } else {
+        list.reserve(objects.size());
+        for (int index : order)
+            list.push_back(std::move(objects[index]));
+    }
+}
+
+bvh::bvh(std::vector<std::unique_ptr<hittable>> objects, BuildMethod method) {
+    buildBvhLeaves(objects, nodes, list, packed, MAX_LEAF_SIZE, MAX_PACKED_LEAF_SIZE, method);
+}
+
+bool bvh::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    return traverseBvh(nodes, r, t_min, t_max, [&](const bvh_node& node, float& closest_so_far) {
+        if (packed) {
+            int closest = packed->hitRange(r, node.offset, node.offset + node.count, t_min, closest_so_far);
+            if (closest < 0)
+                return false;
+            packed->fillRecord(r, closest, closest_so_far, rec);
+            return true;
+        }
+
+        bool hit_anything = false;
+        for (int i = node.offset; i < node.offset + node.count; ++i) {
+            if (list[i]->hit(r, t_min, closest_so_far, rec)) {
+                hit_anything = true;
+                closest_so_far = rec.t;
+            }
+        }
+        return hit_anything;
+    });
+}
+
+bool bvh::occluded(const ray& r, float t_min, float t_max) const {
+    return traverseBvh<true>(nodes, r, t_min, t_max, [&](const bvh_node& node, float& closest_so_far) {
+        if (packed)
+            return packed->occludedRange(r, node.offset, node.offset + node.count, t_min, closest_so_far);
+        for (int i = node.offset; i < node.offset + node.count; ++i) {
+            if (list[i]->occluded(r, t_min, closest_so_far))
+                return true;
+        }
+        return false;
+    });
+}
+
+/**
+ * Packet traversal: a node is entered if any lane's ray overlaps it, and the packet as a whole
+ * goes down the tree. Packets are coherent, so the first lane's direction picks the child order.
+ **/
+void bvh::hitPacket(const ray_packet& p, float t_min, packet_hit& hits) const {
+    if (nodes.empty())
+        return;
+
+    const bool negative[3] = {p.dx[0] < 0, p.dy[0] < 0, p.dz[0] < 0};
+
+    int stack[bvh_builder::MAX_DEPTH + 4];
+    int stackSize = 0;
+    int current = 0;
+
+    while (true) {
+        const bvh_node& node = nodes[current];
+        if (packet::intersectBox(p, node.bounds, t_min, hits.t)) {
+            if (node.isLeaf() && packed) {
+                packed->hitPacketRange(p, node.offset, node.offset + node.count, t_min, hits);
+            } else if (node.isLeaf()) {
+                for (int i = node.offset; i < node.offset + node.count; ++i) {
+                    list[i]->hitPacket(p, t_min, hits);
+                }
+            } else {
+                if (negative[node.axis]) {
+                    stack[stackSize++] = current + 1;
+                    current = node.offset;
+                } else {
+                    stack[stackSize++] = node.offset;
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+
+        if (stackSize == 0)
+            break;
+        current = stack[--stackSize];
+    }
+}
+
+bool bvh::bounding_box(aabb& box) const {
+    if (nodes.empty())
+        return false;
+    box = nodes[0].bounds;
+    return true;
+}
+
+#endif
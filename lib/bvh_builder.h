@@ -0,0 +1,192 @@
+#ifndef BVHBUILDERH
+#define BVHBUILDERH
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "aabb.h"
+
+/**
+ * Flattened bounding volume hierarchy node.
+ *
+ * Nodes are stored depth first, so the left child of an interior node is always the very next
+ * node in the array and we only need to remember where the right child lives.
+ **/
+struct bvh_node {
+    aabb bounds;
+    int offset;  // interior: index of the right child. leaf: index of the first primitive
+    int count;   // number of primitives in a leaf, 0 for interior nodes
+    int axis;    // split axis, used to visit the nearer child first
+
+    inline bool isLeaf() const { return count > 0; }
+};
+
+/**
+ * Surface area heuristic builder.
+ *
+ * Works purely on bounding boxes so any list of primitives (spheres, triangles, ...) can be
+ * organized with it. It fills in `nodes` and a permutation `order` of the primitive indices:
+ * leaf `n` covers primitives order[n.offset] .. order[n.offset + n.count - 1].
+ *
+ * Splits are chosen by binning the primitive centroids along each axis and picking the bin
+ * boundary with the lowest expected cost:
+ *
+ *     cost = traversal + primitiveCost * (area(left) * count(left) + area(right) * count(right)) / area(parent)
+ *
+ * against primitiveCost * count for making a leaf. Primitives tested several at a time with SIMD
+ * are cheaper relative to a box test, so their builds pass a lower cost and get bigger leaves.
+ **/
+class bvh_builder {
+    public:
+        static const int NUM_BINS = 16;
+        static const int MAX_DEPTH = 60;  // traversal keeps a fixed size stack, so cap the tree depth
+
+        bvh_builder(const std::vector<aabb>& b, int leafSize, float primCost = 1.)
+            : boxes(b), maxLeafSize(leafSize), primitiveCost(primCost) {}
+
+        void build(std::vector<bvh_node>& nodes, std::vector<int>& order);
+
+    private:
+        int buildRecursive(int begin, int end, int depth);
+        int makeLeaf(const aabb& bounds, int begin, int end);
+
+        const std::vector<aabb>& boxes;
+        std::vector<vec3> centroids;
+        std::vector<bvh_node>* out;
+        std::vector<int>* prims;
+        int maxLeafSize;
+        float primitiveCost;
+};
+
+void bvh_builder::build(std::vector<bvh_node>& nodes, std::vector<int>& order) {
+    out = &nodes;
+    prims = &order;
+
+    nodes.clear();
+    order.resize(boxes.size());
+    centroids.resize(boxes.size());
+    for (size_t i = 0; i < boxes.size(); ++i) {
+        order[i] = int(i);
+        centroids[i] = boxes[i].centroid();
+    }
+
+    if (boxes.empty())
+        return;
+
+    nodes.reserve(2 * boxes.size());
+    buildRecursive(0, int(boxes.size()), 0);
+}
+
+int bvh_builder::makeLeaf(const aabb& bounds, int begin, int end) {
+    bvh_node leaf;
+    leaf.bounds = bounds;
+    leaf.offset = begin;
+    leaf.count = end - begin;
+    leaf.axis = 0;
+    out->push_back(leaf);
+    return int(out->size()) - 1;
+}
+
+int bvh_builder::buildRecursive(int begin, int end, int depth) {
+    std::vector<int>& order = *prims;
+
+    aabb bounds, centroidBounds;
+    for (int i = begin; i < end; ++i) {
+        bounds.grow(boxes[order[i]]);
+        centroidBounds.grow(centroids[order[i]]);
+    }
+
+    const int n = end - begin;
+    if (n <= 1 || depth >= MAX_DEPTH)
+        return makeLeaf(bounds, begin, end);
+
+    // find the cheapest bin boundary over all three axes
+    float bestCost = std::numeric_limits<float>::max();
+    int bestAxis = -1;
+    int bestSplit = 0;
+    const float parentArea = bounds.surfaceArea();
+
+    for (int axis = 0; axis < 3; ++axis) {
+        const float lo = centroidBounds.pmin[axis];
+        const float hi = centroidBounds.pmax[axis];
+        if (hi <= lo)
+            continue;  // all centroids on the same plane, nothing to split here
+
+        aabb binBounds[NUM_BINS];
+        int binCounts[NUM_BINS] = {0};
+        const float scale = NUM_BINS / (hi - lo);
+        for (int i = begin; i < end; ++i) {
+            int b = std::min(NUM_BINS - 1, int((centroids[order[i]][axis] - lo) * scale));
+            binCounts[b]++;
+            binBounds[b].grow(boxes[order[i]]);
+        }
+
+        // sweep from the right to get suffix areas, then from the left to evaluate each boundary
+        float rightArea[NUM_BINS];
+        int rightCount[NUM_BINS];
+        aabb acc;
+        int count = 0;
+        for (int b = NUM_BINS - 1; b > 0; --b) {
+            acc.grow(binBounds[b]);
+            count += binCounts[b];
+            rightArea[b] = acc.surfaceArea();
+            rightCount[b] = count;
+        }
+
+        acc = aabb();
+        count = 0;
+        for (int b = 0; b < NUM_BINS - 1; ++b) {
+            acc.grow(binBounds[b]);
+            count += binCounts[b];
+            if (count == 0 || rightCount[b + 1] == 0)
+                continue;
+            float cost = 1. + primitiveCost * (acc.surfaceArea() * count + rightArea[b + 1] * rightCount[b + 1]) /
+                                  parentArea;
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b;
+            }
+        }
+    }
+
+    int mid;
+    int axis;
+    if (bestAxis == -1) {
+        // centroids are all coincident, so SAH can't separate them: split by index if we must
+        if (n <= maxLeafSize)
+            return makeLeaf(bounds, begin, end);
+        axis = centroidBounds.longestAxis();
+        mid = begin + n / 2;
+    } else {
+        // intersecting every primitive is cheaper than splitting further
+        if (bestCost >= primitiveCost * n && n <= maxLeafSize)
+            return makeLeaf(bounds, begin, end);
+
+        axis = bestAxis;
+        const float lo = centroidBounds.pmin[axis];
+        const float scale = NUM_BINS / (centroidBounds.pmax[axis] - lo);
+        const std::vector<vec3>& c = centroids;
+        mid = int(std::partition(order.begin() + begin, order.begin() + end,
+                                 [&](int prim) {
+                                     return std::min(NUM_BINS - 1, int((c[prim][axis] - lo) * scale)) <= bestSplit;
+                                 }) -
+                  order.begin());
+    }
+
+    // reserve our slot before the children so the left child lands right after us
+    bvh_node interior;
+    interior.bounds = bounds;
+    interior.count = 0;
+    interior.axis = axis;
+    out->push_back(interior);
+    const int index = int(out->size()) - 1;
+
+    buildRecursive(begin, mid, depth + 1);
+    const int right = buildRecursive(mid, end, depth + 1);
+    (*out)[index].offset = right;
+    return index;
+}
+
+#endif
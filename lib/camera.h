@@ -3,18 +3,11 @@
 
 #include "rand.h"
 #include "ray.h"
+#include "warp.h"
 
 #define _USE_MATH_DEFINES  // for MSVC, for M_PI
 #include <math.h>
 
-vec3 randomInUnitDisk() {
-    vec3 p;
-    do {
-        p = 2.0*vec3(random_double(),random_double(),0) - vec3(1,1,0);
-    } while (dot(p,p) >= 1.0);
-    return p;
-}
-
 class camera {
     public:
         camera(vec3 lookfrom, vec3 lookat, vec3 vup, float vfov, float aspect,
@@ -36,8 +29,14 @@ class camera {
         }
 
         ray get_ray(float s, float t) const {
-            vec3 rd = lens_radius * randomInUnitDisk(); // pick random direction inside radius
-            vec3 offset = u * rd.x() + v * rd.y(); // pick random point on len's surface (no z component!)
+            return get_ray(s, t, random_double(), random_double());
+        }
+
+        // same, the point on the lens given by a sample (lensU, lensV) in [0, 1)^2 (see sampler.h)
+        ray get_ray(float s, float t, float lensU, float lensV) const {
+            float x, y;
+            warp::concentricDisk(lensU, lensV, x, y);  // uniform over the area of the lens
+            vec3 offset = u * (lens_radius * x) + v * (lens_radius * y); // no z component!
             return ray(origin + offset,
                        lower_left_corner + s*horizontal + t*vertical
                            - origin - offset);
@@ -0,0 +1,241 @@
+#ifndef CHECKPOINTH
+#define CHECKPOINTH
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "adaptive.h"
+#include "image.h"
+#include "scheduler.h"
+
+/**
+ * Checkpoints of a render in progress, so a killed job can pick up where it left off.
+ *
+ * A checkpoint holds the command line the render was started with (which is its whole
+ * configuration: the scene is rebuilt from it) and how far it got. That's all the random state
+ * there is, too: every pixel (and in progressive mode every pass of every pixel) reseeds from
+ * the render seed, so the same rays come out whether or not the render was interrupted.
+ *
+ *  - tiled renders store the framebuffer, which pixels are finished and how many samples each
+ *    took. Only finished tiles are recorded, and only those get skipped on resume.
+ *  - progressive renders store the float accumulation buffer and the number of passes in it,
+ *    taken between passes.
+ *
+ * Files are raw host byte order, they're meant to be resumed on the machine (type) that wrote them.
+ **/
+namespace checkpoint {
+
+    static const char MAGIC[8] = {'D', 'R', 'E', 'V', 'O', 'C', 'K', 'P'};
+    static const uint32_t VERSION = 1;
+
+    enum class Mode : uint8_t { Tiles = 0, Progressive = 1 };
+
+    struct State {
+        std::vector<std::string> args;  // command line, without the program name
+        Mode mode;
+        int32_t width, height;
+        double elapsedMs;  // render time already spent
+
+        // tiles
+        uint8_t pixelFormat;
+        std::vector<uint8_t> pixels;        // framebuffer bytes, finished pixels only
+        scheduler::PixelMask done;          // finished pixels
+        adaptive::SampleCounts counts;      // samples per finished pixel
+
+        // progressive
+        uint32_t passes;
+        std::vector<float> sums;
+    };
+
+    namespace detail {
+        template <typename T>
+        bool write(std::FILE* f, const T& value) {
+            return std::fwrite(&value, sizeof(T), 1, f) == 1;
+        }
+
+        template <typename T>
+        bool read(std::FILE* f, T& value) {
+            return std::fread(&value, sizeof(T), 1, f) == 1;
+        }
+
+        template <typename T>
+        bool writeVector(std::FILE* f, const std::vector<T>& v) {
+            return write(f, uint64_t(v.size())) &&
+                   (v.empty() || std::fwrite(v.data(), sizeof(T), v.size(), f) == v.size());
+        }
+
+        // `limit` guards against allocating whatever a corrupt size field says
+        template <typename T>
+        bool readVector(std::FILE* f, std::vector<T>& v, uint64_t limit) {
+            uint64_t n;
+            if (!read(f, n) || n > limit)
+                return false;
+            v.resize(size_t(n));
+            return v.empty() || std::fread(v.data(), sizeof(T), v.size(), f) == v.size();
+        }
+    }
+
+    /**
+     * Writes `state` to `path`, through a temporary file renamed over it so that a kill halfway
+     * through leaves the previous checkpoint intact. Returns false and sets `error` on failure.
+     **/
+    bool save(const std::string& path, const State& state, std::string& error) {
+        const std::string partial = path + ".part";
+        std::FILE* f = std::fopen(partial.c_str(), "wb");
+        if (!f) {
+            error = "can't open " + partial;
+            return false;
+        }
+
+        bool ok = std::fwrite(MAGIC, 1, sizeof(MAGIC), f) == sizeof(MAGIC) && detail::write(f, VERSION);
+        ok = ok && detail::write(f, uint32_t(state.args.size()));
+        for (const std::string& arg : state.args)
+            ok = ok && detail::writeVector(f, std::vector<char>(arg.begin(), arg.end()));
+        ok = ok && detail::write(f, state.mode) && detail::write(f, state.width) && detail::write(f, state.height) &&
+             detail::write(f, state.elapsedMs);
+        if (state.mode == Mode::Tiles) {
+            ok = ok && detail::write(f, state.pixelFormat) && detail::writeVector(f, state.pixels) &&
+                 detail::writeVector(f, state.done) && detail::writeVector(f, state.counts);
+        } else {
+            ok = ok && detail::write(f, state.passes) && detail::writeVector(f, state.sums);
+        }
+        ok = (std::fclose(f) == 0) && ok;
+        if (!ok) {
+            error = "error writing " + partial;
+            return false;
+        }
+
+#ifdef _WIN32
+        std::remove(path.c_str());  // rename doesn't replace existing files on Windows
+#endif
+        if (std::rename(partial.c_str(), path.c_str()) != 0) {
+            error = "can't rename " + partial + " to " + path;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Reads a checkpoint written by `save`. Returns false and sets `error` if `path` can't be read
+     * or isn't a checkpoint of this version.
+     **/
+    bool load(const std::string& path, State& state, std::string& error) {
+        std::FILE* f = std::fopen(path.c_str(), "rb");
+        if (!f) {
+            error = "can't open " + path;
+            return false;
+        }
+
+        char magic[sizeof(MAGIC)];
+        uint32_t version = 0, numArgs = 0;
+        bool ok = std::fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+                  std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0 && detail::read(f, version) && version == VERSION;
+        if (!ok) {
+            std::fclose(f);
+            error = path + " is not a checkpoint (of this version)";
+            return false;
+        }
+
+        ok = detail::read(f, numArgs) && numArgs < 4096;
+        state.args.clear();
+        for (uint32_t k = 0; k < numArgs && ok; ++k) {
+            std::vector<char> arg;
+            ok = detail::readVector(f, arg, 1 << 16);
+            state.args.push_back(std::string(arg.begin(), arg.end()));
+        }
+        ok = ok && detail::read(f, state.mode) && detail::read(f, state.width) && detail::read(f, state.height) &&
+             detail::read(f, state.elapsedMs) && state.width > 0 && state.height > 0;
+        const uint64_t numPixels = ok ? uint64_t(state.width) * uint64_t(state.height) : 0;
+        if (ok && state.mode == Mode::Tiles) {
+            ok = detail::read(f, state.pixelFormat) && detail::readVector(f, state.pixels, 16 * numPixels) &&
+                 detail::readVector(f, state.done, numPixels) && detail::readVector(f, state.counts, numPixels) &&
+                 state.done.size() == numPixels && state.counts.size() == numPixels;
+        } else if (ok && state.mode == Mode::Progressive) {
+            ok = detail::read(f, state.passes) && detail::readVector(f, state.sums, 3 * numPixels) &&
+                 state.sums.size() == 3 * numPixels;
+        } else {
+            ok = false;
+        }
+        std::fclose(f);
+        if (!ok)
+            error = path + " is truncated or corrupt";
+        return ok;
+    }
+
+    /**
+     * Keeps the checkpoint of a tiled render up to date. `tileDone` is called by the workers as
+     * they finish tiles, and every `intervalMs` one of them stops to write the checkpoint. Only
+     * the finished pixel mask is copied under the lock: pixels of finished tiles are copied out
+     * of the framebuffer, which nobody writes anymore, and saved after it's released, so the
+     * others can go on rendering (and finishing tiles) meanwhile.
+     **/
+    class TileCheckpointer {
+        public:
+            TileCheckpointer(const std::string& p, double interval, State initial, const Image& image,
+                             const adaptive::SampleCounts& sampleCounts)
+                : path(p), intervalMs(interval), state(std::move(initial)), done(state.done), img(image),
+                  counts(sampleCounts), previousMs(state.elapsedMs), start(std::chrono::steady_clock::now()),
+                  lastWrite(start), writing(false) {}
+
+            void tileDone(const scheduler::Tile& tile) {
+                const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    for (int j = tile.y0; j < tile.y1; ++j)
+                        for (int i = tile.x0; i < tile.x1; ++i)
+                            done[img.index(i, j)] = 1;
+                    // one snapshot at a time, a worker finishing a tile while one is written skips its turn
+                    if (writing || std::chrono::duration<double, std::milli>(now - lastWrite).count() < intervalMs)
+                        return;
+                    writing = true;
+                    lastWrite = now;
+                    state.done = done;
+                }
+                write(now);
+                std::lock_guard<std::mutex> guard(lock);
+                writing = false;
+            }
+
+            // time spent rendering so far, this run and the ones before it
+            double elapsedMs(std::chrono::steady_clock::time_point now) const {
+                return previousMs + std::chrono::duration<double, std::milli>(now - start).count();
+            }
+
+        private:
+            // only the thread that set `writing` gets here, `state` is its own until it clears it
+            void write(std::chrono::steady_clock::time_point now) {
+                const size_t bytes = size_t(pixels::bytesPerPixel(img.format));
+                state.pixels.resize(img.data.size());
+                for (size_t k = 0; k < state.done.size(); ++k) {
+                    if (state.done[k]) {
+                        std::memcpy(&state.pixels[k * bytes], &img.data[k * bytes], bytes);
+                        state.counts[k] = counts[k];
+                    }
+                }
+                state.elapsedMs = elapsedMs(now);
+                std::string error;
+                if (!save(path, state, error))
+                    std::cerr << "Error writing checkpoint: " << error << std::endl;
+            }
+
+            std::string path;
+            double intervalMs;
+            State state;                // the snapshot being written
+            scheduler::PixelMask done;  // finished pixels, guarded by `lock`
+            const Image& img;
+            const adaptive::SampleCounts& counts;
+            double previousMs;  // spent by the runs this one resumes
+            std::chrono::steady_clock::time_point start, lastWrite;
+            bool writing;  // a worker is writing `state`
+            std::mutex lock;
+    };
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef ESTIMATORH
+#define ESTIMATORH
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "adaptive.h"
+#include "image.h"
+#include "rand.h"
+#include "thread_pool.h"
+#include "tracing.h"
+
+namespace estimator {
+
+    // random stream for picking the sample pixels, apart from the scene and per pixel streams
+    static const uint64_t SAMPLE_STREAM = 0xfffffffffffffffeULL;
+
+    // two sided 95% confidence, normal approximation (the sample is hundreds of pixels or more)
+    static const double Z_95 = 1.96;
+
+    /**
+     * Result of an estimate run. Times are in ms, the interval bounds are 95% confidence.
+     **/
+    struct Estimate {
+        size_t sampledPixels;
+        size_t remainingPixels;
+        double wallMs;         // how long the estimate itself took
+        double msPerPixel;     // mean cost of one pixel on one thread
+        double msPerPixelCI;   // half width of the interval on msPerPixel
+        double parallelism;    // pixel-ms traced per wall-ms, i.e. how many threads we really got
+        double etaMs;          // time to render the remaining pixels
+        double etaLowMs, etaHighMs;
+    };
+
+    /**
+     * Picks about `fraction` of the pixels, one at a random spot in each cell of a regular grid.
+     * Stratifying keeps every region of the image represented (a purely random pick can miss the
+     * glass sphere, which is where the time goes), while the jitter avoids lining up with the
+     * scene. The pick only depends on `seed`.
+     **/
+    std::vector<tracing::TracedPixel> stratifiedSample(int width, int height, float fraction, uint64_t seed) {
+        // clamped before it's an int: a tiny fraction is one cell over the whole image, not an overflow
+        const double side = std::min(double(std::max(width, height)), 1. / std::sqrt(double(fraction)));
+        const int cell = std::max(1, int(std::lround(side)));
+        pcg32 rng(mix64(seed), mix64(SAMPLE_STREAM));
+
+        std::vector<tracing::TracedPixel> pixels;
+        for (int y0 = 0; y0 < height; y0 += cell) {
+            for (int x0 = 0; x0 < width; x0 += cell) {
+                const int w = std::min(cell, width - x0);
+                const int h = std::min(cell, height - y0);
+                pixels.push_back(tracing::TracedPixel(x0 + int(rng.next() % w), y0 + int(rng.next() % h)));
+            }
+        }
+        return pixels;
+    }
+
+    /**
+     * Traces a stratified `config.estimate` fraction of the image on `numThreads` threads of the
+     * shared pool, straight into `img`, and marks those pixels in `done` so the render proper can
+     * skip them (and records their sample counts in `counts`, if given, for adaptive renders). Pixels
+     * are seeded by position, so the final image is the same whether or not it was estimated first.
+     *
+     * The cost of every sampled pixel is timed on its own, which gives the spread as well as the
+     * mean. The speedup from threading is measured rather than assumed: the sum of the per pixel
+     * times over the wall time of the run is the parallelism this machine actually delivered.
+     **/
+    Estimate run(const tracing::RayTracingConfig& config, Image& img, unsigned numThreads, std::vector<uint8_t>& done,
+                 adaptive::SampleCounts* counts = nullptr) {
+        using std::chrono::duration;
+        using std::chrono::high_resolution_clock;
+
+        const float fraction = std::min(1.f, config.estimate);
+        const std::vector<tracing::TracedPixel> sample =
+            stratifiedSample(config.width, config.height, fraction, config.seed);
+        std::vector<double> pixelMs(sample.size());
+
+        // pixels are handed out one at a time, they're far too few for tiles to balance well
+        std::atomic<size_t> next(0);
+        auto worker = [&](unsigned) {
+            for (size_t k = next++; k < sample.size(); k = next++) {
+                const tracing::TracedPixel& p = sample[k];
+                const high_resolution_clock::time_point start = high_resolution_clock::now();
+                unsigned int samples;
+                img.setPixel(tracing::trace(p.i, p.j, config, &samples), p.i, p.j);
+                pixelMs[k] = duration<double, std::milli>(high_resolution_clock::now() - start).count();
+                if (counts)
+                    (*counts)[img.index(p.i, p.j)] = samples;
+                done[img.index(p.i, p.j)] = 1;
+            }
+        };
+
+        const high_resolution_clock::time_point start = high_resolution_clock::now();
+        threading::ThreadPool::shared().run(numThreads, worker);
+        const double wallMs = duration<double, std::milli>(high_resolution_clock::now() - start).count();
+
+        // mean and sample variance of the per pixel cost
+        const double n = double(sample.size());
+        double sum = 0., squares = 0.;
+        for (double ms : pixelMs)
+            sum += ms;
+        const double mean = sum / n;
+        for (double ms : pixelMs)
+            squares += (ms - mean) * (ms - mean);
+        const double variance = sample.size() > 1 ? squares / (n - 1.) : 0.;
+
+        // we sampled without replacement out of a finite image, which narrows the interval
+        const double total = double(config.width) * config.height;
+        const double finiteCorrection = total > 1. ? std::sqrt(std::max(0., (total - n) / (total - 1.))) : 0.;
+
+        Estimate e;
+        e.sampledPixels = sample.size();
+        e.remainingPixels = size_t(total) - sample.size();
+        e.wallMs = wallMs;
+        e.msPerPixel = mean;
+        e.msPerPixelCI = Z_95 * std::sqrt(variance / n) * finiteCorrection;
+        e.parallelism = wallMs > 0. ? std::max(1., sum / wallMs) : 1.;
+        e.etaMs = e.remainingPixels * mean / e.parallelism;
+        e.etaLowMs = e.remainingPixels * std::max(0., mean - e.msPerPixelCI) / e.parallelism;
+        e.etaHighMs = e.remainingPixels * (mean + e.msPerPixelCI) / e.parallelism;
+        return e;
+    }
+}
+
+#endif
@@ -1,21 +1,56 @@
 #ifndef HITTABLEH
 #define HITTABLEH
 
-#include "ray.h"
+#include <cstdint>
 
-class material;
+#include "aabb.h"
+#include "packet.h"
+#include "ray.h"
 
 struct hit_record {
 	float t;
 	vec3 p;
 	vec3 normal;
-  material *mat_ptr;
+  uint32_t material_id;  // index into the scene's material_table
+};
+
+/**
+ * Closest hits of a ray_packet, one lane per ray
+ **/
+struct packet_hit {
+    alignas(32) float t[ray_packet::MAX_WIDTH];  // closest hit so far, starts out as t_max
+    hit_record rec[ray_packet::MAX_WIDTH];
+    int mask;  // bit set for every lane that hit something
+
+    inline void reset(float t_max) {
+        for (int lane = 0; lane < ray_packet::MAX_WIDTH; ++lane)
+            t[lane] = t_max;
+        mask = 0;
+    }
+    inline bool hit(int lane) const { return (mask >> lane) & 1; }
 };
 
 class hittable  {
     public:
         virtual bool hit(
             const ray& r, float t_min, float t_max, hit_record& rec) const = 0;
+        // any hit inside (t_min, t_max), for shadow and occlusion rays. Stops at the first intersection
+        // found and computes none of the hit attributes. Objects that don't override it fall back on `hit`
+        virtual bool occluded(const ray& r, float t_min, float t_max) const {
+            hit_record rec;
+            return hit(r, t_min, t_max, rec);
+        }
+        // box enclosing the whole object, so acceleration structures can group it with its neighbours
+        virtual bool bounding_box(aabb& box) const = 0;
+        // closest hit for every ray of the packet. Objects without a SIMD kernel trace the lanes one by one
+        virtual void hitPacket(const ray_packet& p, float t_min, packet_hit& hits) const {
+            for (int lane = 0; lane < p.width; ++lane) {
+                if (hit(p.get(lane), t_min, hits.t[lane], hits.rec[lane])) {
+                    hits.t[lane] = hits.rec[lane].t;
+                    hits.mask |= 1 << lane;
+                }
+            }
+        }
         virtual ~hittable() = default; // so it's default construct-able
 };
 
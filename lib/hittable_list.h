@@ -9,6 +9,9 @@ class hittable_list: public hittable {
         hittable_list(std::vector<std::unique_ptr<hittable>> l) : list(std::move(l)) {}
         virtual bool hit(
             const ray& r, float tmin, float tmax, hit_record& rec) const;
+        virtual bool occluded(const ray& r, float t_min, float t_max) const;
+        virtual bool bounding_box(aabb& box) const;
+        virtual void hitPacket(const ray_packet& p, float t_min, packet_hit& hits) const;
         std::vector<std::unique_ptr<hittable>> list;
 };
 
@@ -34,4 +37,29 @@ bool hittable_list::hit(const ray& r, float t_min, float t_max,
     return false;
 }
 
+bool hittable_list::occluded(const ray& r, float t_min, float t_max) const {
+    for (const auto& item: list) {
+        if (item->occluded(r, t_min, t_max))
+            return true;
+    }
+    return false;
+}
+
+void hittable_list::hitPacket(const ray_packet& p, float t_min, packet_hit& hits) const {
+    for (const auto& item: list) {
+        item->hitPacket(p, t_min, hits);
+    }
+}
+
+bool hittable_list::bounding_box(aabb& box) const {
+    box = aabb();
+    for (const auto& item: list) {
+        aabb itemBox;
+        if (!item->bounding_box(itemBox))
+            return false;
+        box.grow(itemBox);
+    }
+    return !list.empty();
+}
+
 #endif
\ No newline at end of file
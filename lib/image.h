@@ -1,47 +1,266 @@
+#ifndef IMAGEH
+#define IMAGEH
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <string>
+#include <vector>
 
+#include "thread_pool.h"
 #include "vec3.h"
 
+// P3 is plain text ("255 0 12\n" per pixel), P6 is the same header followed by raw RGB bytes
+enum class ImageFormat { P3, P6 };
+
+/**
+ * How the framebuffer stores its pixels:
+ *
+ *  - RGB8:    final display values (gamma corrected, 0-255), 3 bytes per pixel. The default: a
+ *             quarter of the memory of a vec3 per pixel, and exactly the bytes that go in the PPM.
+ *  - RGB32F:  linear radiance as floats, 12 bytes per pixel. Full precision, for accumulating
+ *             samples over several passes.
+ *  - RGBA16F: linear radiance as half floats, 8 bytes per pixel. Keeps the HDR values at two
+ *             thirds of the size of RGB32F.
+ **/
+enum class PixelFormat { RGB8, RGB32F, RGBA16F };
+
+namespace pixels {
+
+    inline int bytesPerPixel(PixelFormat format) {
+        switch (format) {
+            case PixelFormat::RGB32F: return 12;
+            case PixelFormat::RGBA16F: return 8;
+            default: return 3;
+        }
+    }
+
+    /**
+     * Linear radiance to a display byte: gamma 2, then quantize
+     **/
+    inline uint8_t toDisplay(float linear) {
+        if (!(linear > 0.))
+            return 0;
+        int v = int(sqrt(linear) * 255.99);
+        return uint8_t(v > 255 ? 255 : v);
+    }
+
+    inline float fromDisplay(uint8_t display) {
+        float v = (display + 0.5) / 256.;
+        return v * v;
+    }
+
+    /**
+     * IEEE 754 binary16 conversion, rounding to nearest even
+     **/
+    inline uint16_t toHalf(float f) {
+        uint32_t x;
+        std::memcpy(&x, &f, sizeof(x));
+        const uint32_t sign = (x >> 16) & 0x8000;
+        const uint32_t mantissa = x & 0x007fffff;
+        const int exponent = int((x >> 23) & 0xff) - 127 + 15;
+
+        if (((x >> 23) & 0xff) == 0xff)  // inf and NaN
+            return uint16_t(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+        if (exponent >= 0x1f)  // too big for a half, becomes inf
+            return uint16_t(sign | 0x7c00);
+        if (exponent <= 0) {
+            // subnormal half (or zero)
+            if (exponent < -10)
+                return uint16_t(sign);
+            const uint32_t m = mantissa | 0x00800000;
+            const int shift = 14 - exponent;
+            uint32_t half = m >> shift;
+            const uint32_t rest = m & ((1u << shift) - 1);
+            const uint32_t halfway = 1u << (shift - 1);
+            if (rest > halfway || (rest == halfway && (half & 1)))
+                half++;
+            return uint16_t(sign | half);
+        }
+
+        uint32_t half = sign | (uint32_t(exponent) << 10) | (mantissa >> 13);
+        const uint32_t rest = mantissa & 0x1fff;
+        if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+            half++;  // may carry into the exponent, which is still the right answer
+        return uint16_t(half);
+    }
+
+    inline float fromHalf(uint16_t h) {
+        const uint32_t sign = uint32_t(h & 0x8000) << 16;
+        const uint32_t exponent = (h >> 10) & 0x1f;
+        uint32_t mantissa = h & 0x3ff;
+        uint32_t x;
+
+        if (exponent == 0x1f) {
+            x = sign | 0x7f800000 | (mantissa << 13);
+        } else if (exponent != 0) {
+            x = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+        } else if (mantissa == 0) {
+            x = sign;
+        } else {
+            // subnormal half, normalize it for the float
+            int e = -1;
+            do {
+                e++;
+                mantissa <<= 1;
+            } while ((mantissa & 0x400) == 0);
+            x = sign | (uint32_t(127 - 15 - e) << 23) | ((mantissa & 0x3ff) << 13);
+        }
+
+        float f;
+        std::memcpy(&f, &x, sizeof(f));
+        return f;
+    }
+}
+
+/**
+ * Framebuffer. Pixels are set as linear radiance (what `tracing::trace` returns) and stored
+ * in `format`, row by row starting from the bottom row (j = 0).
+ **/
 class Image {
     public:
-        Image(int h, int w) : pixels(h * w), height(h), width(w) {}
+        Image(int h, int w, PixelFormat f = PixelFormat::RGB8)
+            : data(size_t(h) * w * pixels::bytesPerPixel(f)), height(h), width(w), format(f) {}
 
-        const vec3& getPixel(int i, int j) const;
+        vec3 getPixel(int i, int j) const;
         void setPixel(const vec3& p, int i, int j);
-        bool writeToFile(std::string filepath) const;
+        // the conversion to display bytes and the text encoding are split over `numThreads` threads
+        bool writeToFile(std::string filepath, ImageFormat format = ImageFormat::P3, unsigned numThreads = 1) const;
 
-        std::vector<vec3> pixels;
-        int height; 
+        // PPM header, also used by ImageStream to know where the pixel data starts
+        std::string header(ImageFormat format) const;
+        // packs pixels [x0, x1) of row j as display RGB bytes into `out`
+        void packRow(int j, int x0, int x1, unsigned char* out) const;
+
+        inline size_t index(int i, int j) const { return size_t(j) * width + i; }
+
+        std::vector<uint8_t> data;
+        int height;
         int width;
+        PixelFormat format;
 };
 
-inline const vec3& Image::getPixel(int i, int j) const {
-    return pixels[height * i + j];
+inline vec3 Image::getPixel(int i, int j) const {
+    const size_t k = index(i, j);
+    switch (format) {
+        case PixelFormat::RGB32F: {
+            const float* f = reinterpret_cast<const float*>(data.data()) + 3 * k;
+            return vec3(f[0], f[1], f[2]);
+        }
+        case PixelFormat::RGBA16F: {
+            const uint16_t* h = reinterpret_cast<const uint16_t*>(data.data()) + 4 * k;
+            return vec3(pixels::fromHalf(h[0]), pixels::fromHalf(h[1]), pixels::fromHalf(h[2]));
+        }
+        default: {
+            const uint8_t* b = data.data() + 3 * k;
+            return vec3(pixels::fromDisplay(b[0]), pixels::fromDisplay(b[1]), pixels::fromDisplay(b[2]));
+        }
+    }
 }
 
 inline void Image::setPixel(const vec3& p, int i, int j) {
-    pixels[height * i + j] = p;
+    const size_t k = index(i, j);
+    switch (format) {
+        case PixelFormat::RGB32F: {
+            float* f = reinterpret_cast<float*>(data.data()) + 3 * k;
+            f[0] = p[0];
+            f[1] = p[1];
+            f[2] = p[2];
+            break;
+        }
+        case PixelFormat::RGBA16F: {
+            uint16_t* h = reinterpret_cast<uint16_t*>(data.data()) + 4 * k;
+            h[0] = pixels::toHalf(p[0]);
+            h[1] = pixels::toHalf(p[1]);
+            h[2] = pixels::toHalf(p[2]);
+            h[3] = pixels::toHalf(1.);
+            break;
+        }
+        default: {
+            uint8_t* b = data.data() + 3 * k;
+            b[0] = pixels::toDisplay(p[0]);
+            b[1] = pixels::toDisplay(p[1]);
+            b[2] = pixels::toDisplay(p[2]);
+        }
+    }
 }
 
-inline bool Image::writeToFile(std::string filepath) const {
-    // open up file to write
-    std::ofstream f(filepath);
-    if (!f.is_open()) {
-        return false;
+inline std::string Image::header(ImageFormat format) const {
+    return std::string(format == ImageFormat::P6 ? "P6" : "P3") + "\n" + std::to_string(width) + " " +
+           std::to_string(height) + "\n255\n";
+}
+
+inline void Image::packRow(int j, int x0, int x1, unsigned char* out) const {
+    if (format == PixelFormat::RGB8) {
+        // already display bytes
+        std::memcpy(out, data.data() + 3 * index(x0, j), size_t(x1 - x0) * 3);
+        return;
+    }
+    for (int i = x0; i < x1; i++) {
+        const vec3 pixel = getPixel(i, j);
+        *out++ = pixels::toDisplay(pixel.r());
+        *out++ = pixels::toDisplay(pixel.g());
+        *out++ = pixels::toDisplay(pixel.b());
     }
+}
+
+inline bool Image::writeToFile(std::string filepath, ImageFormat format, unsigned numThreads) const {
+    // rows below this many per thread aren't worth handing out
+    static const size_t MIN_ROWS = 16;
 
-    // header for PPM file
-    f << "P3\n" << width << " " << height << "\n255\n";
+    // convert the whole frame to display bytes in one pass, top row first
+    const std::string head = header(format);
+    std::vector<unsigned char> buffer(head.size() + size_t(width) * height * 3);
+    std::copy(head.begin(), head.end(), buffer.begin());
+    unsigned char* const rows = buffer.data() + head.size();
+    const size_t rowBytes = size_t(width) * 3;
+    threading::parallelChunks(
+        numThreads, size_t(height),
+        [&](size_t begin, size_t end, unsigned) {
+            for (size_t row = begin; row < end; ++row)
+                packRow(height - 1 - int(row), 0, width, rows + row * rowBytes);
+        },
+        MIN_ROWS);
 
-    // write pixels
-    for (int j = height - 1; j >= 0; j--) {
-        for (unsigned int i = 0; i < width; i++) {
-            const vec3& pixel = getPixel(i, j);
-            f << pixel.r() << " " << pixel.g() << " " << pixel.b() << "\n";
+    if (format == ImageFormat::P6) {
+        // and hand it to the OS in a single write
+        std::FILE* f = std::fopen(filepath.c_str(), "wb");
+        if (!f) {
+            return false;
         }
+        bool ok = std::fwrite(buffer.data(), 1, buffer.size(), f) == buffer.size();
+        return std::fclose(f) == 0 && ok;
     }
 
-    // close file
-    f.close();
-    return true;
-}
\ No newline at end of file
+    // text: every thread formats the pixels of its rows ("r g b\n" each), pieces written in order
+    std::vector<std::string> pieces(std::max(1u, numThreads));
+    threading::parallelChunks(
+        numThreads, size_t(height),
+        [&](size_t begin, size_t end, unsigned t) {
+            std::string& text = pieces[t];
+            text.reserve((end - begin) * width * 12);
+            for (const unsigned char* b = rows + begin * rowBytes; b < rows + end * rowBytes; ++b) {
+                const unsigned v = *b;
+                if (v >= 100)
+                    text += char('0' + v / 100);
+                if (v >= 10)
+                    text += char('0' + v / 10 % 10);
+                text += char('0' + v % 10);
+                text += (b - rows) % 3 == 2 ? '\n' : ' ';
+            }
+        },
+        MIN_ROWS);
+
+    std::FILE* f = std::fopen(filepath.c_str(), "w");
+    if (!f) {
+        return false;
+    }
+    bool ok = std::fputs(head.c_str(), f) >= 0;
+    for (const std::string& text : pieces)
+        ok = ok && std::fwrite(text.data(), 1, text.size(), f) == text.size();
+    return std::fclose(f) == 0 && ok;
+}
+
+#endif
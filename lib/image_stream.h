@@ -0,0 +1,87 @@
+#ifndef IMAGESTREAMH
+#define IMAGESTREAMH
+
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "image.h"
+
+/**
+ * Writes a binary (P6) PPM while the image is still rendering.
+ *
+ * Every P6 pixel takes exactly 3 bytes, so we know where each pixel goes in the file before it is
+ * traced. `open` writes the header and sizes the file, then every finished tile is written
+ * straight to its place, in whatever order tiles finish. If a render gets killed, the file still
+ * holds everything done so far (unfinished pixels are black).
+ **/
+class ImageStream {
+    public:
+        ImageStream() : file(nullptr), dataStart(0), failed(false) {}
+        ~ImageStream() { close(); }
+
+        bool open(const std::string& filepath, const Image& img);
+        // write pixels [x0, x1) x [y0, y1) of `img`. Safe to call from several threads
+        bool writeRegion(const Image& img, int x0, int y0, int x1, int y1);
+        // false if the file didn't close, or if any write since `open` failed
+        bool close();
+
+    private:
+        std::FILE* file;
+        long dataStart;
+        bool failed;  // a region didn't make it to the file, tiles of it are still black
+        std::mutex lock;
+};
+
+inline bool ImageStream::open(const std::string& filepath, const Image& img) {
+    failed = false;
+    file = std::fopen(filepath.c_str(), "wb");
+    if (!file)
+        return false;
+
+    const std::string head = img.header(ImageFormat::P6);
+    dataStart = long(head.size());
+    bool ok = std::fwrite(head.data(), 1, head.size(), file) == head.size();
+
+    // reserve the full size up front: black until traced
+    const std::vector<unsigned char> row(size_t(img.width) * 3, 0);
+    for (int j = 0; j < img.height && ok; ++j)
+        ok = std::fwrite(row.data(), 1, row.size(), file) == row.size();
+    return ok && std::fflush(file) == 0;
+}
+
+inline bool ImageStream::writeRegion(const Image& img, int x0, int y0, int x1, int y1) {
+    // pack outside the lock, only the seeks and writes need to be serialized
+    const size_t rowBytes = size_t(x1 - x0) * 3;
+    std::vector<unsigned char> bytes(rowBytes * (y1 - y0));
+    for (int j = y0; j < y1; ++j)
+        img.packRow(j, x0, x1, &bytes[rowBytes * (j - y0)]);
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (!file)
+        return false;
+
+    bool ok = true;
+    for (int j = y0; j < y1 && ok; ++j) {
+        // the file is written top row first, our rows count up from the bottom
+        const long row = img.height - 1 - j;
+        const long offset = dataStart + (row * img.width + x0) * 3;
+        ok = std::fseek(file, offset, SEEK_SET) == 0 &&
+             std::fwrite(&bytes[rowBytes * (j - y0)], 1, rowBytes, file) == rowBytes;
+    }
+    ok = ok && std::fflush(file) == 0;
+    failed = failed || !ok;
+    return ok;
+}
+
+inline bool ImageStream::close() {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!file)
+        return !failed;
+    bool ok = std::fclose(file) == 0 && !failed;
+    file = nullptr;
+    return ok;
+}
+
+#endif
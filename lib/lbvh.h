@@ -0,0 +1,489 @@
+#ifndef LBVHH
+#define LBVHH
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "aabb.h"
+#include "bvh_builder.h"
+#include "thread_pool.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace lbvh {
+
+    inline int countLeadingZeros(uint32_t x) {
+#if defined(_MSC_VER)
+        unsigned long index;
+        return _BitScanReverse(&index, x) ? 31 - int(index) : 32;
+#else
+        return x == 0 ? 32 : __builtin_clz(x);
+#endif
+    }
+
+    // spreads the low 10 bits of x out to every third bit
+    inline uint32_t expandBits(uint32_t x) {
+        x = (x | (x << 16)) & 0x030000ff;
+        x = (x | (x << 8)) & 0x0300f00f;
+        x = (x | (x << 4)) & 0x030c30c3;
+        x = (x | (x << 2)) & 0x09249249;
+        return x;
+    }
+
+    /**
+     * 30 bit Morton code of a point given in [0, 1]^3: x, y and z bits interleaved (x highest), so
+     * sorting by code lays the points out along a Z-order curve
+     **/
+    inline uint32_t morton3(float x, float y, float z) {
+        auto quantize = [](float v) { return uint32_t(std::min(std::max(v * 1024.f, 0.f), 1023.f)); };
+        return (expandBits(quantize(x)) << 2) | (expandBits(quantize(y)) << 1) | expandBits(quantize(z));
+    }
+
+    /**
+     * Buffers of `radixSort`, kept by callers that sort again and again so they're allocated once
+     **/
+    struct RadixScratch {
+        std::vector<uint32_t> keys;
+        std::vector<int> values;
+        std::vector<size_t> offsets;
+    };
+
+    /**
+     * Stable LSD radix sort of `keys` (30 bit codes) carrying `values` along, 10 bits per pass.
+     *
+     * Each pass every thread histograms its own chunk; an exclusive scan over (digit, thread) gives
+     * every thread its own write position per digit, so the scatters run in parallel without any
+     * atomics and the order within a digit stays the input order. A pass whose digit is the same
+     * for every key wouldn't move anything and skips the scatter.
+     **/
+    void radixSort(std::vector<uint32_t>& keys, std::vector<int>& values, unsigned numThreads, RadixScratch& scratch) {
+        static const int BITS = 10;
+        static const int BUCKETS = 1 << BITS;
+        const size_t n = keys.size();
+        scratch.keys.resize(n);
+        scratch.values.resize(n);
+        scratch.offsets.resize(size_t(numThreads) * BUCKETS);
+        std::vector<size_t>& offsets = scratch.offsets;
+
+        for (int shift = 0; shift < 30; shift += BITS) {
+            std::fill(offsets.begin(), offsets.end(), 0);
+            threading::parallelChunks(numThreads, n, [&](size_t begin, size_t end, unsigned t) {
+                size_t* histogram = &offsets[size_t(t) * BUCKETS];
+                for (size_t i = begin; i < end; ++i)
+                    histogram[(keys[i] >> shift) & (BUCKETS - 1)]++;
+            });
+
+            size_t sum = 0;
+            bool oneDigit = false;
+            for (int digit = 0; digit < BUCKETS; ++digit) {
+                const size_t start = sum;
+                for (unsigned t = 0; t < numThreads; ++t) {
+                    size_t count = offsets[size_t(t) * BUCKETS + digit];
+                    offsets[size_t(t) * BUCKETS + digit] = sum;
+                    sum += count;
+                }
+                oneDigit = oneDigit || sum - start == n;
+            }
+            if (oneDigit)
+                continue;
+
+            threading::parallelChunks(numThreads, n, [&](size_t begin, size_t end, unsigned t) {
+                size_t* next = &offsets[size_t(t) * BUCKETS];
+                for (size_t i = begin; i < end; ++i) {
+                    size_t to = next[(keys[i] >> shift) & (BUCKETS - 1)]++;
+                    scratch.keys[to] = keys[i];
+                    scratch.values[to] = values[i];
+                }
+            });
+            keys.swap(scratch.keys);
+            values.swap(scratch.values);
+        }
+    }
+
+    inline void radixSort(std::vector<uint32_t>& keys, std::vector<int>& values, unsigned numThreads) {
+        RadixScratch scratch;
+        radixSort(keys, values, numThreads, scratch);
+    }
+}
+
+/**
+ * Linear BVH builder (Karras, "Maximizing Parallelism in the Construction of BVHs, Octrees, and
+ * k-d Trees", 2012). Fills in the same `nodes` / `order` as `bvh_builder`, so anything built on
+ * top of a BVH can use either.
+ *
+ * Primitives are sorted by the Morton code of their centroid, which makes the tree implicit: the
+ * internal node splitting a range of codes sits where the highest differing bit flips. Every
+ * internal node finds its own range and split from the sorted codes alone, so all of them are
+ * built in parallel; bounds then flow up from the leaves, each internal node finished by whichever
+ * of its children's threads arrives second. Last, the tree is written out in `bvh_node`'s depth
+ * first layout, with independent subtrees written in parallel.
+ *
+ * The whole build is a few linear passes, far faster than SAH binning on million primitive
+ * meshes, but splits at Morton boundaries rather than where SAH would put them. With `refineTop`
+ * (HLBVH, Pantaleoni & Luebke 2010) the tree is cut into clusters of small subtrees and the levels
+ * above them are rebuilt with the SAH builder, where a good split matters the most for the cost
+ * of only a few thousand primitives' worth of binning.
+ *
+ * Codes are 30 bits and identical codes are split by index, so the tree is at most
+ * 30 + log2(primitives) deep, less the levels folded into leaves: inside bvh_builder::MAX_DEPTH.
+ **/
+class lbvh_builder {
+    public:
+        // clusters the SAH refinement works on, the top of the tree is built over about this many boxes
+        static const int TOP_CLUSTERS = 4096;
+
+        lbvh_builder(const std::vector<aabb>& b, int leafSize, bool refine = false,
+                     unsigned threads = threading::defaultThreads())
+            : boxes(b), maxLeafSize(std::max(1, leafSize)), refineTop(refine), numThreads(threads) {}
+
+        void build(std::vector<bvh_node>& nodes, std::vector<int>& order);
+
+    private:
+        // node references: internal nodes are >= 0, leaf i (one sorted primitive) is ~i
+        static inline bool isInternal(int ref) { return ref >= 0; }
+
+        int delta(int i, int j) const;
+        void buildInternal(int i);
+        void computeBounds();
+        inline int primitiveCount(int ref) const { return isInternal(ref) ? last[ref] - first[ref] + 1 : 1; }
+        inline bool emittedAsLeaf(int ref) const { return primitiveCount(ref) <= maxLeafSize; }
+        inline const aabb& boundsOf(int ref) const { return isInternal(ref) ? bounds[ref] : boxes[sorted[~ref]]; }
+        int splitAxis(int ref) const;
+
+        void cut(int ref, int maxPrimitives, std::vector<int>& clusters) const;
+        int emitAbove(int ref, int outIndex, int maxPrimitives);
+        void emitSubtree(int ref, int outIndex, int shift) const;
+        void emitRefined(const std::vector<int>& clusters, std::vector<int>& order);
+
+        const std::vector<aabb>& boxes;
+        int maxLeafSize;
+        bool refineTop;
+        unsigned numThreads;
+
+        std::vector<uint32_t> codes;  // sorted
+        std::vector<int> sorted;      // primitive of each sorted position
+        int numPrimitives;
+
+        // per internal node
+        std::vector<int> left, right, first, last, nodeCount;
+        std::vector<aabb> bounds;
+        std::vector<int> parentOfInternal, parentOfLeaf;
+
+        // subtrees left to write once the top is placed: (node reference, output index, primitive shift)
+        struct task {
+            int ref, out, shift;
+        };
+        std::vector<task> tasks;
+        std::vector<bvh_node>* out;
+};
+
+/**
+ * Length of the common prefix of the codes at sorted positions i and j, -1 outside the array.
+ * Equal codes fall back to comparing the positions, so every code is unique as far as the tree
+ * is concerned and duplicates get split evenly.
+ **/
+inline int lbvh_builder::delta(int i, int j) const {
+    if (j < 0 || j >= numPrimitives)
+        return -1;
+    if (codes[i] == codes[j])
+        return 32 + lbvh::countLeadingZeros(uint32_t(i) ^ uint32_t(j));
+    return lbvh::countLeadingZeros(codes[i] ^ codes[j]);
+}
+
+/**
+ * Finds the range of sorted primitives internal node `i` covers and where it splits, Karras' algorithm 4
+ **/
+void lbvh_builder::buildInternal(int i) {
+    // direction of the range: towards the neighbour we share the longer prefix with
+    const int d = delta(i, i + 1) - delta(i, i - 1) >= 0 ? 1 : -1;
+    const int deltaMin = delta(i, i - d);
+
+    // exponential then binary search for the other end of the range
+    int lengthMax = 2;
+    while (delta(i, i + lengthMax * d) > deltaMin)
+        lengthMax *= 2;
+    int length = 0;
+    for (int t = lengthMax / 2; t >= 1; t /= 2) {
+        if (delta(i, i + (length + t) * d) > deltaMin)
+            length += t;
+    }
+    const int j = i + length * d;
+
+    // binary search for the split: the last position sharing more than the node's prefix with i
+    const int deltaNode = delta(i, j);
+    int split = 0;
+    int t = length;
+    do {
+        t = (t + 1) / 2;
+        if (delta(i, i + (split + t) * d) > deltaNode)
+            split += t;
+    } while (t > 1);
+    const int gamma = i + split * d + std::min(d, 0);
+
+    first[i] = std::min(i, j);
+    last[i] = std::max(i, j);
+    left[i] = first[i] == gamma ? ~gamma : gamma;
+    right[i] = last[i] == gamma + 1 ? ~(gamma + 1) : gamma + 1;
+
+    if (isInternal(left[i]))
+        parentOfInternal[left[i]] = i;
+    else
+        parentOfLeaf[~left[i]] = i;
+    if (isInternal(right[i]))
+        parentOfInternal[right[i]] = i;
+    else
+        parentOfLeaf[~right[i]] = i;
+}
+
+/**
+ * Bounds and output sizes, from the leaves up. Every leaf's thread walks towards the root and
+ * stops at the first node whose other child isn't done yet; that child's thread finishes it.
+ **/
+void lbvh_builder::computeBounds() {
+    std::vector<std::atomic<int>> arrivals(numPrimitives - 1);
+    for (auto& a : arrivals)
+        a.store(0, std::memory_order_relaxed);
+
+    threading::parallelChunks(numThreads, size_t(numPrimitives), [&](size_t begin, size_t end, unsigned) {
+        for (size_t leaf = begin; leaf < end; ++leaf) {
+            int node = parentOfLeaf[leaf];
+            while (node >= 0) {
+                // acq_rel: the second arrival sees everything the first wrote for its child
+                if (arrivals[node].fetch_add(1, std::memory_order_acq_rel) == 0)
+                    break;
+
+                aabb box = boundsOf(left[node]);
+                box.grow(boundsOf(right[node]));
+                bounds[node] = box;
+                auto sizeOf = [&](int ref) { return emittedAsLeaf(ref) ? 1 : nodeCount[ref]; };
+                nodeCount[node] = 1 + sizeOf(left[node]) + sizeOf(right[node]);
+                node = parentOfInternal[node];
+            }
+        }
+    });
+}
+
+/**
+ * Axis of the highest bit the node's two halves differ in, which is the axis the Morton curve
+ * split along. Used for the near child first order during traversal.
+ **/
+int lbvh_builder::splitAxis(int ref) const {
+    const uint32_t differ = codes[first[ref]] ^ codes[last[ref]];
+    if (differ == 0)
+        return bounds[ref].longestAxis();  // duplicate codes, split by position
+    const int bit = 31 - lbvh::countLeadingZeros(differ);
+    return 2 - bit % 3;
+}
+
+/**
+ * Collects the topmost subtrees under `ref` with at most `maxPrimitives` primitives, left to right
+ **/
+void lbvh_builder::cut(int ref, int maxPrimitives, std::vector<int>& clusters) const {
+    if (primitiveCount(ref) <= maxPrimitives || emittedAsLeaf(ref)) {
+        clusters.push_back(ref);
+        return;
+    }
+    cut(left[ref], maxPrimitives, clusters);
+    cut(right[ref], maxPrimitives, clusters);
+}
+
+/**
+ * Writes the nodes of subtree `ref` starting at `out` into the depth first layout. Leaf offsets are
+ * positions in the sorted order moved by `shift`, for subtrees that end up elsewhere in `order`.
+ **/
+void lbvh_builder::emitSubtree(int ref, int outIndex, int shift) const {
+    std::vector<bvh_node>& nodes = *out;
+    while (true) {
+        bvh_node& node = nodes[outIndex];
+        node.bounds = boundsOf(ref);
+        if (emittedAsLeaf(ref)) {
+            node.offset = (isInternal(ref) ? first[ref] : ~ref) + shift;
+            node.count = primitiveCount(ref);
+            node.axis = 0;
+            return;
+        }
+        node.count = 0;
+        node.axis = splitAxis(ref);
+        const int leftSize = emittedAsLeaf(left[ref]) ? 1 : nodeCount[left[ref]];
+        node.offset = outIndex + 1 + leftSize;
+        emitSubtree(left[ref], outIndex + 1, shift);
+        // loop on the right child instead of recursing, the depth then only grows with left turns
+        ref = right[ref];
+        outIndex = node.offset;
+    }
+}
+
+/**
+ * Writes the nodes above the cut (subtrees of more than `maxPrimitives`) and queues the ones
+ * below it as tasks. Returns the number of nodes the subtree at `ref` takes.
+ **/
+int lbvh_builder::emitAbove(int ref, int outIndex, int maxPrimitives) {
+    const int size = emittedAsLeaf(ref) ? 1 : nodeCount[ref];
+    if (primitiveCount(ref) <= maxPrimitives || emittedAsLeaf(ref)) {
+        tasks.push_back(task{ref, outIndex, 0});
+        return size;
+    }
+    bvh_node& node = (*out)[outIndex];
+    node.bounds = bounds[ref];
+    node.count = 0;
+    node.axis = splitAxis(ref);
+    const int leftSize = emitAbove(left[ref], outIndex + 1, maxPrimitives);
+    (*out)[outIndex].offset = outIndex + 1 + leftSize;
+    emitAbove(right[ref], outIndex + 1 + leftSize, maxPrimitives);
+    return size;
+}
+
+/**
+ * HLBVH: the levels above the clusters are rebuilt with the SAH builder over the clusters' boxes,
+ * then each cluster's subtree is hung under the SAH leaf it landed in. Clusters move around, so
+ * their primitives are renumbered to keep every leaf a contiguous run of `order`.
+ **/
+void lbvh_builder::emitRefined(const std::vector<int>& clusters, std::vector<int>& order) {
+    std::vector<aabb> clusterBoxes(clusters.size());
+    for (size_t c = 0; c < clusters.size(); ++c)
+        clusterBoxes[c] = boundsOf(clusters[c]);
+
+    std::vector<bvh_node> top;
+    std::vector<int> clusterOrder;
+    bvh_builder(clusterBoxes, 1).build(top, clusterOrder);
+
+    auto clusterSize = [&](int c) { return emittedAsLeaf(clusters[c]) ? 1 : nodeCount[clusters[c]]; };
+    auto clusterFirst = [&](int c) { return isInternal(clusters[c]) ? first[clusters[c]] : ~clusters[c]; };
+
+    // output size: interior SAH nodes, a chain node for every extra cluster in a SAH leaf (only
+    // when the builder hit its depth limit) and the clusters themselves
+    size_t total = 0;
+    for (const bvh_node& t : top)
+        total += t.isLeaf() ? size_t(t.count - 1) : 1;
+    for (size_t c = 0; c < clusters.size(); ++c)
+        total += clusterSize(int(c));
+    out->resize(total);
+
+    std::vector<bvh_node>& nodes = *out;
+    int primitiveBase = 0;
+    order.resize(sorted.size());
+
+    // writes top node `t` at `outIndex` and returns the number of nodes its subtree takes
+    std::function<int(int, int)> placeTop = [&](int t, int outIndex) -> int {
+        const bvh_node& topNode = top[t];
+        if (topNode.isLeaf()) {
+            int written = 0;
+            for (int k = 0; k < topNode.count; ++k) {
+                const int c = clusterOrder[topNode.offset + k];
+                const bool chained = k + 1 < topNode.count;
+                if (chained) {
+                    // interior node holding this cluster on the left and the rest of the leaf on the right
+                    aabb rest;
+                    for (int m = k; m < topNode.count; ++m)
+                        rest.grow(clusterBoxes[clusterOrder[topNode.offset + m]]);
+                    nodes[outIndex + written].bounds = rest;
+                    nodes[outIndex + written].count = 0;
+                    nodes[outIndex + written].axis = rest.longestAxis();
+                    nodes[outIndex + written].offset = outIndex + written + 1 + clusterSize(c);
+                    written++;
+                }
+                const int from = clusterFirst(c);
+                const int n = primitiveCount(clusters[c]);
+                std::copy(sorted.begin() + from, sorted.begin() + from + n, order.begin() + primitiveBase);
+                tasks.push_back(task{clusters[c], outIndex + written, primitiveBase - from});
+                primitiveBase += n;
+                written += clusterSize(c);
+            }
+            return written;
+        }
+        nodes[outIndex].bounds = topNode.bounds;
+        nodes[outIndex].count = 0;
+        nodes[outIndex].axis = topNode.axis;
+        const int leftSize = placeTop(t + 1, outIndex + 1);
+        nodes[outIndex].offset = outIndex + 1 + leftSize;
+        return 1 + leftSize + placeTop(topNode.offset, outIndex + 1 + leftSize);
+    };
+    placeTop(0, 0);
+}
+
+void lbvh_builder::build(std::vector<bvh_node>& nodes, std::vector<int>& order) {
+    out = &nodes;
+    nodes.clear();
+    order.clear();
+    tasks.clear();
+    numPrimitives = int(boxes.size());
+    if (numPrimitives == 0)
+        return;
+
+    // Morton codes of the centroids, relative to the centroids' bounds
+    aabb centroidBounds;
+    for (const aabb& box : boxes)
+        centroidBounds.grow(box.centroid());
+    const vec3 extent = centroidBounds.extent();
+    const vec3 scale(extent.x() > 0 ? 1. / extent.x() : 0., extent.y() > 0 ? 1. / extent.y() : 0.,
+                     extent.z() > 0 ? 1. / extent.z() : 0.);
+
+    codes.resize(numPrimitives);
+    sorted.resize(numPrimitives);
+    threading::parallelChunks(numThreads, size_t(numPrimitives), [&](size_t begin, size_t end, unsigned) {
+        for (size_t i = begin; i < end; ++i) {
+            const vec3 p = (boxes[i].centroid() - centroidBounds.pmin) * scale;
+            codes[i] = lbvh::morton3(p.x(), p.y(), p.z());
+            sorted[i] = int(i);
+        }
+    });
+    lbvh::radixSort(codes, sorted, numThreads);
+
+    if (numPrimitives == 1) {
+        nodes.resize(1);
+        nodes[0].bounds = boxes[0];
+        nodes[0].offset = 0;
+        nodes[0].count = 1;
+        nodes[0].axis = 0;
+        order = sorted;
+        return;
+    }
+
+    // every internal node independently
+    const int numInternal = numPrimitives - 1;
+    left.resize(numInternal);
+    right.resize(numInternal);
+    first.resize(numInternal);
+    last.resize(numInternal);
+    nodeCount.resize(numInternal);
+    bounds.resize(numInternal);
+    parentOfInternal.resize(numInternal);
+    parentOfLeaf.resize(numPrimitives);
+    parentOfInternal[0] = -1;
+    threading::parallelChunks(numThreads, size_t(numInternal), [&](size_t begin, size_t end, unsigned) {
+        for (size_t i = begin; i < end; ++i)
+            buildInternal(int(i));
+    });
+    computeBounds();
+
+    // place the top of the tree, then write the subtrees below it in parallel
+    const int root = 0;
+    if (refineTop) {
+        std::vector<int> clusters;
+        cut(root, std::max(maxLeafSize, numPrimitives / TOP_CLUSTERS), clusters);
+        emitRefined(clusters, order);
+    } else {
+        nodes.resize(emittedAsLeaf(root) ? 1 : nodeCount[root]);
+        const int grain = std::max(maxLeafSize, numPrimitives / int(8 * numThreads));
+        emitAbove(root, 0, grain);
+    }
+
+    // subtrees differ in size, so threads take them one at a time
+    std::atomic<size_t> next(0);
+    threading::parallelChunks(
+        numThreads, tasks.size(),
+        [&](size_t, size_t, unsigned) {
+            for (size_t k = next++; k < tasks.size(); k = next++)
+                emitSubtree(tasks[k].ref, tasks[k].out, tasks[k].shift);
+        },
+        1);
+    if (!refineTop)
+        order = sorted;
+}
+
+#endif
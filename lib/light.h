@@ -0,0 +1,174 @@
+#ifndef LIGHTH
+#define LIGHTH
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#define _USE_MATH_DEFINES  // for MSVC, for M_PI
+#include <math.h>
+
+#include "hittable.h"
+#include "material.h"
+#include "packed_spheres.h"
+#include "rand.h"
+#include "sphere.h"
+#include "vec3.h"
+
+/**
+ * A sphere with an emissive material, as the integrator sees it when it goes looking for light.
+ * `material_id` (and where on the sphere the hit is) is how a path that runs into the sphere by
+ * itself finds out which light it hit.
+ **/
+struct sphere_light {
+    vec3 center;
+    float radius;
+    vec3 emission;
+    uint32_t material_id;
+};
+
+namespace lights {
+
+    /**
+     * Sorts lights by position, so which light a sample picks doesn't depend on the order the
+     * spheres are stored in (a compiled scene keeps them in BVH leaf order)
+     **/
+    inline void sortLights(std::vector<sphere_light>& found) {
+        std::sort(found.begin(), found.end(), [](const sphere_light& a, const sphere_light& b) {
+            if (a.center.x() != b.center.x())
+                return a.center.x() < b.center.x();
+            if (a.center.y() != b.center.y())
+                return a.center.y() < b.center.y();
+            return a.center.z() < b.center.z();
+        });
+    }
+
+    /**
+     * The emissive spheres among `objects`. Call before the objects go into the world, which
+     * takes them apart.
+     **/
+    std::vector<sphere_light> collect(const std::vector<std::unique_ptr<hittable>>& objects,
+                                      const material_table& materials) {
+        std::vector<sphere_light> found;
+        for (const auto& object : objects) {
+            const sphere* s = dynamic_cast<const sphere*>(object.get());
+            if (!s)
+                continue;
+            const vec3 emission = materials[s->material_id].emitted();
+            if (emission.r() > 0 || emission.g() > 0 || emission.b() > 0)
+                found.push_back(sphere_light{s->center, std::fabs(s->radius), emission, s->material_id});
+        }
+        sortLights(found);
+        return found;
+    }
+
+    /**
+     * The emissive spheres of a packed store (the spheres of a compiled scene). Its arrays stay put,
+     * so unlike the objects above this can be called any time.
+     **/
+    std::vector<sphere_light> collect(const packed_spheres& spheres, const material_table& materials) {
+        std::vector<bool> emissive(materials.size());
+        bool any = false;
+        for (size_t m = 0; m < materials.size(); ++m) {
+            const vec3 emission = materials[uint32_t(m)].emitted();
+            emissive[m] = emission.r() > 0 || emission.g() > 0 || emission.b() > 0;
+            any = any || emissive[m];
+        }
+        std::vector<sphere_light> found;
+        for (int k = 0; any && k < spheres.count; ++k) {
+            const uint32_t id = spheres.materialIndex[k];
+            if (emissive[id])
+                found.push_back(sphere_light{vec3(spheres.cx[k], spheres.cy[k], spheres.cz[k]),
+                                             std::fabs(spheres.radius[k]), materials[id].emitted(), id});
+        }
+        sortLights(found);
+        return found;
+    }
+
+    /**
+     * Cosine of the half angle of the cone `light` covers as seen from `p`, or false from inside it
+     **/
+    inline bool coneCosine(const sphere_light& light, const vec3& p, float& cosThetaMax) {
+        const float squaredDistance = (light.center - p).squaredLength();
+        const float squaredRadius = light.radius * light.radius;
+        if (squaredDistance <= squaredRadius)
+            return false;
+        cosThetaMax = std::sqrt(std::max(0.f, 1.f - squaredRadius / squaredDistance));
+        return true;
+    }
+
+    /**
+     * Density per solid angle of `sample` picking the direction from `p` towards the light hit at
+     * `hit`, 0 when it isn't one of `all` (and so is never sampled directly). Lights can share a
+     * material, the one hit is the one of its material whose surface `hit.p` is on.
+     **/
+    float pdf(const std::vector<sphere_light>& all, const vec3& p, const hit_record& hit) {
+        const sphere_light* found = nullptr;
+        float closest = std::numeric_limits<float>::max();
+        for (const sphere_light& light : all) {
+            if (light.material_id != hit.material_id)
+                continue;
+            const float offSurface = std::fabs((hit.p - light.center).length() - light.radius);
+            if (offSurface < closest) {
+                closest = offSurface;
+                found = &light;
+            }
+        }
+        float cosThetaMax;
+        if (!found || !coneCosine(*found, p, cosThetaMax) || cosThetaMax >= 1.f)
+            return 0;
+        return 1.f / (2.f * float(M_PI) * (1.f - cosThetaMax) * float(all.size()));
+    }
+
+    /**
+     * Picks one of the lights uniformly by `pick` and a direction from `p` uniformly within the cone
+     * it covers by (u, v), all in [0, 1), so every sample hits it (unless something is in the
+     * way). Sets `direction` (unit), the `distance` to the light's surface along it, its
+     * `emission` and the `density` per solid angle of the pick. Returns false when there's nothing
+     * to sample from `p`.
+     **/
+    bool sample(const std::vector<sphere_light>& all, const vec3& p, float pick, float u, float v, vec3& direction,
+                float& distance, vec3& emission, float& density) {
+        if (all.empty())
+            return false;
+        const size_t k = std::min(all.size() - 1, size_t(pick * all.size()));
+        const sphere_light& light = all[k];
+        float cosThetaMax;
+        if (!coneCosine(light, p, cosThetaMax) || cosThetaMax >= 1.f)
+            return false;
+
+        // orthonormal frame around the direction to the light's center
+        const vec3 w = unitVector(light.center - p);
+        const vec3 a = std::fabs(w.x()) > 0.9f ? vec3(0, 1, 0) : vec3(1, 0, 0);
+        const vec3 s = unitVector(cross(w, a));
+        const vec3 t = cross(w, s);
+
+        const float cosTheta = 1.f + u * (cosThetaMax - 1.f);
+        const float sinTheta = std::sqrt(std::max(0.f, 1.f - cosTheta * cosTheta));
+        const float phi = 2.f * float(M_PI) * v;
+        direction = unitVector(std::cos(phi) * sinTheta * t + std::sin(phi) * sinTheta * s + cosTheta * w);
+
+        // nearest root of |p + t d - c|^2 = r^2 with |d| = 1, clamped for directions grazing the rim
+        const vec3 oc = p - light.center;
+        const float b = dot(oc, direction);
+        const float c = oc.squaredLength() - light.radius * light.radius;
+        distance = -b - std::sqrt(std::max(0.f, b * b - c));
+
+        emission = light.emission;
+        density = 1.f / (2.f * float(M_PI) * (1.f - cosThetaMax) * float(all.size()));
+        return true;
+    }
+
+    /**
+     * Power heuristic (beta = 2) weight of a sample drawn with density `f` when `g` could have drawn it too
+     **/
+    inline float powerHeuristic(float f, float g) {
+        const float ff = f * f, gg = g * g;
+        return ff + gg > 0.f ? ff / (ff + gg) : 0.f;
+    }
+}
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef MAPPEDFILEH
+#define MAPPEDFILEH
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+ * A whole file mapped read only into memory. Pages are read in by the OS as they're touched,
+ * so opening is instant and the contents cost no allocation of our own.
+ **/
+class MappedFile {
+    public:
+        MappedFile() : bytes(nullptr), length(0) {}
+        ~MappedFile() { close(); }
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        bool open(const std::string& path, std::string& error);
+        void close();
+
+        inline const uint8_t* data() const { return bytes; }
+        inline size_t size() const { return length; }
+
+    private:
+        const uint8_t* bytes;
+        size_t length;
+};
+
+#ifdef _WIN32
+
+inline bool MappedFile::open(const std::string& path, std::string& error) {
+    close();
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        error = "can't open " + path;
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+        CloseHandle(file);
+        error = path + " is empty";
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);  // the mapping keeps the file open
+    if (!mapping) {
+        error = "can't map " + path;
+        return false;
+    }
+    bytes = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    CloseHandle(mapping);  // and the view keeps the mapping
+    if (!bytes) {
+        error = "can't map " + path;
+        return false;
+    }
+    length = size_t(fileSize.QuadPart);
+    return true;
+}
+
+inline void MappedFile::close() {
+    if (bytes)
+        UnmapViewOfFile(bytes);
+    bytes = nullptr;
+    length = 0;
+}
+
+#else
+
+inline bool MappedFile::open(const std::string& path, std::string& error) {
+    close();
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = "can't open " + path;
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        ::close(fd);
+        error = path + " is empty";
+        return false;
+    }
+    void* mapped = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);  // the mapping keeps the file open
+    if (mapped == MAP_FAILED) {
+        error = "can't map " + path;
+        return false;
+    }
+    bytes = static_cast<const uint8_t*>(mapped);
+    length = size_t(info.st_size);
+    return true;
+}
+
+inline void MappedFile::close() {
+    if (bytes)
+        munmap(const_cast<uint8_t*>(bytes), length);
+    bytes = nullptr;
+    length = 0;
+}
+
+#endif
+
+#endif
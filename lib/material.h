@@ -1,9 +1,17 @@
 #ifndef MATERIALH
 #define MATERIALH
 
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#define _USE_MATH_DEFINES  // for MSVC, for M_PI
+#include <math.h>
+
 #include "hittable.h"
 #include "rand.h"
 #include "ray.h"
+#include "warp.h"
 
 
 struct hit_record;
@@ -32,93 +40,151 @@ vec3 reflect(const vec3& v, const vec3& n) {
 }
 
 
-vec3 randomInUnitSphere() {
-    vec3 p;
-    do {
-        p = 2.0*vec3(random_double(),random_double(),random_double()) - vec3(1,1,1);
-    } while (p.squaredLength() >= 1.0);
-    return p;
+/**
+ * Surface response to light.
+ *
+ * Materials are plain records with a type tag, kept in one table per scene (`material_table`)
+ * that spheres, meshes and hit records refer to by a 32 bit index. The calls below switch on the
+ * tag: no virtual call, no heap object to chase on every bounce, and the records can be copied
+ * around (or mapped from a file) as they are.
+ *
+ * `scatter` samples the direction a path continues in, from the sample (u, v, w) in [0, 1)^3 it's
+ * given rather than numbers of its own, so stratified samples stay stratified (see sampler.h):
+ * (u, v) picks the direction and w is the one extra number METAL (the fuzz radius) and
+ * DIELECTRIC (reflect or refract) need. Materials whose BSDF has a density (only
+ * LAMBERTIAN so far, mirrors and glass scatter into a single direction) also answer
+ * `evaluate` and `scatteringPdf`, which lets the integrator send rays straight at the lights
+ * and weigh them against the scattered ray (next event estimation, see tracing.h).
+ **/
+enum class MaterialType : uint32_t { LAMBERTIAN = 0, METAL = 1, DIELECTRIC = 2, LIGHT = 3 };
+
+struct material {
+    MaterialType type;
+    vec3 color;   // albedo, or the radiance given off by a LIGHT
+    float param;  // METAL: fuzz, DIELECTRIC: index of refraction
+
+    inline bool scatter(const ray& r_in, const hit_record& rec, float u, float v, float w, vec3& attenuation,
+                        ray& scattered) const;
+    // radiance given off by the surface
+    inline vec3 emitted() const { return type == MaterialType::LIGHT ? color : vec3(0, 0, 0); }
+    // whether `evaluate` and `scatteringPdf` are meaningful
+    inline bool isDiffuse() const { return type == MaterialType::LAMBERTIAN; }
+    // BSDF times cosine for light leaving along the unit vector `direction`
+    inline vec3 evaluate(const hit_record& rec, const vec3& direction) const;
+    // density (per solid angle) of `scatter` picking the unit vector `direction`
+    inline float scatteringPdf(const hit_record& rec, const vec3& direction) const;
+};
+
+inline material lambertian(const vec3& albedo) {
+    return material{MaterialType::LAMBERTIAN, albedo, 0.f};
 }
 
+inline material metal(const vec3& albedo, float fuzz) {
+    return material{MaterialType::METAL, albedo, fuzz < 1 ? fuzz : 1.f};
+}
 
-class material  {
-    public:
-        virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const = 0;
-        virtual ~material() = 0;
-};
+inline material dielectric(float ref_idx) {
+    return material{MaterialType::DIELECTRIC, vec3(1, 1, 1), ref_idx};
+}
 
-// weird gotcha: we HAVE to declare this for a virtual base class! otherwise we get
-//     ld: symbol(s) not found for architecture x86_64
-material::~material() {}
+// emitter: absorbs whatever hits it and gives off `emit` radiance in every direction
+inline material diffuse_light(const vec3& emit) {
+    return material{MaterialType::LIGHT, emit, 0.f};
+}
 
 
-class lambertian : public material {
-    public:
-        lambertian(const vec3& a) : albedo(a) {}
-        ~lambertian() {}
-        virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const  {
-             vec3 target = rec.p + rec.normal + randomInUnitSphere();
-             scattered = ray(rec.p, target - rec.p);
-             attenuation = albedo;
-             return true;
-        }
+// cosine distributed around the normal, pdf = cos / pi, so the BSDF * cos / pdf that the path
+// carries on is just the albedo
+inline bool scatterLambertian(const material& m, const hit_record& rec, float u, float v, vec3& attenuation,
+                              ray& scattered) {
+    vec3 s, t;
+    warp::frame(rec.normal, s, t);
+    scattered = ray(rec.p, warp::toWorld(warp::cosineHemisphere(u, v), s, t, rec.normal));
+    attenuation = m.color;
+    return true;
+}
 
-        vec3 albedo;
-};
 
+inline bool scatterMetal(const material& m, const ray& r_in, const hit_record& rec, float u, float v, float w,
+                         vec3& attenuation, ray& scattered) {
+    vec3 reflected = reflect(unitVector(r_in.direction()), rec.normal);
+    scattered = ray(rec.p, reflected + m.param * warp::uniformBall(u, v, w));
+    attenuation = m.color;
+    return (dot(scattered.direction(), rec.normal) > 0);
+}
 
-class metal : public material {
-    public:
-        metal(const vec3& a, float f) : albedo(a) { if (f < 1) fuzz = f; else fuzz = 1; }
-        ~metal() {}
-        virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const  {
-            vec3 reflected = reflect(unitVector(r_in.direction()), rec.normal);
-            scattered = ray(rec.p, reflected + fuzz*randomInUnitSphere());
-            attenuation = albedo;
-            return (dot(scattered.direction(), rec.normal) > 0);
-        }
-        vec3 albedo;
-        float fuzz;
-};
+
+inline bool scatterDielectric(const material& m, const ray& r_in, const hit_record& rec, float w, vec3& attenuation,
+                              ray& scattered) {
+     const float ref_idx = m.param;
+     vec3 outward_normal;
+     vec3 reflected = reflect(r_in.direction(), rec.normal);
+     float ni_over_nt;
+     attenuation = vec3(1.0, 1.0, 1.0);
+     vec3 refracted;
+     float reflect_prob;
+     float cosine;
+     if (dot(r_in.direction(), rec.normal) > 0) {
+          outward_normal = -rec.normal;
+          ni_over_nt = ref_idx;
+       // cosine = ref_idx * dot(r_in.direction(), rec.normal) / r_in.direction().length();
+          cosine = dot(r_in.direction(), rec.normal) / r_in.direction().length();
+          cosine = sqrt(1 - ref_idx * ref_idx * (1 - cosine * cosine));
+     }
+     else {
+          outward_normal = rec.normal;
+          ni_over_nt = 1.0 / ref_idx;
+          cosine = -dot(r_in.direction(), rec.normal) / r_in.direction().length();
+     }
+     if (refract(r_in.direction(), outward_normal, ni_over_nt, refracted))
+        reflect_prob = schlick(cosine, ref_idx);
+     else
+        reflect_prob = 1.0;
+     if (w < reflect_prob)
+        scattered = ray(rec.p, reflected);
+     else
+        scattered = ray(rec.p, refracted);
+     return true;
+}
+
+
+inline bool material::scatter(const ray& r_in, const hit_record& rec, float u, float v, float w, vec3& attenuation,
+                              ray& scattered) const {
+    switch (type) {
+        case MaterialType::LAMBERTIAN: return scatterLambertian(*this, rec, u, v, attenuation, scattered);
+        case MaterialType::METAL: return scatterMetal(*this, r_in, rec, u, v, w, attenuation, scattered);
+        case MaterialType::DIELECTRIC: return scatterDielectric(*this, r_in, rec, w, attenuation, scattered);
+        default: return false;  // lights absorb
+    }
+}
+
+inline vec3 material::evaluate(const hit_record& rec, const vec3& direction) const {
+    if (type != MaterialType::LAMBERTIAN)
+        return vec3(0, 0, 0);
+    return color * (std::max(0.f, dot(rec.normal, direction)) / float(M_PI));
+}
+
+inline float material::scatteringPdf(const hit_record& rec, const vec3& direction) const {
+    if (type != MaterialType::LAMBERTIAN)
+        return 0;
+    return std::max(0.f, dot(rec.normal, direction)) / float(M_PI);
+}
 
 
-class dielectric : public material {
+/**
+ * Every material of a scene, objects hold the index `add` gives back
+ **/
+class material_table {
     public:
-        dielectric(float ri) : ref_idx(ri) {}
-        ~dielectric() {}
-        virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const  {
-             vec3 outward_normal;
-             vec3 reflected = reflect(r_in.direction(), rec.normal);
-             float ni_over_nt;
-             attenuation = vec3(1.0, 1.0, 1.0);
-             vec3 refracted;
-             float reflect_prob;
-             float cosine;
-             if (dot(r_in.direction(), rec.normal) > 0) {
-                  outward_normal = -rec.normal;
-                  ni_over_nt = ref_idx;
-               // cosine = ref_idx * dot(r_in.direction(), rec.normal) / r_in.direction().length();
-                  cosine = dot(r_in.direction(), rec.normal) / r_in.direction().length();
-                  cosine = sqrt(1 - ref_idx * ref_idx * (1 - cosine * cosine));
-             }
-             else {
-                  outward_normal = rec.normal;
-                  ni_over_nt = 1.0 / ref_idx;
-                  cosine = -dot(r_in.direction(), rec.normal) / r_in.direction().length();
-             }
-             if (refract(r_in.direction(), outward_normal, ni_over_nt, refracted))
-                reflect_prob = schlick(cosine, ref_idx);
-             else
-                reflect_prob = 1.0;
-             if (random_double() < reflect_prob)
-                scattered = ray(rec.p, reflected);
-             else
-                scattered = ray(rec.p, refracted);
-             return true;
+        inline uint32_t add(const material& m) {
+            entries.push_back(m);
+            return uint32_t(entries.size() - 1);
         }
+        inline const material& operator[](uint32_t id) const { return entries[id]; }
+        inline size_t size() const { return entries.size(); }
 
-        float ref_idx;
+        std::vector<material> entries;
 };
 
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,215 @@
+#ifndef OBJLOADERH
+#define OBJLOADERH
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "vec3.h"
+
+/**
+ * Indexed triangle data, the layout `triangle_mesh` renders from
+ **/
+struct mesh_data {
+    std::vector<vec3> positions;
+    std::vector<vec3> normals;
+    std::vector<uint32_t> indices;        // 3 per triangle, into `positions`
+    std::vector<uint32_t> normalIndices;  // 3 per triangle, into `normals`. empty if the file has none
+
+    inline size_t numTriangles() const { return indices.size() / 3; }
+};
+
+namespace obj {
+
+    /**
+     * Minimal Wavefront OBJ reader: `v`, `vn` and `f` lines, everything else (texture coordinates,
+     * groups, materials, ...) is skipped.
+     *
+     * The whole file is read with a single read into one buffer and parsed in place, appending
+     * straight into the mesh_data vectors. No per-line strings or per-face allocations, which is
+     * what keeps multi-million triangle files loading in seconds. Polygons are split into
+     * triangle fans.
+     **/
+    class reader {
+        public:
+            reader(const char* b, const char* e) : cur(b), end(e) {}
+
+            bool parse(mesh_data& mesh, std::string& error);
+
+        private:
+            inline void skipSpaces() {
+                while (cur < end && (*cur == ' ' || *cur == '\t' || *cur == '\r'))
+                    ++cur;
+            }
+            inline void skipLine() {
+                while (cur < end && *cur != '\n')
+                    ++cur;
+                if (cur < end)
+                    ++cur;
+            }
+            inline bool atLineEnd() const { return cur >= end || *cur == '\n' || *cur == '#'; }
+
+            bool parseFloat(float& out);
+            bool parseInt(long& out);
+            bool parseVertex(long& position, long& normal, bool& hasNormal);
+            bool resolve(long index, size_t count, uint32_t& out) const;
+
+            const char* cur;
+            const char* end;
+            long line = 1;
+    };
+
+    bool reader::parseFloat(float& out) {
+        skipSpaces();
+        // the buffer is null terminated, so strtof can't run off the end
+        char* after;
+        out = strtof(cur, &after);
+        if (after == cur)
+            return false;
+        cur = after;
+        return true;
+    }
+
+    bool reader::parseInt(long& out) {
+        bool negative = false;
+        if (cur < end && (*cur == '-' || *cur == '+'))
+            negative = *cur++ == '-';
+        if (cur >= end || *cur < '0' || *cur > '9')
+            return false;
+        long value = 0;
+        while (cur < end && *cur >= '0' && *cur <= '9')
+            value = value * 10 + (*cur++ - '0');
+        out = negative ? -value : value;
+        return true;
+    }
+
+    // one face corner: v, v/vt, v//vn or v/vt/vn
+    bool reader::parseVertex(long& position, long& normal, bool& hasNormal) {
+        hasNormal = false;
+        if (!parseInt(position))
+            return false;
+        if (cur < end && *cur == '/') {
+            ++cur;
+            long texture;
+            if (cur < end && *cur != '/' && !parseInt(texture))
+                return false;
+            if (cur < end && *cur == '/') {
+                ++cur;
+                if (!parseInt(normal))
+                    return false;
+                hasNormal = true;
+            }
+        }
+        return true;
+    }
+
+    // OBJ indices are 1 based, negative ones count back from the last element read so far
+    bool reader::resolve(long index, size_t count, uint32_t& out) const {
+        long resolved = index > 0 ? index - 1 : long(count) + index;
+        if (index == 0 || resolved < 0 || resolved >= long(count))
+            return false;
+        out = uint32_t(resolved);
+        return true;
+    }
+
+    bool reader::parse(mesh_data& mesh, std::string& error) {
+        // corners of the current polygon, reused between faces so it only allocates for the largest one
+        std::vector<uint32_t> corners, cornerNormals;
+        bool allFacesHaveNormals = true;
+
+        for (; cur < end; ++line) {
+            skipSpaces();
+            if (cur + 1 < end && cur[0] == 'v' && (cur[1] == ' ' || cur[1] == '\t')) {
+                cur += 1;
+                vec3 p;
+                if (!parseFloat(p.e[0]) || !parseFloat(p.e[1]) || !parseFloat(p.e[2])) {
+                    error = "bad vertex on line " + std::to_string(line);
+                    return false;
+                }
+                mesh.positions.push_back(p);
+            } else if (cur + 2 < end && cur[0] == 'v' && cur[1] == 'n' && (cur[2] == ' ' || cur[2] == '\t')) {
+                cur += 2;
+                vec3 n;
+                if (!parseFloat(n.e[0]) || !parseFloat(n.e[1]) || !parseFloat(n.e[2])) {
+                    error = "bad normal on line " + std::to_string(line);
+                    return false;
+                }
+                mesh.normals.push_back(n);
+            } else if (cur + 1 < end && cur[0] == 'f' && (cur[1] == ' ' || cur[1] == '\t')) {
+                cur += 1;
+                corners.clear();
+                cornerNormals.clear();
+                bool faceHasNormals = true;
+
+                skipSpaces();
+                while (!atLineEnd()) {
+                    long position, normal = 0;
+                    bool hasNormal;
+                    uint32_t p, n = 0;
+                    if (!parseVertex(position, normal, hasNormal) || !resolve(position, mesh.positions.size(), p) ||
+                        (hasNormal && !resolve(normal, mesh.normals.size(), n))) {
+                        error = "bad face on line " + std::to_string(line);
+                        return false;
+                    }
+                    faceHasNormals = faceHasNormals && hasNormal;
+                    corners.push_back(p);
+                    cornerNormals.push_back(n);
+                    skipSpaces();
+                }
+
+                if (corners.size() < 3) {
+                    error = "face with fewer than 3 vertices on line " + std::to_string(line);
+                    return false;
+                }
+                allFacesHaveNormals = allFacesHaveNormals && faceHasNormals;
+
+                for (size_t k = 1; k + 1 < corners.size(); ++k) {
+                    mesh.indices.push_back(corners[0]);
+                    mesh.indices.push_back(corners[k]);
+                    mesh.indices.push_back(corners[k + 1]);
+                    mesh.normalIndices.push_back(cornerNormals[0]);
+                    mesh.normalIndices.push_back(cornerNormals[k]);
+                    mesh.normalIndices.push_back(cornerNormals[k + 1]);
+                }
+            }
+            skipLine();
+        }
+
+        // smooth shading only if every face has normals, otherwise fall back to flat shading
+        if (!allFacesHaveNormals || mesh.normals.empty()) {
+            mesh.normals.clear();
+            mesh.normalIndices.clear();
+        }
+        return true;
+    }
+
+    /**
+     * Loads `path` into `mesh`. On failure returns false with a message in `error`.
+     **/
+    bool load(const std::string& path, mesh_data& mesh, std::string& error) {
+        std::ifstream f(path, std::ios::binary | std::ios::ate);
+        if (!f.is_open()) {
+            error = "can't open " + path;
+            return false;
+        }
+
+        const std::streamsize size = f.tellg();
+        std::string buffer(size_t(size) + 1, '\0');
+        f.seekg(0);
+        if (!f.read(&buffer[0], size)) {
+            error = "can't read " + path;
+            return false;
+        }
+
+        // rough guess from typical line lengths, saves most of the regrowing on big files
+        mesh.positions.reserve(size_t(size) / 64);
+        mesh.indices.reserve(size_t(size) / 16);
+
+        reader r(buffer.data(), buffer.data() + size);
+        return r.parse(mesh, error);
+    }
+}
+
+#endif
@@ -0,0 +1,342 @@
+#ifndef PACKEDSPHERESH
+#define PACKEDSPHERESH
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "hittable.h"
+#include "material.h"
+#include "simd.h"
+#include "sphere.h"
+
+/**
+ * Spheres stored as structure of arrays: all x coordinates of the centers together, then all y,
+ * and so on. One ray is tested against 8 (AVX2) or 16 (AVX-512) spheres per instruction, with
+ * no virtual call or pointer chase per sphere.
+ *
+ * Materials are owned here and referenced by index, so the per-sphere data is plain floats.
+ * `hitRange` tests a contiguous run of spheres, which lets the BVH keep its leaves in here.
+ *
+ * The kernels read the arrays through plain pointers, which point either at our own vectors
+ * (filled with `add`) or, for a view, at memory owned by someone else, such as a compiled scene
+ * file mapped straight into memory (see scene_file.h).
+ **/
+class packed_spheres : public hittable {
+    public:
+        // the kernels read whole vectors, so the arrays are padded past the last sphere
+        static const int PADDING = 16;
+
+        packed_spheres() : count(0), level(simd::detect()) { finalize(); }
+        packed_spheres(std::vector<std::unique_ptr<hittable>> objects);
+        // view of `n` spheres in arrays that outlive us, each padded to n + PADDING entries the
+        // way `finalize` pads them
+        packed_spheres(const float* centerX, const float* centerY, const float* centerZ, const float* squaredRadii,
+                       const float* radii, const uint32_t* materialIndices, int n)
+            : cx(centerX), cy(centerY), cz(centerZ), squaredRadius(squaredRadii), radius(radii),
+              materialIndex(materialIndices), count(n), level(simd::detect()) {}
+        // the array pointers may point into our own vectors
+        packed_spheres(const packed_spheres&) = delete;
+        packed_spheres& operator=(const packed_spheres&) = delete;
+
+        void add(const vec3& center, float radius, uint32_t material_id);
+        void add(const sphere& s);
+        void finalize();      // sets up the padding, call after the last add()
+
+        // closest sphere in [begin, end) hit inside (t_min, t_max), -1 if none. Lowers t_max on a hit
+        inline int hitRange(const ray& r, int begin, int end, float t_min, float& t_max) const;
+        // whether any sphere in [begin, end) is hit inside (t_min, t_max), stopping at the first one
+        inline bool occludedRange(const ray& r, int begin, int end, float t_min, float t_max) const;
+        inline void fillRecord(const ray& r, int index, float t, hit_record& rec) const;
+        // hitRange for every ray of the packet
+        inline void hitPacketRange(const ray_packet& p, int begin, int end, float t_min, packet_hit& hits) const;
+
+        virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        virtual bool occluded(const ray& r, float t_min, float t_max) const;
+        virtual bool bounding_box(aabb& box) const;
+        virtual void hitPacket(const ray_packet& p, float t_min, packet_hit& hits) const;
+
+        const float *cx, *cy, *cz;
+        const float* squaredRadius;
+        const float* radius;
+        const uint32_t* materialIndex;  // into the scene's material_table
+        int count;
+        simd::Level level;  // widest kernel we're allowed to use
+
+    private:
+        // storage behind the arrays above, unless we're a view
+        std::vector<float> ownCx, ownCy, ownCz, ownSquaredRadius, ownRadius;
+        std::vector<uint32_t> ownMaterialIndex;
+
+        // with `anyHit` the kernels return the first hit they find instead of the closest one
+        template <bool anyHit>
+        inline int hitRangeScalar(const ray& r, int begin, int end, float t_min, float& t_max) const;
+#ifdef TRACER_X86
+        template <bool anyHit>
+        TARGET_AVX2 int hitRangeAvx2(const ray& r, int begin, int end, float t_min, float& t_max) const;
+        template <bool anyHit>
+        TARGET_AVX512 int hitRangeAvx512(const ray& r, int begin, int end, float t_min, float& t_max) const;
+#endif
+};
+
+/**
+ * Packs a list of hittables, which must all be spheres
+ **/
+packed_spheres::packed_spheres(std::vector<std::unique_ptr<hittable>> objects) : count(0), level(simd::detect()) {
+    for (auto& object : objects) {
+        sphere* s = dynamic_cast<sphere*>(object.get());
+        if (s)
+            add(*s);
+    }
+    finalize();
+}
+
+void packed_spheres::add(const vec3& center, float r, uint32_t material_id) {
+    // drop the padding of an earlier finalize()
+    ownCx.resize(count);
+    ownCy.resize(count);
+    ownCz.resize(count);
+    ownSquaredRadius.resize(count);
+    ownRadius.resize(count);
+    ownMaterialIndex.resize(count);
+
+    ownCx.push_back(center.x());
+    ownCy.push_back(center.y());
+    ownCz.push_back(center.z());
+    ownSquaredRadius.push_back(r * r);
+    ownRadius.push_back(r);
+    ownMaterialIndex.push_back(material_id);
+    count++;
+}
+
+void packed_spheres::add(const sphere& s) {
+    add(s.center, s.radius, s.material_id);
+}
+
+void packed_spheres::finalize() {
+    // a squared radius of -inf makes c = +inf, so the discriminant is -inf and padding never hits
+    const float never = -std::numeric_limits<float>::infinity();
+    ownCx.resize(count + PADDING, 0.);
+    ownCy.resize(count + PADDING, 0.);
+    ownCz.resize(count + PADDING, 0.);
+    ownSquaredRadius.resize(count + PADDING, never);
+    ownRadius.resize(count + PADDING, 1.);
+    ownMaterialIndex.resize(count + PADDING, 0);
+
+    cx = ownCx.data();
+    cy = ownCy.data();
+    cz = ownCz.data();
+    squaredRadius = ownSquaredRadius.data();
+    radius = ownRadius.data();
+    materialIndex = ownMaterialIndex.data();
+}
+
+inline void packed_spheres::fillRecord(const ray& r, int index, float t, hit_record& rec) const {
+    const vec3 center(cx[index], cy[index], cz[index]);
+    rec.t = t;
+    rec.p = r.pointAtParameter(t);
+    rec.normal = (rec.p - center) / radius[index];
+    rec.material_id = materialIndex[index];
+}
+
+template <bool anyHit>
+inline int packed_spheres::hitRangeScalar(const ray& r, int begin, int end, float t_min, float& t_max) const {
+    const vec3 origin = r.origin();
+    const vec3 direction = r.direction();
+    const float a = r.getDirectionSquaredLength();
+    int closest = -1;
+
+    for (int k = begin; k < end; ++k) {
+        const vec3 oc = origin - vec3(cx[k], cy[k], cz[k]);
+        const float b = dot(oc, direction);
+        const float c = dot(oc, oc) - squaredRadius[k];
+        const float discriminant = b * b - a * c;
+        if (discriminant <= 0)
+            continue;
+
+        const float sqrt_discriminant_div_a = sqrt(discriminant) / a;
+        const float minus_b_div_a = -b / a;
+        float t = minus_b_div_a - sqrt_discriminant_div_a;
+        if (!(t < t_max && t > t_min))
+            t = minus_b_div_a + sqrt_discriminant_div_a;
+        if (t < t_max && t > t_min) {
+            t_max = t;
+            closest = k;
+            if (anyHit)
+                return closest;
+        }
+    }
+    return closest;
+}
+
+#ifdef TRACER_X86
+template <bool anyHit>
+TARGET_AVX2 int packed_spheres::hitRangeAvx2(const ray& r, int begin, int end, float t_min, float& t_max) const {
+    const __m256 ox = _mm256_set1_ps(r.A.x()), oy = _mm256_set1_ps(r.A.y()), oz = _mm256_set1_ps(r.A.z());
+    const __m256 dx = _mm256_set1_ps(r.B.x()), dy = _mm256_set1_ps(r.B.y()), dz = _mm256_set1_ps(r.B.z());
+    const __m256 a = _mm256_set1_ps(r.getDirectionSquaredLength());
+    const __m256 tmin = _mm256_set1_ps(t_min);
+    const __m256 lanes = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    int closest = -1;
+
+    for (int k = begin; k < end; k += 8) {
+        const __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(&cx[k]));
+        const __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(&cy[k]));
+        const __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(&cz[k]));
+        const __m256 b = _mm256_fmadd_ps(ocz, dz, _mm256_fmadd_ps(ocy, dy, _mm256_mul_ps(ocx, dx)));
+        const __m256 c = _mm256_sub_ps(_mm256_fmadd_ps(ocz, ocz, _mm256_fmadd_ps(ocy, ocy, _mm256_mul_ps(ocx, ocx))),
+                                       _mm256_loadu_ps(&squaredRadius[k]));
+        const __m256 discriminant = _mm256_fmsub_ps(b, b, _mm256_mul_ps(a, c));
+
+        // only lanes inside [begin, end) count, the rest belong to other leaves (or padding)
+        const __m256 inRange = _mm256_cmp_ps(lanes, _mm256_set1_ps(float(end - k)), _CMP_LT_OQ);
+        const __m256 valid = _mm256_and_ps(inRange, _mm256_cmp_ps(discriminant, _mm256_setzero_ps(), _CMP_GT_OQ));
+        if (_mm256_movemask_ps(valid) == 0)
+            continue;
+
+        const __m256 sqrtDiscriminantDivA =
+            _mm256_div_ps(_mm256_sqrt_ps(_mm256_max_ps(discriminant, _mm256_setzero_ps())), a);
+        const __m256 minusBDivA = _mm256_div_ps(_mm256_sub_ps(_mm256_setzero_ps(), b), a);
+        const __m256 t0 = _mm256_sub_ps(minusBDivA, sqrtDiscriminantDivA);
+        const __m256 t1 = _mm256_add_ps(minusBDivA, sqrtDiscriminantDivA);
+
+        const __m256 tmax = _mm256_set1_ps(t_max);
+        const __m256 hit0 = _mm256_and_ps(
+            valid, _mm256_and_ps(_mm256_cmp_ps(t0, tmax, _CMP_LT_OQ), _mm256_cmp_ps(t0, tmin, _CMP_GT_OQ)));
+        const __m256 hit1 = _mm256_andnot_ps(
+            hit0, _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t1, tmax, _CMP_LT_OQ),
+                                                     _mm256_cmp_ps(t1, tmin, _CMP_GT_OQ))));
+        int mask = _mm256_movemask_ps(_mm256_or_ps(hit0, hit1));
+        if (mask == 0)
+            continue;
+        if (anyHit)
+            return k + simd::lowestBit(mask);
+
+        // hits are rare compared to tests, so find the nearest of them one lane at a time
+        alignas(32) float t[8];
+        _mm256_store_ps(t, _mm256_blendv_ps(t1, t0, hit0));
+        for (int lane = 0; mask != 0; ++lane, mask >>= 1) {
+            if ((mask & 1) && t[lane] < t_max) {
+                t_max = t[lane];
+                closest = k + lane;
+            }
+        }
+    }
+    return closest;
+}
+
+template <bool anyHit>
+TARGET_AVX512 int packed_spheres::hitRangeAvx512(const ray& r, int begin, int end, float t_min, float& t_max) const {
+    const __m512 ox = _mm512_set1_ps(r.A.x()), oy = _mm512_set1_ps(r.A.y()), oz = _mm512_set1_ps(r.A.z());
+    const __m512 dx = _mm512_set1_ps(r.B.x()), dy = _mm512_set1_ps(r.B.y()), dz = _mm512_set1_ps(r.B.z());
+    const __m512 a = _mm512_set1_ps(r.getDirectionSquaredLength());
+    const __m512 tmin = _mm512_set1_ps(t_min);
+    int closest = -1;
+
+    for (int k = begin; k < end; k += 16) {
+        const __m512 ocx = _mm512_sub_ps(ox, _mm512_loadu_ps(&cx[k]));
+        const __m512 ocy = _mm512_sub_ps(oy, _mm512_loadu_ps(&cy[k]));
+        const __m512 ocz = _mm512_sub_ps(oz, _mm512_loadu_ps(&cz[k]));
+        const __m512 b = _mm512_fmadd_ps(ocz, dz, _mm512_fmadd_ps(ocy, dy, _mm512_mul_ps(ocx, dx)));
+        const __m512 c = _mm512_sub_ps(_mm512_fmadd_ps(ocz, ocz, _mm512_fmadd_ps(ocy, ocy, _mm512_mul_ps(ocx, ocx))),
+                                       _mm512_loadu_ps(&squaredRadius[k]));
+        const __m512 discriminant = _mm512_fmsub_ps(b, b, _mm512_mul_ps(a, c));
+
+        const int remaining = end - k;
+        const __mmask16 inRange = remaining >= 16 ? __mmask16(0xffff) : __mmask16((1u << remaining) - 1);
+        const __mmask16 valid = _mm512_mask_cmp_ps_mask(inRange, discriminant, _mm512_setzero_ps(), _CMP_GT_OQ);
+        if (valid == 0)
+            continue;
+
+        // the zeroing forms, so lanes outside `valid` (negative discriminants) come out 0 rather than
+        // out of an undefined source
+        const __m512 sqrtDiscriminantDivA = _mm512_maskz_div_ps(valid, _mm512_maskz_sqrt_ps(valid, discriminant), a);
+        const __m512 minusBDivA = _mm512_maskz_div_ps(valid, _mm512_sub_ps(_mm512_setzero_ps(), b), a);
+        const __m512 t0 = _mm512_sub_ps(minusBDivA, sqrtDiscriminantDivA);
+        const __m512 t1 = _mm512_add_ps(minusBDivA, sqrtDiscriminantDivA);
+
+        const __m512 tmax = _mm512_set1_ps(t_max);
+        const __mmask16 hit0 = _mm512_mask_cmp_ps_mask(_mm512_mask_cmp_ps_mask(valid, t0, tmax, _CMP_LT_OQ), t0, tmin,
+                                                       _CMP_GT_OQ);
+        const __mmask16 hit1 = _mm512_mask_cmp_ps_mask(
+            _mm512_mask_cmp_ps_mask(valid & ~hit0, t1, tmax, _CMP_LT_OQ), t1, tmin, _CMP_GT_OQ);
+        unsigned mask = hit0 | hit1;
+        if (mask == 0)
+            continue;
+        if (anyHit)
+            return k + simd::lowestBit(mask);
+
+        alignas(64) float t[16];
+        _mm512_store_ps(t, _mm512_mask_blend_ps(hit0, t1, t0));
+        for (int lane = 0; mask != 0; ++lane, mask >>= 1) {
+            if ((mask & 1) && t[lane] < t_max) {
+                t_max = t[lane];
+                closest = k + lane;
+            }
+        }
+    }
+    return closest;
+}
+#endif
+
+inline int packed_spheres::hitRange(const ray& r, int begin, int end, float t_min, float& t_max) const {
+#ifdef TRACER_X86
+    if (level >= simd::AVX512)
+        return hitRangeAvx512<false>(r, begin, end, t_min, t_max);
+    if (level >= simd::AVX2)
+        return hitRangeAvx2<false>(r, begin, end, t_min, t_max);
+#endif
+    return hitRangeScalar<false>(r, begin, end, t_min, t_max);
+}
+
+inline bool packed_spheres::occludedRange(const ray& r, int begin, int end, float t_min, float t_max) const {
+#ifdef TRACER_X86
+    if (level >= simd::AVX512)
+        return hitRangeAvx512<true>(r, begin, end, t_min, t_max) >= 0;
+    if (level >= simd::AVX2)
+        return hitRangeAvx2<true>(r, begin, end, t_min, t_max) >= 0;
+#endif
+    return hitRangeScalar<true>(r, begin, end, t_min, t_max) >= 0;
+}
+
+bool packed_spheres::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    int closest = hitRange(r, 0, count, t_min, t_max);
+    if (closest < 0)
+        return false;
+    fillRecord(r, closest, t_max, rec);
+    return true;
+}
+
+bool packed_spheres::occluded(const ray& r, float t_min, float t_max) const {
+    return occludedRange(r, 0, count, t_min, t_max);
+}
+
+inline void packed_spheres::hitPacketRange(const ray_packet& p, int begin, int end, float t_min,
+                                           packet_hit& hits) const {
+    // a leaf holds about one vector of spheres, so going ray by ray with the sphere kernel keeps
+    // every lane busy, where going sphere by sphere over the packet would pay one test per sphere
+    for (int lane = 0; lane < p.width; ++lane) {
+        const ray r = p.get(lane);
+        int closest = hitRange(r, begin, end, t_min, hits.t[lane]);
+        if (closest >= 0) {
+            fillRecord(r, closest, hits.t[lane], hits.rec[lane]);
+            hits.mask |= 1 << lane;
+        }
+    }
+}
+
+void packed_spheres::hitPacket(const ray_packet& p, float t_min, packet_hit& hits) const {
+    hitPacketRange(p, 0, count, t_min, hits);
+}
+
+bool packed_spheres::bounding_box(aabb& box) const {
+    box = aabb();
+    for (int k = 0; k < count; ++k) {
+        const float rad = fabs(radius[k]);
+        box.grow(aabb(vec3(cx[k] - rad, cy[k] - rad, cz[k] - rad), vec3(cx[k] + rad, cy[k] + rad, cz[k] + rad)));
+    }
+    return count > 0;
+}
+
+#endif
@@ -0,0 +1,227 @@
+#ifndef PACKETH
+#define PACKETH
+
+#include "aabb.h"
+#include "ray.h"
+#include "simd.h"
+
+/**
+ * A bundle of 4 (SSE) or 8 (AVX2) rays stored as structure of arrays, so one vector
+ * instruction does the same step of an intersection test for every ray at once.
+ *
+ * This pays off for rays that travel together, like the camera rays of one pixel: they
+ * visit the same BVH nodes and test the same spheres, so we do one traversal for the
+ * whole packet instead of one per ray.
+ **/
+struct ray_packet {
+    static const int MAX_WIDTH = 8;
+
+    alignas(32) float ox[MAX_WIDTH];
+    alignas(32) float oy[MAX_WIDTH];
+    alignas(32) float oz[MAX_WIDTH];
+    alignas(32) float dx[MAX_WIDTH];
+    alignas(32) float dy[MAX_WIDTH];
+    alignas(32) float dz[MAX_WIDTH];
+    alignas(32) float ix[MAX_WIDTH];  // 1 / direction, for the box tests
+    alignas(32) float iy[MAX_WIDTH];
+    alignas(32) float iz[MAX_WIDTH];
+    alignas(32) float dd[MAX_WIDTH];  // dot(direction, direction)
+    int width;
+
+    inline void set(int lane, const ray& r) {
+        ox[lane] = r.A.x(); oy[lane] = r.A.y(); oz[lane] = r.A.z();
+        dx[lane] = r.B.x(); dy[lane] = r.B.y(); dz[lane] = r.B.z();
+        ix[lane] = 1. / r.B.x(); iy[lane] = 1. / r.B.y(); iz[lane] = 1. / r.B.z();
+        dd[lane] = r.getDirectionSquaredLength();
+    }
+
+    inline ray get(int lane) const { return ray(vec3(ox[lane], oy[lane], oz[lane]), vec3(dx[lane], dy[lane], dz[lane])); }
+};
+
+namespace packet {
+
+    /**
+     * Packet width we use for a given instruction set, 1 meaning no packets at all
+     **/
+    inline int widthFor(simd::Level level) {
+        if (level >= simd::AVX2) return 8;
+        if (level >= simd::SSE4) return 4;
+        return 1;
+    }
+
+    // --- sphere ---------------------------------------------------------------------------
+    //
+    // Same math as `sphere::hit`, one lane per ray. Returns a bitmask of the lanes that hit the
+    // sphere inside (t_min, tbest[lane]) and lowers tbest for those lanes.
+
+#ifdef TRACER_X86
+    TARGET_SSE41 inline int intersectSphere4(const ray_packet& p, const vec3& center, float squaredRadius, float t_min,
+                                             float* tbest) {
+        const __m128 dx = _mm_load_ps(p.dx), dy = _mm_load_ps(p.dy), dz = _mm_load_ps(p.dz);
+        const __m128 ocx = _mm_sub_ps(_mm_load_ps(p.ox), _mm_set1_ps(center.x()));
+        const __m128 ocy = _mm_sub_ps(_mm_load_ps(p.oy), _mm_set1_ps(center.y()));
+        const __m128 ocz = _mm_sub_ps(_mm_load_ps(p.oz), _mm_set1_ps(center.z()));
+
+        const __m128 a = _mm_load_ps(p.dd);
+        const __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+        const __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)),
+                                               _mm_mul_ps(ocz, ocz)),
+                                    _mm_set1_ps(squaredRadius));
+        const __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(a, c));
+        const __m128 valid = _mm_cmpgt_ps(discriminant, _mm_setzero_ps());
+        if (_mm_movemask_ps(valid) == 0)
+            return 0;
+
+        const __m128 sqrtDiscriminantDivA = _mm_div_ps(_mm_sqrt_ps(_mm_max_ps(discriminant, _mm_setzero_ps())), a);
+        const __m128 minusBDivA = _mm_div_ps(_mm_sub_ps(_mm_setzero_ps(), b), a);
+        const __m128 t0 = _mm_sub_ps(minusBDivA, sqrtDiscriminantDivA);
+        const __m128 t1 = _mm_add_ps(minusBDivA, sqrtDiscriminantDivA);
+
+        const __m128 tmin = _mm_set1_ps(t_min);
+        const __m128 tmax = _mm_load_ps(tbest);
+        const __m128 hit0 = _mm_and_ps(valid, _mm_and_ps(_mm_cmplt_ps(t0, tmax), _mm_cmpgt_ps(t0, tmin)));
+        const __m128 hit1 = _mm_andnot_ps(hit0, _mm_and_ps(valid, _mm_and_ps(_mm_cmplt_ps(t1, tmax), _mm_cmpgt_ps(t1, tmin))));
+        const __m128 hit = _mm_or_ps(hit0, hit1);
+
+        const __m128 t = _mm_blendv_ps(t1, t0, hit0);
+        _mm_store_ps(tbest, _mm_blendv_ps(tmax, t, hit));
+        return _mm_movemask_ps(hit);
+    }
+
+    TARGET_AVX2 inline int intersectSphere8(const ray_packet& p, const vec3& center, float squaredRadius, float t_min,
+                                            float* tbest) {
+        const __m256 dx = _mm256_load_ps(p.dx), dy = _mm256_load_ps(p.dy), dz = _mm256_load_ps(p.dz);
+        const __m256 ocx = _mm256_sub_ps(_mm256_load_ps(p.ox), _mm256_set1_ps(center.x()));
+        const __m256 ocy = _mm256_sub_ps(_mm256_load_ps(p.oy), _mm256_set1_ps(center.y()));
+        const __m256 ocz = _mm256_sub_ps(_mm256_load_ps(p.oz), _mm256_set1_ps(center.z()));
+
+        const __m256 a = _mm256_load_ps(p.dd);
+        const __m256 b = _mm256_fmadd_ps(ocz, dz, _mm256_fmadd_ps(ocy, dy, _mm256_mul_ps(ocx, dx)));
+        const __m256 c = _mm256_sub_ps(_mm256_fmadd_ps(ocz, ocz, _mm256_fmadd_ps(ocy, ocy, _mm256_mul_ps(ocx, ocx))),
+                                       _mm256_set1_ps(squaredRadius));
+        const __m256 discriminant = _mm256_fmsub_ps(b, b, _mm256_mul_ps(a, c));
+        const __m256 valid = _mm256_cmp_ps(discriminant, _mm256_setzero_ps(), _CMP_GT_OQ);
+        if (_mm256_movemask_ps(valid) == 0)
+            return 0;
+
+        const __m256 sqrtDiscriminantDivA =
+            _mm256_div_ps(_mm256_sqrt_ps(_mm256_max_ps(discriminant, _mm256_setzero_ps())), a);
+        const __m256 minusBDivA = _mm256_div_ps(_mm256_sub_ps(_mm256_setzero_ps(), b), a);
+        const __m256 t0 = _mm256_sub_ps(minusBDivA, sqrtDiscriminantDivA);
+        const __m256 t1 = _mm256_add_ps(minusBDivA, sqrtDiscriminantDivA);
+
+        const __m256 tmin = _mm256_set1_ps(t_min);
+        const __m256 tmax = _mm256_load_ps(tbest);
+        const __m256 hit0 = _mm256_and_ps(
+            valid, _mm256_and_ps(_mm256_cmp_ps(t0, tmax, _CMP_LT_OQ), _mm256_cmp_ps(t0, tmin, _CMP_GT_OQ)));
+        const __m256 hit1 = _mm256_andnot_ps(
+            hit0, _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t1, tmax, _CMP_LT_OQ),
+                                                     _mm256_cmp_ps(t1, tmin, _CMP_GT_OQ))));
+        const __m256 hit = _mm256_or_ps(hit0, hit1);
+
+        const __m256 t = _mm256_blendv_ps(t1, t0, hit0);
+        _mm256_store_ps(tbest, _mm256_blendv_ps(tmax, t, hit));
+        return _mm256_movemask_ps(hit);
+    }
+#endif
+
+    inline int intersectSphereScalar(const ray_packet& p, const vec3& center, float squaredRadius, float t_min,
+                                     float* tbest) {
+        int mask = 0;
+        for (int lane = 0; lane < p.width; ++lane) {
+            const vec3 oc = vec3(p.ox[lane], p.oy[lane], p.oz[lane]) - center;
+            const vec3 d(p.dx[lane], p.dy[lane], p.dz[lane]);
+            const float a = p.dd[lane];
+            const float b = dot(oc, d);
+            const float c = dot(oc, oc) - squaredRadius;
+            const float discriminant = b * b - a * c;
+            if (discriminant <= 0)
+                continue;
+
+            const float sqrt_discriminant_div_a = sqrt(discriminant) / a;
+            const float minus_b_div_a = -b / a;
+            float t = minus_b_div_a - sqrt_discriminant_div_a;
+            if (!(t < tbest[lane] && t > t_min))
+                t = minus_b_div_a + sqrt_discriminant_div_a;
+            if (t < tbest[lane] && t > t_min) {
+                tbest[lane] = t;
+                mask |= 1 << lane;
+            }
+        }
+        return mask;
+    }
+
+    inline int intersectSphere(const ray_packet& p, const vec3& center, float squaredRadius, float t_min,
+                               float* tbest) {
+#ifdef TRACER_X86
+        if (p.width == 8)
+            return intersectSphere8(p, center, squaredRadius, t_min, tbest);
+        if (p.width == 4)
+            return intersectSphere4(p, center, squaredRadius, t_min, tbest);
+#endif
+        return intersectSphereScalar(p, center, squaredRadius, t_min, tbest);
+    }
+
+    // --- box ------------------------------------------------------------------------------
+    //
+    // Slab test for every lane. Returns a bitmask of the lanes whose ray overlaps the box inside
+    // (t_min, tbest[lane]). min/max return their second operand when the first is NaN, which
+    // keeps the running interval for rays lying exactly in a slab plane.
+
+#ifdef TRACER_X86
+    TARGET_SSE41 inline int intersectBox4(const ray_packet& p, const aabb& box, float t_min, const float* tbest) {
+        __m128 tnear = _mm_set1_ps(t_min);
+        __m128 tfar = _mm_load_ps(tbest);
+        const float* origins[3] = {p.ox, p.oy, p.oz};
+        const float* inverses[3] = {p.ix, p.iy, p.iz};
+        for (int a = 0; a < 3; ++a) {
+            const __m128 o = _mm_load_ps(origins[a]);
+            const __m128 inv = _mm_load_ps(inverses[a]);
+            const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.pmin[a]), o), inv);
+            const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.pmax[a]), o), inv);
+            tnear = _mm_max_ps(_mm_min_ps(t0, t1), tnear);
+            tfar = _mm_min_ps(_mm_max_ps(t0, t1), tfar);
+        }
+        return _mm_movemask_ps(_mm_cmple_ps(tnear, tfar));
+    }
+
+    TARGET_AVX2 inline int intersectBox8(const ray_packet& p, const aabb& box, float t_min, const float* tbest) {
+        __m256 tnear = _mm256_set1_ps(t_min);
+        __m256 tfar = _mm256_load_ps(tbest);
+        const float* origins[3] = {p.ox, p.oy, p.oz};
+        const float* inverses[3] = {p.ix, p.iy, p.iz};
+        for (int a = 0; a < 3; ++a) {
+            const __m256 o = _mm256_load_ps(origins[a]);
+            const __m256 inv = _mm256_load_ps(inverses[a]);
+            const __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.pmin[a]), o), inv);
+            const __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.pmax[a]), o), inv);
+            tnear = _mm256_max_ps(_mm256_min_ps(t0, t1), tnear);
+            tfar = _mm256_min_ps(_mm256_max_ps(t0, t1), tfar);
+        }
+        return _mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ));
+    }
+#endif
+
+    inline int intersectBoxScalar(const ray_packet& p, const aabb& box, float t_min, const float* tbest) {
+        int mask = 0;
+        for (int lane = 0; lane < p.width; ++lane) {
+            const vec3 origin(p.ox[lane], p.oy[lane], p.oz[lane]);
+            const vec3 invDirection(p.ix[lane], p.iy[lane], p.iz[lane]);
+            if (box.hit(origin, invDirection, t_min, tbest[lane]))
+                mask |= 1 << lane;
+        }
+        return mask;
+    }
+
+    inline int intersectBox(const ray_packet& p, const aabb& box, float t_min, const float* tbest) {
+#ifdef TRACER_X86
+        if (p.width == 8)
+            return intersectBox8(p, box, t_min, tbest);
+        if (p.width == 4)
+            return intersectBox4(p, box, t_min, tbest);
+#endif
+        return intersectBoxScalar(p, box, t_min, tbest);
+    }
+}
+
+#endif
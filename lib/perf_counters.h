@@ -0,0 +1,179 @@
+#ifndef PERFCOUNTERSH
+#define PERFCOUNTERSH
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "thread_pool.h"
+
+/**
+ * Hardware counters (cache and branch misses) of a stretch of the program, through Linux'
+ * perf_event_open. A Counters counts the thread that opened it, between `start` and `stop`; a
+ * PoolCounters the threads of the shared pool.
+ *
+ * Whether they're there at all depends on the kernel (perf_event_paranoid), the CPU and, in a
+ * VM, the hypervisor: `open` says why when they aren't, and elsewhere than Linux they never are.
+ **/
+namespace perf {
+
+    enum Event { CACHE_REFERENCES, CACHE_MISSES, BRANCH_MISSES, INSTRUCTIONS, NUM_EVENTS };
+
+    inline const char* name(Event event) {
+        switch (event) {
+            case CACHE_REFERENCES:
+                return "cache-references";
+            case CACHE_MISSES:
+                return "cache-misses";
+            case BRANCH_MISSES:
+                return "branch-misses";
+            default:
+                return "instructions";
+        }
+    }
+
+    class Counters {
+        public:
+            Counters() {
+                for (int e = 0; e < NUM_EVENTS; ++e)
+                    fds[e] = -1;
+            }
+            ~Counters() { close(); }
+            Counters(const Counters&) = delete;
+            Counters& operator=(const Counters&) = delete;
+
+            // opens all the counters, stopped, or none of them
+            bool open(std::string& error);
+            void close();
+            void start();
+            void stop();
+
+            // the count so far, false if the counter isn't open
+            bool read(Event event, uint64_t& value) const;
+
+        private:
+            int fds[NUM_EVENTS];
+    };
+
+    /**
+     * Counters on each of the threads a `numThreads` wide run of the shared pool goes to (it
+     * always hands task t to the same thread), added up
+     **/
+    class PoolCounters {
+        public:
+            bool open(unsigned numThreads, std::string& error) {
+                std::vector<std::string> errors(numThreads);
+                std::vector<uint8_t> opened(numThreads);
+                threads.clear();
+                for (unsigned t = 0; t < numThreads; ++t)
+                    threads.push_back(std::make_unique<Counters>());
+                threading::ThreadPool::shared().run(numThreads,
+                                                    [&](unsigned t) { opened[t] = threads[t]->open(errors[t]); });
+                for (unsigned t = 0; t < numThreads; ++t) {
+                    if (!opened[t]) {
+                        error = errors[t];
+                        threads.clear();
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            void start() {
+                for (auto& counters : threads)
+                    counters->start();
+            }
+            void stop() {
+                for (auto& counters : threads)
+                    counters->stop();
+            }
+
+            uint64_t read(Event event) const {
+                uint64_t sum = 0, value;
+                for (auto& counters : threads)
+                    if (counters->read(event, value))
+                        sum += value;
+                return sum;
+            }
+
+        private:
+            std::vector<std::unique_ptr<Counters>> threads;
+    };
+
+#ifdef __linux__
+
+    inline bool Counters::open(std::string& error) {
+        static const uint64_t configs[NUM_EVENTS] = {PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_CACHE_MISSES,
+                                                     PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_INSTRUCTIONS};
+        close();
+        for (int e = 0; e < NUM_EVENTS; ++e) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[e];
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fds[e] = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+            if (fds[e] < 0) {
+                error = std::string("perf_event_open: ") + std::strerror(errno);
+                close();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    inline void Counters::close() {
+        for (int e = 0; e < NUM_EVENTS; ++e) {
+            if (fds[e] >= 0)
+                ::close(fds[e]);
+            fds[e] = -1;
+        }
+    }
+
+    inline void Counters::start() {
+        for (int e = 0; e < NUM_EVENTS; ++e) {
+            if (fds[e] >= 0) {
+                ioctl(fds[e], PERF_EVENT_IOC_RESET, 0);
+                ioctl(fds[e], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    inline void Counters::stop() {
+        for (int e = 0; e < NUM_EVENTS; ++e)
+            if (fds[e] >= 0)
+                ioctl(fds[e], PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    inline bool Counters::read(Event event, uint64_t& value) const {
+        return fds[event] >= 0 && ::read(fds[event], &value, sizeof(value)) == ssize_t(sizeof(value));
+    }
+
+#else
+
+    inline bool Counters::open(std::string& error) {
+        error = "hardware counters are only read on Linux";
+        return false;
+    }
+    inline void Counters::close() {}
+    inline void Counters::start() {}
+    inline void Counters::stop() {}
+    inline bool Counters::read(Event, uint64_t&) const { return false; }
+
+#endif
+}
+
+#endif
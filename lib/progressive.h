@@ -0,0 +1,167 @@
+#ifndef PROGRESSIVEH
+#define PROGRESSIVEH
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "image.h"
+#include "rand.h"
+#include "scheduler.h"
+#include "thread_pool.h"
+#include "tracing.h"
+#include "wavefront.h"
+
+namespace progressive {
+
+    /**
+     * When a progressive render stops and how often it shows its work. Zero means no limit /
+     * never, but something has to stop it: `maxPasses` or `timeBudgetMs`.
+     **/
+    struct Settings {
+        unsigned int maxPasses;
+        double timeBudgetMs;
+        unsigned int snapshotPasses;  // write a snapshot every this many passes
+        double snapshotMs;            // or when this long has gone by since the last one
+    };
+
+    /**
+     * Running sum of the samples of every pixel, as floats (rows from the bottom, like Image),
+     * and the number of passes that went into it. Every pass adds one sample to every pixel.
+     **/
+    class Accumulator {
+        public:
+            Accumulator(int w, int h) : sums(size_t(w) * h * 3, 0.f), width(w), height(h), passes(0) {}
+
+            inline void add(const vec3& sample, int i, int j) {
+                float* s = &sums[3 * (size_t(j) * width + i)];
+                s[0] += sample[0];
+                s[1] += sample[1];
+                s[2] += sample[2];
+            }
+
+            // average of the passes so far, as linear radiance, rows split over `numThreads` threads
+            void resolve(Image& img, unsigned numThreads = 1) const {
+                const float scale = passes > 0 ? 1.f / passes : 0.f;
+                threading::parallelChunks(
+                    numThreads, size_t(height),
+                    [&](size_t begin, size_t end, unsigned) {
+                        for (int j = int(begin); j < int(end); ++j) {
+                            for (int i = 0; i < width; ++i) {
+                                const float* s = &sums[3 * (size_t(j) * width + i)];
+                                img.setPixel(scale * vec3(s[0], s[1], s[2]), i, j);
+                            }
+                        }
+                    },
+                    16);
+            }
+
+            std::vector<float> sums;
+            int width, height;
+            unsigned int passes;
+    };
+
+    /**
+     * One sample of pixel (i, j) in pass `pass`. Every (pass, pixel) pair has its own random
+     * stream, so a pass traces the same rays whichever thread gets it and however many passes
+     * came before. Pass 0 uses the stream `tracing::trace` gives the pixel, and every pass is the
+     * next sample of the pixel's sequence (see sampler.h).
+     **/
+    vec3 traceSample(int i, int j, unsigned int pass, const tracing::RayTracingConfig& config) {
+        const uint64_t pixels = uint64_t(config.width) * config.height;
+        seed_random(config.seed, uint64_t(pass) * pixels + uint64_t(j) * config.width + i);
+        return tracing::tracePixelSample(i, j, pass, config);
+    }
+
+    /**
+     * Adds one sample to every pixel of `acc`, tiles spread over `numThreads` threads. The
+     * wavefront integrator seeds its paths the same way, so it adds the very same samples.
+     **/
+    void renderPass(const tracing::RayTracingConfig& config, Accumulator& acc, unsigned numThreads) {
+        const unsigned int pass = acc.passes;
+        scheduler::runTiles(scheduler::makeTiles(config.width, config.height, config.tile_size), numThreads,
+                            [&](const scheduler::Tile& tile) {
+                                if (config.wavefront) {
+                                    wavefront::traceTile(tile, config, pass, 1, nullptr,
+                                                         [&](int i, int j, const vec3& sample) { acc.add(sample, i, j); });
+                                    return;
+                                }
+                                for (int j = tile.y0; j < tile.y1; ++j)
+                                    for (int i = tile.x0; i < tile.x1; ++i)
+                                        acc.add(traceSample(i, j, pass, config), i, j);
+                            });
+        acc.passes++;
+    }
+
+    /**
+     * Writes the current average of `acc` to `path`, through `img`. The file is written next to
+     * `path` and renamed over it, so whoever looks at it (or kills us) never sees half an image.
+     **/
+    bool writeSnapshot(const Accumulator& acc, Image& img, const std::string& path, ImageFormat format,
+                       unsigned numThreads = 1) {
+        acc.resolve(img, numThreads);
+        const std::string partial = path + ".part";
+        if (!img.writeToFile(partial, format, numThreads))
+            return false;
+#ifdef _WIN32
+        std::remove(path.c_str());  // rename doesn't replace existing files on Windows
+#endif
+        return std::rename(partial.c_str(), path.c_str()) == 0;
+    }
+
+    // called between passes, e.g. to checkpoint the buffer
+    typedef std::function<void(const Accumulator&)> PassCallback;
+
+    /**
+     * Renders pass after pass into `acc` until `settings` says stop, writing snapshots to
+     * `config.savepath` along the way. `acc` may already hold passes (of a resumed render), which
+     * count towards `maxPasses` but not the time budget. The budget is checked before each pass:
+     * we stop when the last pass says the next one wouldn't fit. Returns the number of snapshots written.
+     **/
+    unsigned int render(const tracing::RayTracingConfig& config, Accumulator& acc, Image& img, unsigned numThreads,
+                        const Settings& settings, ImageFormat format, const PassCallback& afterPass = nullptr) {
+        using std::chrono::duration;
+        using std::chrono::high_resolution_clock;
+        typedef duration<double, std::milli> ms;
+
+        const high_resolution_clock::time_point start = high_resolution_clock::now();
+        high_resolution_clock::time_point lastSnapshot = start;
+        unsigned int snapshots = 0, passesSinceSnapshot = 0;
+        double lastPassMs = 0;
+
+        while (settings.maxPasses == 0 || acc.passes < settings.maxPasses) {
+            const double elapsedMs = ms(high_resolution_clock::now() - start).count();
+            if (settings.timeBudgetMs > 0 && acc.passes > 0 && elapsedMs + lastPassMs > settings.timeBudgetMs)
+                break;
+
+            const high_resolution_clock::time_point passStart = high_resolution_clock::now();
+            renderPass(config, acc, numThreads);
+            const high_resolution_clock::time_point passEnd = high_resolution_clock::now();
+            lastPassMs = ms(passEnd - passStart).count();
+            ++passesSinceSnapshot;
+
+            const bool byPasses = settings.snapshotPasses > 0 && passesSinceSnapshot >= settings.snapshotPasses;
+            const bool byTime = settings.snapshotMs > 0 && ms(passEnd - lastSnapshot).count() >= settings.snapshotMs;
+            if (byPasses || byTime) {
+                if (writeSnapshot(acc, img, config.savepath, format, numThreads)) {
+                    ++snapshots;
+                    std::cout << "[Snapshot] " << acc.passes << " passes, " << ms(passEnd - start).count() / 1000.
+                              << "s" << std::endl;
+                } else {
+                    std::cerr << "Error writing snapshot to " << config.savepath << std::endl;
+                }
+                lastSnapshot = high_resolution_clock::now();
+                passesSinceSnapshot = 0;
+            }
+            if (afterPass)
+                afterPass(acc);
+        }
+        return snapshots;
+    }
+}
+
+#endif
@@ -1,10 +1,79 @@
 #ifndef RANDOMH
 #define RANDOMH
 
-#include <cstdlib>
+#include <cstdint>
+
+/**
+ * PCG32 generator (https://www.pcg-random.org), small and fast with good statistical quality.
+ *
+ * Every thread owns its own generator (see `thread_rng`), so sampling never touches shared
+ * state. glibc's `rand()` takes a process-wide lock on every call, which stopped us from
+ * scaling past a handful of threads.
+ **/
+class pcg32 {
+    public:
+        pcg32() { seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+        pcg32(uint64_t initstate, uint64_t initseq) { seed(initstate, initseq); }
+
+        inline void seed(uint64_t initstate, uint64_t initseq) {
+            state = 0U;
+            inc = (initseq << 1u) | 1u;
+            next();
+            state += initstate;
+            next();
+        }
+
+        inline uint32_t next() {
+            uint64_t oldstate = state;
+            state = oldstate * 6364136223846793005ULL + inc;
+            uint32_t xorshifted = uint32_t(((oldstate >> 18u) ^ oldstate) >> 27u);
+            uint32_t rot = uint32_t(oldstate >> 59u);
+            return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+        }
+
+        uint64_t state;
+        uint64_t inc;
+};
+
+/**
+ * splitmix64 finalizer, used to turn (seed, stream) pairs such as (render seed, pixel index)
+ * into well separated generator states. Neighbouring PCG streams seeded with plain counters
+ * are noticeably correlated.
+ **/
+inline uint64_t mix64(uint64_t z) {
+    z += 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+inline pcg32& thread_rng() {
+    static thread_local pcg32 rng;
+    return rng;
+}
+
+/**
+ * Generator for stream `stream` of the render seeded with `seed`, e.g. a pixel
+ **/
+inline pcg32 random_stream(uint64_t seed, uint64_t stream) {
+    const uint64_t s = mix64(seed ^ mix64(stream));
+    return pcg32(s, mix64(s));
+}
+
+/**
+ * Reseeds the calling thread's generator. Seeding per unit of work (e.g. per pixel) instead of
+ * per thread makes renders reproducible no matter which thread picks up which work.
+ **/
+inline void seed_random(uint64_t seed, uint64_t stream) {
+    thread_rng() = random_stream(seed, stream);
+}
+
+inline double random_double(pcg32& rng) {
+    return rng.next() * (1.0 / 4294967296.0);
+}
 
 inline double random_double() {
-    return rand() / (RAND_MAX + 1.0);
+    return random_double(thread_rng());
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,408 @@
+#ifndef SAMPLERH
+#define SAMPLERH
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "rand.h"
+
+/**
+ * Where the sample numbers of a path come from.
+ *
+ * Every sample of a pixel asks a PixelSampler for its numbers by slot: one for the position in
+ * the pixel, one for the lens, then a fixed block per bounce. Fixed slots mean the same decision
+ * of every sample of a pixel reads the same dimension of the sequence, which is what lets a low
+ * discrepancy sequence spread them out evenly instead of clumping like independent random
+ * numbers do. Every slot is two dimensions wide, a 1D decision uses the first one.
+ *
+ *  - RANDOM: a PCG stream (the thread's unless the sampler is given one), numbers in the order
+ *    they're asked for
+ *  - SOBOL: the first two dimensions of Sobol', a separately Owen scrambled (and shuffled) copy
+ *    per slot and pixel. The scrambles are hashes (Burley 2020, "Practical Hash-based Owen
+ *    Scrambling"), not stored per pixel; the only table is the second dimension's direction
+ *    numbers, a byte of the index at a time (SobolTable).
+ *  - HALTON: radical inverses in the first primes. Every digit is shifted by an offset of its
+ *    own per pixel and dimension, then permuted by one fixed table per prime and digit position,
+ *    the same for every pixel. Slots past the primes (the deeper bounces) take SOBOL's numbers
+ *  - BLUE_NOISE: the same Sobol' points in every pixel (scrambled per slot only), shifted by a
+ *    blue noise mask (Georgiev & Fajardo 2016). The error of neighbouring pixels is then
+ *    anti-correlated, it looks like fine grain instead of blotches at low sample counts.
+ **/
+namespace sampling {
+
+    enum class Method : uint8_t { RANDOM = 0, SOBOL = 1, HALTON = 2, BLUE_NOISE = 3 };
+
+    inline bool parse(const std::string& name, Method& method) {
+        if (name == "random")
+            method = Method::RANDOM;
+        else if (name == "sobol")
+            method = Method::SOBOL;
+        else if (name == "halton")
+            method = Method::HALTON;
+        else if (name == "bluenoise")
+            method = Method::BLUE_NOISE;
+        else
+            return false;
+        return true;
+    }
+
+    inline const char* name(Method method) {
+        switch (method) {
+            case Method::SOBOL: return "sobol";
+            case Method::HALTON: return "halton";
+            case Method::BLUE_NOISE: return "bluenoise";
+            default: return "random";
+        }
+    }
+
+    // slots of a camera sample
+    static const uint32_t PIXEL = 0;
+    static const uint32_t LENS = 1;
+    static const uint32_t FIRST_BOUNCE = 2;
+    // slots of every bounce, from FIRST_BOUNCE + depth * BOUNCE_SLOTS on
+    static const uint32_t LIGHT_PICK = 0;
+    static const uint32_t LIGHT_DIRECTION = 1;
+    static const uint32_t ROULETTE = 2;
+    static const uint32_t BSDF = 3;         // direction of the scattered ray
+    static const uint32_t BSDF_CHOICE = 4;  // the material's one extra number (see material::scatter)
+    static const uint32_t BOUNCE_SLOTS = 5;
+
+    inline uint32_t bounceSlot(unsigned int depth, uint32_t slot) {
+        return FIRST_BOUNCE + uint32_t(depth) * BOUNCE_SLOTS + slot;
+    }
+
+    namespace detail {
+        // largest float below 1, so a sample never rounds up to it
+        static const float ONE_MINUS_EPSILON = 0.99999994f;
+
+        inline uint32_t hash(uint32_t x) {
+            x ^= x >> 16;
+            x *= 0x7feb352dU;
+            x ^= x >> 15;
+            x *= 0x846ca68bU;
+            x ^= x >> 16;
+            return x;
+        }
+
+        inline uint32_t hashCombine(uint32_t seed, uint32_t v) {
+            return seed ^ (v + (seed << 6) + (seed >> 2));
+        }
+
+        inline uint32_t reverseBits(uint32_t x) {
+            x = (x << 16) | (x >> 16);
+            x = ((x & 0x00ff00ffU) << 8) | ((x & 0xff00ff00U) >> 8);
+            x = ((x & 0x0f0f0f0fU) << 4) | ((x & 0xf0f0f0f0U) >> 4);
+            x = ((x & 0x33333333U) << 2) | ((x & 0xccccccccU) >> 2);
+            x = ((x & 0x55555555U) << 1) | ((x & 0xaaaaaaaaU) >> 1);
+            return x;
+        }
+
+        /**
+         * Laine-Karras style permutation: every bit only depends on the bits below it. Vegdahl's
+         * constants ("Building a Better LK Hash", 2021), which also multiply by the seed: with
+         * Burley's, the scrambles of different seeds are visibly correlated.
+         **/
+        inline uint32_t laineKarras(uint32_t x, uint32_t seed) {
+            x ^= x * 0x3d20adeaU;
+            x += seed;
+            x *= (seed >> 16) | 1;
+            x ^= x * 0x05526c56U;
+            x ^= x * 0x53a22864U;
+            return x;
+        }
+
+        // Owen scrambling of a 0.32 fixed point number, each bit flipped depending on the ones above it
+        inline uint32_t owenScramble(uint32_t x, uint32_t seed) {
+            return reverseBits(laineKarras(reverseBits(x), seed));
+        }
+
+        /**
+         * Second dimension of Sobol' (primitive polynomial x + 1) with its bits reversed, a byte of
+         * the index at a time: entry [b][k] is the XOR of the direction numbers of the bits set in
+         * k << 8b. Direction numbers start at 1 and go v ^ (v << 1) in reversed form.
+         **/
+        struct SobolTable {
+            uint32_t bytes[4][256];
+
+            SobolTable() {
+                uint32_t directions[32];
+                directions[0] = 1;
+                for (int bit = 1; bit < 32; ++bit)
+                    directions[bit] = directions[bit - 1] ^ (directions[bit - 1] << 1);
+                for (int b = 0; b < 4; ++b) {
+                    for (uint32_t k = 0; k < 256; ++k) {
+                        uint32_t y = 0;
+                        for (int bit = 0; bit < 8; ++bit) {
+                            if ((k >> bit) & 1)
+                                y ^= directions[8 * b + bit];
+                        }
+                        bytes[b][k] = y;
+                    }
+                }
+            }
+        };
+
+        inline const SobolTable& sobolTable() {
+            static const SobolTable table;
+            return table;
+        }
+
+        inline float toFloat(uint32_t bits) {
+            return std::fmin(float(bits >> 8) * (1.f / 16777216.f), ONE_MINUS_EPSILON);
+        }
+
+        /**
+         * Sobol' point `index` of a pattern scrambled with `seed`, its order shuffled too so that
+         * slots sharing the same index don't line up. The first dimension (van der Corput) is the
+         * index with its bits reversed, so both dimensions are computed and scrambled in reversed
+         * form, which saves undoing and redoing the reversal around every scramble.
+         **/
+        inline void owenSobol2D(uint32_t index, uint32_t seed, float& u, float& v) {
+            const uint32_t shuffled = laineKarras(reverseBits(index), seed);  // reversed
+            const uint32_t i = reverseBits(shuffled);
+            const SobolTable& table = sobolTable();
+            const uint32_t y = table.bytes[0][i & 0xff] ^ table.bytes[1][(i >> 8) & 0xff] ^
+                               table.bytes[2][(i >> 16) & 0xff] ^ table.bytes[3][i >> 24];
+            u = toFloat(reverseBits(laineKarras(i, hashCombine(seed, 0xa511e9b3U))));
+            v = toFloat(reverseBits(laineKarras(y, hashCombine(seed, 0x63d83595U))));
+        }
+
+        static const uint32_t NUM_PRIMES = 32;
+        static const uint32_t PRIMES[NUM_PRIMES] = {2,  3,  5,  7,  11, 13, 17, 19, 23, 29,  31,  37,  41,  43,  47,  53,
+                                                    59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131};
+
+        /**
+         * A random permutation of the digits [0, base) for every digit position of every prime,
+         * for as many positions as a float resolves, back to back. Made once from a fixed seed,
+         * pixels differ by the digit shifts they apply before permuting.
+         **/
+        struct HaltonPermutations {
+            std::vector<uint8_t> digits;
+            uint32_t first[NUM_PRIMES];  // offset of the permutations of each prime
+
+            HaltonPermutations() {
+                pcg32 rng(0x5eed, 0x4a17);
+                for (uint32_t p = 0; p < NUM_PRIMES; ++p) {
+                    first[p] = uint32_t(digits.size());
+                    const uint32_t base = PRIMES[p];
+                    const float inverse = 1.f / float(base);
+                    // same positions as scrambledRadicalInverse's loop
+                    for (float factor = inverse; factor > 1e-7f; factor *= inverse) {
+                        const size_t start = digits.size();
+                        for (uint32_t d = 0; d < base; ++d)
+                            digits.push_back(uint8_t(d));
+                        for (uint32_t d = base - 1; d > 0; --d)  // Fisher-Yates
+                            std::swap(digits[start + d], digits[start + rng.next() % (d + 1)]);
+                    }
+                }
+            }
+        };
+
+        inline const HaltonPermutations& haltonPermutations() {
+            static const HaltonPermutations permutations;
+            return permutations;
+        }
+
+        /**
+         * Radical inverse of `index` in the prime PRIMES[p], every digit shifted by a random offset
+         * of its position and then randomly permuted. Shifting alone isn't enough: the first 29
+         * points of the primes 29 and 31, (i / 29, i / 31), sit on a line a shift only moves, and
+         * high primes are what the second and third bounces get.
+         **/
+        inline float scrambledRadicalInverse(uint32_t p, uint32_t index, uint32_t seed) {
+            const uint32_t base = PRIMES[p];
+            const uint8_t* permutation = &haltonPermutations().digits[haltonPermutations().first[p]];
+            const float inverse = 1.f / float(base);
+            float factor = inverse, result = 0;
+            uint32_t state = hash(seed);
+            for (; factor > 1e-7f; factor *= inverse, permutation += base) {
+                state = state * 747796405U + 2891336453U;  // a step of PCG's LCG per digit position
+                // past the last digit of `index` the scrambled zeros are just uniform digits, all of
+                // them together a uniform number below base * factor
+                if (index == 0)
+                    return std::fmin(result + float(base) * factor * toFloat(hash(state)), ONE_MINUS_EPSILON);
+                const uint32_t shift = uint32_t((uint64_t(state >> 8) * base) >> 24);
+                const uint32_t next = index / base;
+                uint32_t digit = index - next * base + shift;
+                digit = digit >= base ? digit - base : digit;
+                result += float(permutation[digit]) * factor;
+                index = next;
+            }
+            return std::fmin(result, ONE_MINUS_EPSILON);
+        }
+
+        static const int BLUE_NOISE_SIZE = 64;
+
+        /**
+         * Blue noise mask by void and cluster (Ulichney 1993): the ranks in which dots go into
+         * the largest hole of a pattern that's kept as even as possible, so the pixels of any
+         * threshold of it are evenly spaced. Values are (rank + 0.5) / pixels.
+         **/
+        std::vector<float> makeBlueNoise() {
+            const int n = BLUE_NOISE_SIZE, pixels = n * n;
+            const float sigma = 1.5f;
+
+            // energy one dot adds at every (wrapped around) offset
+            std::vector<float> splat(static_cast<size_t>(pixels));
+            for (int dy = 0; dy < n; ++dy) {
+                for (int dx = 0; dx < n; ++dx) {
+                    const int x = std::min(dx, n - dx), y = std::min(dy, n - dy);
+                    splat[size_t(dy * n + dx)] = std::exp(-float(x * x + y * y) / (2.f * sigma * sigma));
+                }
+            }
+            std::vector<uint8_t> dots(size_t(pixels), 0);
+            std::vector<float> energy(size_t(pixels), 0.f);
+            auto toggle = [&](int p) {
+                dots[size_t(p)] ^= 1;
+                const float sign = dots[size_t(p)] ? 1.f : -1.f;
+                const int px = p % n, py = p / n;
+                for (int q = 0; q < pixels; ++q) {
+                    const int dx = (q % n - px + n) % n, dy = (q / n - py + n) % n;
+                    energy[size_t(q)] += sign * splat[size_t(dy * n + dx)];
+                }
+            };
+            // densest dot, or emptiest hole
+            auto extreme = [&](uint8_t dot) {
+                int best = -1;
+                for (int p = 0; p < pixels; ++p) {
+                    if (dots[size_t(p)] == dot &&
+                        (best < 0 || (dot ? energy[size_t(p)] > energy[size_t(best)]
+                                          : energy[size_t(p)] < energy[size_t(best)])))
+                        best = p;
+                }
+                return best;
+            };
+
+            // random starting pattern, evened out by moving dots from clusters to holes
+            pcg32 rng(0x5eed, 0xb1be);
+            const int initial = pixels / 10;
+            for (int placed = 0; placed < initial;) {
+                const int p = int(rng.next() % uint32_t(pixels));
+                if (!dots[size_t(p)]) {
+                    toggle(p);
+                    ++placed;
+                }
+            }
+            for (;;) {
+                const int cluster = extreme(1);
+                toggle(cluster);
+                const int hole = extreme(0);
+                toggle(hole);
+                if (hole == cluster)
+                    break;
+            }
+
+            // rank the starting dots by taking them out densest first, then fill holes emptiest first
+            std::vector<float> mask(static_cast<size_t>(pixels));
+            const std::vector<uint8_t> start = dots;
+            const std::vector<float> startEnergy = energy;
+            for (int rank = initial - 1; rank >= 0; --rank) {
+                const int cluster = extreme(1);
+                toggle(cluster);
+                mask[size_t(cluster)] = (float(rank) + 0.5f) / float(pixels);
+            }
+            dots = start;
+            energy = startEnergy;
+            for (int rank = initial; rank < pixels; ++rank) {
+                const int hole = extreme(0);
+                toggle(hole);
+                mask[size_t(hole)] = (float(rank) + 0.5f) / float(pixels);
+            }
+            return mask;
+        }
+
+        // made on first use, the same every run
+        inline const std::vector<float>& blueNoise() {
+            static const std::vector<float> mask = makeBlueNoise();
+            return mask;
+        }
+    }
+
+    /**
+     * Sets up the tables `method` needs (they're computed on first use), so the time doesn't count
+     * towards the render
+     **/
+    inline void prepare(Method method) {
+        if (method == Method::SOBOL || method == Method::BLUE_NOISE)
+            detail::sobolTable();
+        if (method == Method::HALTON)
+            detail::haltonPermutations();
+        if (method == Method::BLUE_NOISE)
+            detail::blueNoise();
+    }
+
+    /**
+     * The numbers of sample `index` of pixel (i, j). RANDOM draws from `rng` if given, which has
+     * to outlive the sampler, and from the calling thread's generator otherwise.
+     **/
+    class PixelSampler {
+        public:
+            PixelSampler() = default;
+            PixelSampler(Method m, uint64_t seed, int i, int j, uint32_t sampleIndex, pcg32* rng = nullptr)
+                : method(m), x(i), y(j), index(sampleIndex),
+                  pixelSeed(detail::hash(uint32_t(mix64(seed) ^ mix64(uint64_t(uint32_t(j)) << 32 | uint32_t(i))))),
+                  patternSeed(uint32_t(mix64(seed))), stream(rng ? rng : &thread_rng()) {}
+
+            inline float get1D(uint32_t slot) {
+                if (method == Method::RANDOM)
+                    return float(random_double(*stream));
+                float u, v;
+                get2D(slot, u, v);
+                return u;
+            }
+
+            inline void get2D(uint32_t slot, float& u, float& v) {
+                switch (method) {
+                    case Method::SOBOL:
+                        detail::owenSobol2D(index, detail::hashCombine(pixelSeed, detail::hash(slot)), u, v);
+                        break;
+                    case Method::HALTON: {
+                        // past the primes, slots get the Sobol' pair: two dimensions in the same
+                        // prime share its permutations, so one would be a function of the other
+                        const uint32_t dimension = 2 * slot;
+                        if (dimension + 1 >= detail::NUM_PRIMES) {
+                            detail::owenSobol2D(index, detail::hashCombine(pixelSeed, detail::hash(slot)), u, v);
+                            break;
+                        }
+                        const uint32_t seed = detail::hashCombine(pixelSeed, detail::hash(dimension));
+                        u = detail::scrambledRadicalInverse(dimension, index, seed);
+                        v = detail::scrambledRadicalInverse(dimension + 1, index, detail::hash(seed));
+                        break;
+                    }
+                    case Method::BLUE_NOISE: {
+                        // every slot reads the mask at its own offset, and so do its two dimensions
+                        const uint32_t slotSeed = detail::hashCombine(patternSeed, detail::hash(slot));
+                        detail::owenSobol2D(index, slotSeed, u, v);
+                        const std::vector<float>& mask = detail::blueNoise();
+                        const int n = detail::BLUE_NOISE_SIZE;
+                        const uint32_t offset = detail::hash(slotSeed);
+                        const int ux = int((uint32_t(x) + offset) % n), uy = int((uint32_t(y) + (offset >> 8)) % n);
+                        const int vx = int((uint32_t(x) + (offset >> 16)) % n),
+                                  vy = int((uint32_t(y) + (offset >> 24)) % n);
+                        u += mask[size_t(uy * n + ux)];
+                        v += mask[size_t(vy * n + vx)];
+                        u = std::fmin(u - std::floor(u), detail::ONE_MINUS_EPSILON);
+                        v = std::fmin(v - std::floor(v), detail::ONE_MINUS_EPSILON);
+                        break;
+                    }
+                    default:
+                        u = float(random_double(*stream));
+                        v = float(random_double(*stream));
+                        break;
+                }
+            }
+
+        private:
+            Method method;
+            int x, y;
+            uint32_t index;
+            uint32_t pixelSeed;    // scrambles that differ from pixel to pixel
+            uint32_t patternSeed;  // scrambles shared by the whole image
+            pcg32* stream;
+    };
+}
+
+#endif
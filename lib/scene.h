@@ -3,26 +3,41 @@
 
 #include <algorithm>
 #include <memory>
+#include <string>
 
+#include "bvh.h"
 #include "rand.h"
 #include "sphere.h"
+#include "triangle_mesh.h"
 #include "hittable.h"
 #include "hittable_list.h"
 #include "material.h"
+#include "packed_spheres.h"
 #include "vec3.h"
+#include "wide_bvh.h"
 
 namespace scene {
 
-    std::unique_ptr<hittable> random_scene(bool floating) {
+    // random stream used to place the scene's objects, kept apart from the per-pixel streams
+    static const uint64_t SEED_STREAM = 0xffffffffffffffffULL;
+
+    /**
+     * Objects of our random scene, before they get organized into a world (see `build_world`), their
+     * materials added to `materials`.
+     * Without the centerpiece the big metal sphere in front of the camera is left out, to make room for a mesh.
+     **/
+    std::vector<std::unique_ptr<hittable>> random_scene_objects(material_table& materials, bool floating,
+                                                                bool centerpiece = true) {
         int n = 500;
         std::vector<std::unique_ptr<hittable>> list;
         list.reserve(n); // preallocate memory, but do not default construct (ie: nullptr)
+        const uint32_t glass = materials.add(dielectric(1.5));
 
         // add world sphere
         list.push_back(std::make_unique<sphere>(
             vec3(0, -1000, 0),
             1000, 
-            std::make_unique<lambertian>(vec3(0.5, 0.5, 0.5))
+            materials.add(lambertian(vec3(0.5, 0.5, 0.5)))
         ));
         
         for (int a = -11; a < 11; a++) {
@@ -56,24 +71,24 @@ namespace scene {
                 if ((center - vec3(4, 0.2, 0)).length() > 0.9) {
                     if (choose_mat < 0.8) {  // diffuse
                         list.push_back(std::make_unique<sphere>(center, 0.2,
-                            std::make_unique<lambertian>(vec3(
+                            materials.add(lambertian(vec3(
                                 random_double(),
                                 0.,
                                 0.)
-                            )
+                            ))
                         ));
                     }
                     else if (choose_mat < 0.95) { // metal
                         list.push_back(std::make_unique<sphere>(center, 0.2,
-                                std::make_unique<metal>(vec3(0.5*(1 + random_double()),
+                                materials.add(metal(vec3(0.5*(1 + random_double()),
                                             0.5*(random_double()),
                                             0.5*(random_double())),
-                                        0.5*random_double()))
+                                        0.5*random_double())))
                         );
                     }
                     else {  // glass
                         list.push_back(
-                            std::make_unique<sphere>(center, 0.2, std::make_unique<dielectric>(1.5))
+                            std::make_unique<sphere>(center, 0.2, glass)
                         );
                     }
                 }
@@ -81,11 +96,98 @@ namespace scene {
         }
 
         // add large spheres
-        list.push_back(std::make_unique<sphere>(vec3(0, 1, 0), 1.0, std::make_unique<dielectric>(1.5)));
-        list.push_back(std::make_unique<sphere>(vec3(-4, 1, 0), 1.0, std::make_unique<lambertian>(vec3(0.2, 0.2, 0.2))));
-        list.push_back(std::make_unique<sphere>(vec3(4, 1, 0), 1.0, std::make_unique<metal>(vec3(0.7, 0.6, 0.5), 0.)));
+        list.push_back(std::make_unique<sphere>(vec3(0, 1, 0), 1.0, glass));
+        list.push_back(std::make_unique<sphere>(vec3(-4, 1, 0), 1.0, materials.add(lambertian(vec3(0.2, 0.2, 0.2)))));
+        if (centerpiece)
+            list.push_back(std::make_unique<sphere>(vec3(4, 1, 0), 1.0, materials.add(metal(vec3(0.7, 0.6, 0.5), 0.))));
         
-        return std::make_unique<hittable_list>(std::move(list));
+        return list;
+    }
+
+    /**
+     * Hangs `n` glowing spheres of `intensity` times a warm white over the random scene, on a ring
+     * around the big spheres. Their radiance is what `lights::collect` later finds them by.
+     **/
+    void add_lights(std::vector<std::unique_ptr<hittable>>& list, material_table& materials, int n, float intensity) {
+        const vec3 warm(1.0, 0.85, 0.65);
+        const uint32_t glow = materials.add(diffuse_light(intensity * warm));
+        for (int k = 0; k < n; ++k) {
+            const float angle = 2. * M_PI * (k + random_double()) / n;
+            const vec3 center(6. * cos(angle), 3.5 + random_double(), 6. * sin(angle));
+            const float radius = 0.3 + 0.3 * random_double();
+            list.push_back(std::make_unique<sphere>(center, radius, glow));
+        }
+    }
+
+    std::unique_ptr<hittable> random_scene(material_table& materials, bool floating) {
+        return std::make_unique<hittable_list>(random_scene_objects(materials, floating));
+    }
+
+    /**
+     * Reads an OBJ file into `data`, scaled so its largest side is `size` and centered on `center`.
+     * Returns false and sets `error` if the file can't be loaded.
+     **/
+    bool load_mesh_data(const std::string& path, const vec3& center, float size, mesh_data& data, std::string& error) {
+        if (!obj::load(path, data, error))
+            return false;
+        if (data.numTriangles() == 0) {
+            error = path + " has no faces";
+            return false;
+        }
+
+        aabb bounds;
+        for (const vec3& p : data.positions)
+            bounds.grow(p);
+        const vec3 extent = bounds.extent();
+        const float largest = std::max(extent.x(), std::max(extent.y(), extent.z()));
+        const float scale = largest > 0 ? size / largest : 1.f;  // all its vertices on one point: nothing to scale
+        const vec3 offset = bounds.centroid();
+        for (vec3& p : data.positions)
+            p = center + scale * (p - offset);
+        return true;
+    }
+
+    /**
+     * Loads an OBJ file as a mesh of material `m` (see `load_mesh_data`), with its BVH built by `method`.
+     * Returns nullptr and sets `error` if the file can't be loaded.
+     **/
+    std::unique_ptr<hittable> load_mesh(const std::string& path, const vec3& center, float size, uint32_t m,
+                                        std::string& error, BuildMethod method = BuildMethod::SAH) {
+        mesh_data data;
+        if (!load_mesh_data(path, center, size, data, error))
+            return nullptr;
+        return std::make_unique<triangle_mesh>(std::move(data), m, method);
+    }
+
+    /**
+     * Wraps the objects in the acceleration structure named on the command line, trees built with `method`.
+     * Returns nullptr for an unknown name.
+     **/
+    std::unique_ptr<hittable> build_world(std::vector<std::unique_ptr<hittable>> objects, const std::string& accel,
+                                          BuildMethod method = BuildMethod::SAH) {
+        if (accel == "bvh")
+            return std::make_unique<bvh>(std::move(objects), method);
+        if (accel == "bvh4")
+            return std::make_unique<bvh4>(std::move(objects), method);
+        if (accel == "bvh8")
+            return std::make_unique<bvh8>(std::move(objects), method);
+        if (accel == "list")
+            return std::make_unique<hittable_list>(std::move(objects));
+        if (accel == "packed") {
+            // spheres go in the packed store, anything else (meshes) next to it in a plain list
+            std::vector<std::unique_ptr<hittable>> spheres, others;
+            for (auto& object : objects) {
+                if (dynamic_cast<sphere*>(object.get()))
+                    spheres.push_back(std::move(object));
+                else
+                    others.push_back(std::move(object));
+            }
+            if (others.empty())
+                return std::make_unique<packed_spheres>(std::move(spheres));
+            others.push_back(std::make_unique<packed_spheres>(std::move(spheres)));
+            return std::make_unique<hittable_list>(std::move(others));
+        }
+        return nullptr;
     }
 }
 
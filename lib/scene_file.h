@@ -0,0 +1,625 @@
+#ifndef SCENEFILEH
+#define SCENEFILEH
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "bvh.h"
+#include "camera.h"
+#include "hittable.h"
+#include "mapped_file.h"
+#include "material.h"
+#include "packed_spheres.h"
+#include "scene.h"
+#include "sphere.h"
+#include "vec3.h"
+
+/**
+ * Scenes as files instead of C++.
+ *
+ * The text form is one object per line, `#` starts a comment:
+ *
+ *     camera <from x y z> <at x y z> <up x y z> <fov degrees> [aperture] [focus distance]
+ *     material <name> lambertian <r g b>
+ *     material <name> metal <r g b> <fuzz>
+ *     material <name> dielectric <index of refraction>
+ *     material <name> light <r g b>
+ *     sphere <x y z> <radius> <material name>
+ *     mesh <file.obj> <x y z> <size> <material name>
+ *
+ * Materials have to be defined before they're used, mesh paths are relative to the scene file.
+ *
+ * The compiled (binary) form is made for big scenes: the spheres are stored as the padded
+ * structure of arrays packed_spheres works on, already in the leaf order of their BVH, and the
+ * BVH nodes and the material table are stored next to them. Loading maps the file into memory and points a
+ * packed_spheres view at it, so there's no parsing and no allocation per sphere, and the tree
+ * doesn't need building. The file is in host byte order and its leaf size follows the SIMD
+ * width of the machine that compiled it (any machine can render it). Meshes stay OBJ files,
+ * loaded when rendering, by their paths as resolved when compiling.
+ **/
+namespace scenefile {
+
+    struct SphereRecord {
+        vec3 center;
+        float radius;
+        uint32_t material;
+    };
+
+    struct MeshRecord {
+        std::string path;
+        vec3 center;
+        float size;
+        uint32_t material;
+    };
+
+    struct CameraSetup {
+        vec3 lookFrom, lookAt, up;
+        float fov;            // vertical, in degrees
+        float aperture;
+        float focusDistance;  // 0 to focus on lookAt
+    };
+
+    struct Description {
+        CameraSetup camera;
+        std::vector<std::string> materialNames;
+        std::vector<material> materials;
+        std::vector<SphereRecord> spheres;
+        std::vector<MeshRecord> meshes;
+    };
+
+    // the camera of the built-in random scene
+    inline CameraSetup defaultCamera() {
+        return CameraSetup{vec3(7.8, 1.5, 1.95), vec3(0, 1, 0), vec3(0, 1, 0), 45, 0, 0};
+    }
+
+    std::unique_ptr<camera> makeCamera(const CameraSetup& setup, float aspect) {
+        const float focus = setup.focusDistance > 0 ? setup.focusDistance : (setup.lookFrom - setup.lookAt).length();
+        return std::make_unique<camera>(setup.lookFrom, setup.lookAt, setup.up, setup.fov, aspect, setup.aperture,
+                                        focus);
+    }
+
+    /**
+     * Describes scene objects (spheres only) and their materials so they can be written out.
+     * Returns false and sets `error` for anything else.
+     **/
+    bool describe(const std::vector<std::unique_ptr<hittable>>& objects, const material_table& materials,
+                  const CameraSetup& cam, Description& scene, std::string& error) {
+        scene = Description();
+        scene.camera = cam;
+        scene.materials = materials.entries;
+        for (size_t k = 0; k < materials.size(); ++k)
+            scene.materialNames.push_back("m" + std::to_string(k));
+        for (const auto& object : objects) {
+            const sphere* s = dynamic_cast<const sphere*>(object.get());
+            if (!s) {
+                error = "only spheres can be written to a scene file";
+                return false;
+            }
+            scene.spheres.push_back(SphereRecord{s->center, s->radius, s->material_id});
+        }
+        return true;
+    }
+
+    namespace detail {
+        inline std::string directoryOf(const std::string& path) {
+            const size_t slash = path.find_last_of("/\\");
+            return slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+        }
+
+        inline bool isAbsolute(const std::string& path) {
+            return !path.empty() && (path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':'));
+        }
+
+        inline bool readVec(std::istringstream& in, vec3& v) {
+            return bool(in >> v.e[0] >> v.e[1] >> v.e[2]);
+        }
+
+        // vec3's operator<< is for debugging, this is the "x y z" the parser reads
+        inline std::string vecText(const vec3& v) {
+            std::ostringstream out;
+            out << std::setprecision(9) << v.x() << " " << v.y() << " " << v.z();
+            return out.str();
+        }
+    }
+
+    /**
+     * Reads a text scene. Returns false and sets `error` (with the line number) if it's malformed.
+     **/
+    bool parse(const std::string& path, Description& scene, std::string& error) {
+        std::ifstream file(path);
+        if (!file.is_open()) {
+            error = "can't open " + path;
+            return false;
+        }
+
+        scene = Description();
+        scene.camera = defaultCamera();
+        std::string line;
+        for (int lineNumber = 1; std::getline(file, line); ++lineNumber) {
+            const size_t comment = line.find('#');
+            if (comment != std::string::npos)
+                line.erase(comment);
+            std::istringstream in(line);
+            std::string keyword;
+            if (!(in >> keyword))
+                continue;
+
+            auto findMaterial = [&](const std::string& name, uint32_t& index) {
+                for (size_t k = 0; k < scene.materialNames.size(); ++k) {
+                    if (scene.materialNames[k] == name) {
+                        index = uint32_t(k);
+                        return true;
+                    }
+                }
+                return false;
+            };
+
+            bool ok = true;
+            std::string name;
+            if (keyword == "camera") {
+                CameraSetup& c = scene.camera;
+                ok = detail::readVec(in, c.lookFrom) && detail::readVec(in, c.lookAt) && detail::readVec(in, c.up) &&
+                     bool(in >> c.fov);
+                c.aperture = 0;
+                c.focusDistance = 0;
+                if (ok && (in >> c.aperture))
+                    in >> c.focusDistance;
+            } else if (keyword == "material") {
+                std::string type;
+                material m = lambertian(vec3(0, 0, 0));
+                ok = bool(in >> name >> type);
+                uint32_t existing;
+                if (ok && findMaterial(name, existing)) {
+                    error = path + ":" + std::to_string(lineNumber) + ": material '" + name + "' defined twice";
+                    return false;
+                }
+                vec3 color;
+                float param;
+                if (ok && type == "lambertian") {
+                    ok = detail::readVec(in, color);
+                    m = lambertian(color);
+                } else if (ok && type == "metal") {
+                    ok = detail::readVec(in, color) && bool(in >> param);
+                    m = metal(color, param);
+                } else if (ok && type == "dielectric") {
+                    ok = bool(in >> param);
+                    m = dielectric(param);
+                } else if (ok && type == "light") {
+                    ok = detail::readVec(in, color);
+                    m = diffuse_light(color);
+                } else {
+                    ok = false;
+                }
+                if (ok) {
+                    scene.materialNames.push_back(name);
+                    scene.materials.push_back(m);
+                }
+            } else if (keyword == "sphere") {
+                SphereRecord s;
+                ok = detail::readVec(in, s.center) && bool(in >> s.radius >> name);
+                if (ok && !findMaterial(name, s.material)) {
+                    error = path + ":" + std::to_string(lineNumber) + ": unknown material '" + name + "'";
+                    return false;
+                }
+                if (ok)
+                    scene.spheres.push_back(s);
+            } else if (keyword == "mesh") {
+                MeshRecord m;
+                ok = bool(in >> m.path) && detail::readVec(in, m.center) && bool(in >> m.size >> name);
+                if (ok && !findMaterial(name, m.material)) {
+                    error = path + ":" + std::to_string(lineNumber) + ": unknown material '" + name + "'";
+                    return false;
+                }
+                if (ok && !detail::isAbsolute(m.path))
+                    m.path = detail::directoryOf(path) + m.path;
+                if (ok)
+                    scene.meshes.push_back(m);
+            } else {
+                error = path + ":" + std::to_string(lineNumber) + ": unknown keyword '" + keyword + "'";
+                return false;
+            }
+
+            if (!ok) {
+                error = path + ":" + std::to_string(lineNumber) + ": can't read '" + keyword + "'";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Writes `scene` in the text form, floats in full precision so it reads back exactly
+     **/
+    bool writeText(const std::string& path, const Description& scene, std::string& error) {
+        std::ofstream file(path);
+        if (!file.is_open()) {
+            error = "can't open " + path;
+            return false;
+        }
+        file << std::setprecision(9);
+        const CameraSetup& c = scene.camera;
+        file << "camera " << detail::vecText(c.lookFrom) << " " << detail::vecText(c.lookAt) << " "
+             << detail::vecText(c.up) << " " << c.fov << " " << c.aperture << " "
+             << c.focusDistance << "\n";
+
+        static const char* const typeNames[] = {"lambertian", "metal", "dielectric", "light"};
+        for (size_t k = 0; k < scene.materials.size(); ++k) {
+            const material& m = scene.materials[k];
+            file << "material " << scene.materialNames[k] << " " << typeNames[uint32_t(m.type)] << " ";
+            if (m.type == MaterialType::DIELECTRIC)
+                file << m.param;
+            else
+                file << detail::vecText(m.color);
+            if (m.type == MaterialType::METAL)
+                file << " " << m.param;
+            file << "\n";
+        }
+        for (const SphereRecord& s : scene.spheres)
+            file << "sphere " << detail::vecText(s.center) << " " << s.radius << " " << scene.materialNames[s.material] << "\n";
+        for (const MeshRecord& m : scene.meshes)
+            file << "mesh " << m.path << " " << detail::vecText(m.center) << " " << m.size << " " << scene.materialNames[m.material]
+                 << "\n";
+
+        file.close();
+        if (!file) {
+            error = "error writing " + path;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Loads the meshes of a scene, with BVHs built by `method` and material ids offset by
+     * `firstMaterial`. Returns false and sets `error` if one can't be loaded.
+     **/
+    bool loadMeshes(const std::vector<MeshRecord>& meshes, uint32_t firstMaterial, BuildMethod method,
+                    std::vector<std::unique_ptr<hittable>>& objects, std::string& error) {
+        for (const MeshRecord& m : meshes) {
+            std::unique_ptr<hittable> mesh =
+                scene::load_mesh(m.path, m.center, m.size, firstMaterial + m.material, error, method);
+            if (!mesh)
+                return false;
+            objects.push_back(std::move(mesh));
+        }
+        return true;
+    }
+
+    /**
+     * The objects of a text scene, ready for scene::build_world, its materials added to `materials`
+     **/
+    bool instantiate(const Description& scene, material_table& materials, BuildMethod method,
+                     std::vector<std::unique_ptr<hittable>>& objects, std::string& error) {
+        const uint32_t first = uint32_t(materials.size());
+        for (const material& m : scene.materials)
+            materials.add(m);
+        objects.reserve(scene.spheres.size() + scene.meshes.size());
+        for (const SphereRecord& s : scene.spheres)
+            objects.push_back(std::make_unique<sphere>(s.center, s.radius, first + s.material));
+        return loadMeshes(scene.meshes, first, method, objects, error);
+    }
+
+    // --- compiled form --------------------------------------------------------------------------
+
+    static const char MAGIC[8] = {'D', 'R', 'E', 'V', 'O', 'S', 'C', 'N'};
+    static const uint32_t VERSION = 2;
+    // arrays start on cache lines
+    static const uint64_t ALIGNMENT = 64;
+
+    static_assert(std::is_trivially_copyable<bvh_node>::value, "bvh nodes are stored in the file as they are");
+    static_assert(std::is_trivially_copyable<material>::value && sizeof(material) == 20,
+                  "materials are stored in the file as they are");
+
+    /**
+     * Start of a compiled scene. Offsets are in bytes from the start of the file, sphere arrays
+     * hold numSpheres + packed_spheres::PADDING entries.
+     **/
+    struct BinaryHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t numMaterials, numSpheres, numNodes, numMeshes;
+        float camera[12];  // lookFrom, lookAt, up, fov, aperture, focusDistance
+        uint64_t materials, cx, cy, cz, squaredRadius, radius, materialIndex, nodes, meshes;
+    };
+
+    struct BinaryMesh {
+        float center[3];
+        float size;
+        uint32_t material;
+        uint32_t pathLength;
+        uint64_t path;  // offset of the (not terminated) path
+    };
+
+    inline bool isCompiled(const std::string& path) {
+        char magic[sizeof(MAGIC)] = {0};
+        std::FILE* f = std::fopen(path.c_str(), "rb");
+        if (!f)
+            return false;
+        const bool ok = std::fread(magic, 1, sizeof(magic), f) == sizeof(magic);
+        std::fclose(f);
+        return ok && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+    }
+
+    /**
+     * Writes the compiled form of `scene`: builds the spheres' BVH with `method` the way `bvh`
+     * would and stores spheres and nodes in leaf order. Returns false and sets `error` on failure.
+     **/
+    bool compile(const Description& scene, const std::string& path, BuildMethod method, std::string& error) {
+        const size_t n = scene.spheres.size();
+        const size_t padded = n + packed_spheres::PADDING;
+
+        std::vector<aabb> boxes(n);
+        for (size_t k = 0; k < n; ++k) {
+            const float r = std::fabs(scene.spheres[k].radius);
+            boxes[k] = aabb(scene.spheres[k].center - vec3(r, r, r), scene.spheres[k].center + vec3(r, r, r));
+        }
+        std::vector<bvh_node> nodes;
+        std::vector<int> order;
+        if (n > 0)
+            buildSphereHierarchy(boxes, bvh::MAX_LEAF_SIZE, bvh::MAX_PACKED_LEAF_SIZE, method, nodes, order);
+
+        // padding the way packed_spheres::finalize does it
+        const float never = -std::numeric_limits<float>::infinity();
+        std::vector<float> cx(padded, 0.f), cy(padded, 0.f), cz(padded, 0.f), squaredRadius(padded, never),
+            radius(padded, 1.f);
+        std::vector<uint32_t> materialIndex(padded, 0);
+        for (size_t k = 0; k < n; ++k) {
+            const SphereRecord& s = scene.spheres[order[k]];
+            cx[k] = s.center.x();
+            cy[k] = s.center.y();
+            cz[k] = s.center.z();
+            squaredRadius[k] = s.radius * s.radius;
+            radius[k] = s.radius;
+            materialIndex[k] = s.material;
+        }
+
+        BinaryHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.numMaterials = uint32_t(scene.materials.size());
+        header.numSpheres = uint32_t(n);
+        header.numNodes = uint32_t(nodes.size());
+        header.numMeshes = uint32_t(scene.meshes.size());
+        const CameraSetup& c = scene.camera;
+        const float cameraValues[12] = {c.lookFrom.x(), c.lookFrom.y(), c.lookFrom.z(), c.lookAt.x(), c.lookAt.y(),
+                                        c.lookAt.z(),   c.up.x(),       c.up.y(),       c.up.z(),     c.fov,
+                                        c.aperture,     c.focusDistance};
+        std::memcpy(header.camera, cameraValues, sizeof(cameraValues));
+
+        // lay out the sections
+        uint64_t offset = sizeof(BinaryHeader);
+        auto place = [&](uint64_t& field, uint64_t bytes) {
+            offset = (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+            field = offset;
+            offset += bytes;
+        };
+        place(header.materials, scene.materials.size() * sizeof(material));
+        place(header.cx, padded * sizeof(float));
+        place(header.cy, padded * sizeof(float));
+        place(header.cz, padded * sizeof(float));
+        place(header.squaredRadius, padded * sizeof(float));
+        place(header.radius, padded * sizeof(float));
+        place(header.materialIndex, padded * sizeof(uint32_t));
+        place(header.nodes, nodes.size() * sizeof(bvh_node));
+        place(header.meshes, scene.meshes.size() * sizeof(BinaryMesh));
+        std::vector<BinaryMesh> meshes(scene.meshes.size());
+        for (size_t k = 0; k < scene.meshes.size(); ++k) {
+            const MeshRecord& m = scene.meshes[k];
+            meshes[k] = BinaryMesh{{m.center.x(), m.center.y(), m.center.z()}, m.size, m.material,
+                                   uint32_t(m.path.size()), offset};
+            offset += m.path.size();
+        }
+
+        std::FILE* f = std::fopen(path.c_str(), "wb");
+        if (!f) {
+            error = "can't open " + path;
+            return false;
+        }
+        uint64_t written = 0;
+        bool ok = true;
+        auto put = [&](uint64_t at, const void* data, size_t bytes) {
+            static const char zeros[ALIGNMENT] = {0};
+            while (ok && written < at) {
+                const size_t gap = size_t(std::min<uint64_t>(at - written, ALIGNMENT));
+                ok = std::fwrite(zeros, 1, gap, f) == gap;
+                written += gap;
+            }
+            ok = ok && (bytes == 0 || std::fwrite(data, 1, bytes, f) == bytes);
+            written += bytes;
+        };
+        put(0, &header, sizeof(header));
+        put(header.materials, scene.materials.data(), scene.materials.size() * sizeof(material));
+        put(header.cx, cx.data(), padded * sizeof(float));
+        put(header.cy, cy.data(), padded * sizeof(float));
+        put(header.cz, cz.data(), padded * sizeof(float));
+        put(header.squaredRadius, squaredRadius.data(), padded * sizeof(float));
+        put(header.radius, radius.data(), padded * sizeof(float));
+        put(header.materialIndex, materialIndex.data(), padded * sizeof(uint32_t));
+        put(header.nodes, nodes.data(), nodes.size() * sizeof(bvh_node));
+        put(header.meshes, meshes.data(), meshes.size() * sizeof(BinaryMesh));
+        for (size_t k = 0; k < scene.meshes.size(); ++k)
+            put(meshes[k].path, scene.meshes[k].path.data(), scene.meshes[k].path.size());
+        ok = (std::fclose(f) == 0) && ok;
+        if (!ok)
+            error = "error writing " + path;
+        return ok;
+    }
+
+    /**
+     * A compiled scene mapped into memory. Keep it around as long as anything made from it: the
+     * sphere views read the mapped file directly.
+     **/
+    class CompiledScene {
+        public:
+            bool open(const std::string& path, std::string& error);
+
+            CameraSetup camera() const;
+            // the scene's material table, which the ids of everything else refer to
+            material_table materials() const;
+            // packed_spheres view of the spheres (in leaf order)
+            std::unique_ptr<packed_spheres> spheres() const;
+            // the BVH over `spheres()`
+            std::vector<bvh_node> nodes() const;
+            std::vector<MeshRecord> meshes() const;
+
+            size_t numSpheres() const { return header ? header->numSpheres : 0; }
+
+        private:
+            template <typename T>
+            const T* at(uint64_t offset) const {
+                return reinterpret_cast<const T*>(file.data() + offset);
+            }
+
+            MappedFile file;
+            const BinaryHeader* header = nullptr;
+    };
+
+    bool CompiledScene::open(const std::string& path, std::string& error) {
+        if (!file.open(path, error))
+            return false;
+        if (file.size() < sizeof(BinaryHeader) || std::memcmp(file.data(), MAGIC, sizeof(MAGIC)) != 0 ||
+            at<BinaryHeader>(0)->version != VERSION) {
+            error = path + " is not a compiled scene (of this version)";
+            return false;
+        }
+        header = at<BinaryHeader>(0);
+
+        // every section has to be inside the file
+        const uint64_t padded = uint64_t(header->numSpheres) + packed_spheres::PADDING;
+        const uint64_t sections[][2] = {{header->materials, header->numMaterials * sizeof(material)},
+                                        {header->cx, padded * sizeof(float)},
+                                        {header->cy, padded * sizeof(float)},
+                                        {header->cz, padded * sizeof(float)},
+                                        {header->squaredRadius, padded * sizeof(float)},
+                                        {header->radius, padded * sizeof(float)},
+                                        {header->materialIndex, padded * sizeof(uint32_t)},
+                                        {header->nodes, header->numNodes * sizeof(bvh_node)},
+                                        {header->meshes, header->numMeshes * sizeof(BinaryMesh)}};
+        for (const auto& section : sections) {
+            if (section[0] > file.size() || section[1] > file.size() - section[0]) {
+                error = path + " is truncated or corrupt";
+                header = nullptr;
+                return false;
+            }
+        }
+        // and every id has to name a material, the integrator looks them up unchecked
+        bool valid = true;
+        for (uint32_t k = 0; k < header->numMeshes; ++k) {
+            const BinaryMesh& m = at<BinaryMesh>(header->meshes)[k];
+            valid = valid && m.path <= file.size() && m.pathLength <= file.size() - m.path &&
+                    m.material < header->numMaterials;
+        }
+        for (uint32_t k = 0; k < header->numMaterials; ++k)
+            valid = valid && uint32_t(at<material>(header->materials)[k].type) <= uint32_t(MaterialType::LIGHT);
+        const uint32_t* ids = at<uint32_t>(header->materialIndex);
+        uint32_t largest = 0;
+        for (uint32_t k = 0; k < header->numSpheres; ++k)
+            largest = std::max(largest, ids[k]);
+        // the tree is traversed unchecked too: it has to be one, children after their parent (so
+        // traversal ends), each with one parent and no deeper than the traversal stack, and leaves
+        // have to stay within the spheres
+        const uint32_t numNodes = header->numNodes;
+        valid = valid && (header->numSpheres == 0 || numNodes > 0) && numNodes <= uint32_t(INT32_MAX);
+        const bvh_node* nodes = at<bvh_node>(header->nodes);
+        std::vector<uint8_t> parents(valid ? numNodes : 0, 0), depths(valid ? numNodes : 0, 0);
+        for (uint32_t k = 0; valid && k < numNodes; ++k) {
+            const bvh_node& node = nodes[k];
+            if (node.count > 0) {
+                valid = node.offset >= 0 && uint64_t(node.offset) + uint64_t(node.count) <= header->numSpheres;
+            } else {
+                valid = node.count == 0 && node.axis >= 0 && node.axis < 3 && k + 1 < numNodes &&
+                        node.offset > int64_t(k) + 1 && uint32_t(node.offset) < numNodes &&
+                        depths[k] < bvh_builder::MAX_DEPTH;
+                for (const uint32_t child : {k + 1, uint32_t(node.offset)}) {
+                    if (!valid)
+                        break;
+                    valid = ++parents[child] == 1;
+                    depths[child] = uint8_t(depths[k] + 1);
+                }
+            }
+            valid = valid && (k == 0 || parents[k] == 1);
+        }
+        if (!valid || (header->numSpheres > 0 && largest >= header->numMaterials)) {
+            error = path + " is truncated or corrupt";
+            header = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    CameraSetup CompiledScene::camera() const {
+        const float* c = header->camera;
+        return CameraSetup{vec3(c[0], c[1], c[2]), vec3(c[3], c[4], c[5]), vec3(c[6], c[7], c[8]), c[9], c[10],
+                           c[11]};
+    }
+
+    material_table CompiledScene::materials() const {
+        material_table table;
+        table.entries.assign(at<material>(header->materials), at<material>(header->materials) + header->numMaterials);
+        return table;
+    }
+
+    std::unique_ptr<packed_spheres> CompiledScene::spheres() const {
+        return std::make_unique<packed_spheres>(at<float>(header->cx), at<float>(header->cy), at<float>(header->cz),
+                                                at<float>(header->squaredRadius), at<float>(header->radius),
+                                                at<uint32_t>(header->materialIndex), int(header->numSpheres));
+    }
+
+    std::vector<bvh_node> CompiledScene::nodes() const {
+        return std::vector<bvh_node>(at<bvh_node>(header->nodes), at<bvh_node>(header->nodes) + header->numNodes);
+    }
+
+    std::vector<MeshRecord> CompiledScene::meshes() const {
+        std::vector<MeshRecord> out;
+        for (uint32_t k = 0; k < header->numMeshes; ++k) {
+            const BinaryMesh& m = at<BinaryMesh>(header->meshes)[k];
+            out.push_back(MeshRecord{std::string(at<char>(m.path), m.pathLength),
+                                     vec3(m.center[0], m.center[1], m.center[2]), m.size, m.material});
+        }
+        return out;
+    }
+
+    /**
+     * The world of a compiled scene in the acceleration structure named on the command line: the
+     * stored tree for bvh, collapsed for bvh4 / bvh8, or the flat arrays for packed. Meshes are
+     * loaded next to it, their material ids those of `compiled.materials()`. Returns nullptr and sets
+     * `error` on failure.
+     **/
+    std::unique_ptr<hittable> buildWorld(const CompiledScene& compiled, std::unique_ptr<packed_spheres> spheres,
+                                         const std::string& accel, BuildMethod method, std::string& error) {
+        std::unique_ptr<hittable> world;
+        if (compiled.numSpheres() == 0)
+            world = std::move(spheres);  // nothing to build a tree over
+        else if (accel == "bvh")
+            world = std::make_unique<bvh>(compiled.nodes(), std::move(spheres));
+        else if (accel == "bvh4")
+            world = std::make_unique<bvh4>(compiled.nodes(), std::move(spheres));
+        else if (accel == "bvh8")
+            world = std::make_unique<bvh8>(compiled.nodes(), std::move(spheres));
+        else if (accel == "packed")
+            world = std::move(spheres);
+        else {
+            error = "compiled scenes can't be rendered with '" + accel + "', use bvh, bvh4, bvh8 or packed";
+            return nullptr;
+        }
+
+        std::vector<std::unique_ptr<hittable>> meshes;
+        if (!loadMeshes(compiled.meshes(), 0, method, meshes, error))
+            return nullptr;
+        if (meshes.empty())
+            return world;
+        meshes.push_back(std::move(world));
+        return std::make_unique<hittable_list>(std::move(meshes));
+    }
+}
+
+#endif
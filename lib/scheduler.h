@@ -0,0 +1,153 @@
+#ifndef SCHEDULERH
+#define SCHEDULERH
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "adaptive.h"
+#include "image.h"
+#include "thread_pool.h"
+#include "tracing.h"
+
+namespace scheduler {
+
+    /**
+     * Rectangle of pixels [x0, x1) x [y0, y1) traced as one unit of work
+     **/
+    struct Tile {
+        int x0, y0, x1, y1;
+    };
+
+    /**
+     * Splits the image into tiles of (at most) `tileSize` x `tileSize` pixels, top row of tiles first
+     * since that's the order the image is written out in.
+     **/
+    std::vector<Tile> makeTiles(int width, int height, int tileSize) {
+        std::vector<Tile> tiles;
+        for (int y1 = height; y1 > 0; y1 -= tileSize) {
+            int y0 = std::max(0, y1 - tileSize);
+            for (int x0 = 0; x0 < width; x0 += tileSize) {
+                tiles.push_back(Tile{x0, y0, std::min(width, x0 + tileSize), y1});
+            }
+        }
+        return tiles;
+    }
+
+    /**
+     * Double ended queue of tiles owned by one worker. The owner takes tiles from the front and
+     * idle workers steal from the back, so the two rarely want the same tile at the same time.
+     * Tiles are coarse (hundreds of samples each), so a plain mutex per queue is plenty.
+     **/
+    class TileQueue {
+        public:
+            void push(const Tile& t) {
+                std::lock_guard<std::mutex> guard(lock);
+                tiles.push_back(t);
+            }
+
+            bool pop(Tile& t) {
+                std::lock_guard<std::mutex> guard(lock);
+                if (tiles.empty())
+                    return false;
+                t = tiles.front();
+                tiles.pop_front();
+                return true;
+            }
+
+            bool steal(Tile& t) {
+                std::lock_guard<std::mutex> guard(lock);
+                if (tiles.empty())
+                    return false;
+                t = tiles.back();
+                tiles.pop_back();
+                return true;
+            }
+
+        private:
+            std::deque<Tile> tiles;
+            std::mutex lock;
+    };
+
+    // one flag per pixel (indexed like the image), non-zero for pixels that are already traced
+    typedef std::vector<uint8_t> PixelMask;
+
+    /**
+     * Traces every pixel of `tile` into the image, except those already marked in `done`, and
+     * records how many samples each took in `counts` if given
+     **/
+    void traceTile(const Tile& tile, const tracing::RayTracingConfig& config, Image& img, const PixelMask* done,
+                   adaptive::SampleCounts* counts) {
+        for (int j = tile.y1 - 1; j >= tile.y0; --j) {
+            for (int i = tile.x0; i < tile.x1; ++i) {
+                if (done && (*done)[img.index(i, j)])
+                    continue;
+                unsigned int samples;
+                img.setPixel(tracing::trace(i, j, config, &samples), i, j);
+                if (counts)
+                    (*counts)[img.index(i, j)] = samples;
+            }
+        }
+    }
+
+    // called from the worker thread right after it finishes a tile
+    typedef std::function<void(const Tile&)> TileCallback;
+
+    /**
+     * Worker loop: drain our own queue, then go around the other queues stealing until all are empty.
+     * No new tiles are created while rendering, so once every queue is empty we're done.
+     **/
+    void worker(unsigned self, std::vector<std::unique_ptr<TileQueue>>& queues, const TileCallback& work) {
+        Tile tile;
+        while (true) {
+            bool found = queues[self]->pop(tile);
+            for (size_t k = 1; k < queues.size() && !found; ++k) {
+                found = queues[(self + k) % queues.size()]->steal(tile);
+            }
+            if (!found)
+                return;
+
+            work(tile);
+        }
+    }
+
+    /**
+     * Runs `work` on every tile on `numThreads` threads of the shared pool (the calling thread
+     * being one of them) with work stealing.
+     *
+     * Tiles are dealt out round robin, so every worker starts with tiles spread over the whole
+     * image instead of one band, and a worker that ends up with cheap tiles (sky) steals from
+     * one stuck with expensive ones (glass) instead of sitting idle.
+     **/
+    void runTiles(const std::vector<Tile>& tiles, unsigned numThreads, const TileCallback& work) {
+        std::vector<std::unique_ptr<TileQueue>> queues;
+        for (unsigned t = 0; t < numThreads; ++t)
+            queues.push_back(std::make_unique<TileQueue>());
+        for (size_t k = 0; k < tiles.size(); ++k)
+            queues[k % numThreads]->push(tiles[k]);
+
+        threading::ThreadPool::shared().run(numThreads, [&](unsigned t) { worker(t, queues, work); });
+    }
+
+    /**
+     * Renders the whole image on `numThreads` threads with work stealing (see `runTiles`).
+     *
+     * Pixels marked in `done` (e.g. by the estimator) are left as they are. The samples every
+     * other pixel took go in `counts`, if given (sized like the image).
+     **/
+    void renderTiles(const tracing::RayTracingConfig& config, Image& img, unsigned numThreads,
+                     const TileCallback& onTileDone = nullptr, const PixelMask* done = nullptr,
+                     adaptive::SampleCounts* counts = nullptr) {
+        runTiles(makeTiles(config.width, config.height, config.tile_size), numThreads, [&](const Tile& tile) {
+            traceTile(tile, config, img, done, counts);
+            if (onTileDone)
+                onTileDone(tile);
+        });
+    }
+}
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef SIMDH
+#define SIMDH
+
+#include <string>
+
+/**
+ * Runtime CPU feature detection for the SIMD kernels.
+ *
+ * The binary is compiled for the baseline instruction set, and the SSE / AVX kernels are
+ * compiled for their own instruction set through the TARGET_* function attributes. We only
+ * ever call a kernel after `simd::detect()` says the CPU running us supports it, so one
+ * build runs everywhere and still uses the widest vectors available.
+ **/
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define TRACER_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+// MSVC lets us use any intrinsic without changing the compilation target
+#define TARGET_SSE41
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+namespace simd {
+
+    // ordered from narrowest to widest, so `level >= AVX2` reads naturally
+    enum Level { SCALAR = 0, SSE4 = 1, AVX2 = 2, AVX512 = 3 };
+
+    inline Level detectUncached() {
+#if defined(TRACER_X86) && (defined(__GNUC__) || defined(__clang__))
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            return AVX512;
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            return AVX2;
+        if (__builtin_cpu_supports("sse4.1"))
+            return SSE4;
+        return SCALAR;
+#elif defined(TRACER_X86) && defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+        const bool sse41 = (info[2] & (1 << 19)) != 0;
+        const bool fma = (info[2] & (1 << 12)) != 0;
+        const bool osxsave = (info[2] & (1 << 27)) != 0;
+        // the OS also has to save the wide registers on context switches
+        const unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+        const bool ymm = (xcr0 & 0x6) == 0x6;
+        const bool zmm = (xcr0 & 0xe6) == 0xe6;
+        __cpuidex(info, 7, 0);
+        const bool avx2 = (info[1] & (1 << 5)) != 0;
+        const bool avx512f = (info[1] & (1 << 16)) != 0;
+        if (avx512f && zmm)
+            return AVX512;
+        if (avx2 && fma && ymm)
+            return AVX2;
+        if (sse41)
+            return SSE4;
+        return SCALAR;
+#else
+        return SCALAR;
+#endif
+    }
+
+    /**
+     * Widest instruction set this CPU supports (detected once)
+     **/
+    inline Level detect() {
+        static const Level level = detectUncached();
+        return level;
+    }
+
+    inline const char* name(Level level) {
+        switch (level) {
+            case AVX512: return "avx512";
+            case AVX2: return "avx2";
+            case SSE4: return "sse";
+            default: return "scalar";
+        }
+    }
+
+    /**
+     * Parses a command line level name. "auto" picks the widest supported level, and
+     * anything wider than the CPU supports is clamped down to what it does support.
+     * Returns false for an unknown name.
+     **/
+    inline bool parse(const std::string& s, Level& level) {
+        if (s == "auto") level = detect();
+        else if (s == "off" || s == "scalar") level = SCALAR;
+        else if (s == "sse") level = SSE4;
+        else if (s == "avx2") level = AVX2;
+        else if (s == "avx512") level = AVX512;
+        else return false;
+
+        if (level > detect())
+            level = detect();
+        return true;
+    }
+
+    /**
+     * Index of the lowest set bit of a (non zero) lane mask
+     **/
+    inline int lowestBit(unsigned mask) {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return int(index);
+#else
+        return __builtin_ctz(mask);
+#endif
+    }
+}
+
+#endif
@@ -6,15 +6,18 @@
 
 class sphere: public hittable  {
     public:
-        sphere(vec3 cen, float r, std::unique_ptr<material> m) 
-            : center(cen), radius(r), squaredRadius(r * r), mat_ptr(std::move(m)) {};
+        sphere(vec3 cen, float r, uint32_t m)
+            : center(cen), radius(r), squaredRadius(r * r), material_id(m) {};
         
         virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
+        virtual bool occluded(const ray& r, float t_min, float t_max) const;
+        virtual bool bounding_box(aabb& box) const;
+        virtual void hitPacket(const ray_packet& p, float t_min, packet_hit& hits) const;
 
         vec3 center;
         float radius;
         float squaredRadius;
-        std::unique_ptr<material> mat_ptr;
+        uint32_t material_id;
 };
 
 bool sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
@@ -33,7 +36,7 @@ bool sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec) const
             rec.t = temp;
             rec.p = r.pointAtParameter(rec.t);
             rec.normal = (rec.p - center) / radius;
-            rec.mat_ptr = mat_ptr.get();
+            rec.material_id = material_id;
             return true;
         }
 
@@ -42,12 +45,47 @@ bool sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec) const
             rec.t = temp;
             rec.p = r.pointAtParameter(rec.t);
             rec.normal = (rec.p - center) / radius;
-            rec.mat_ptr = mat_ptr.get();
+            rec.material_id = material_id;
             return true;
         }
     }
     return false;
 }
 
+bool sphere::occluded(const ray& r, float t_min, float t_max) const {
+    const vec3 oc = r.origin() - center;
+    const float a = dot(r.direction(), r.direction());
+    const float b = dot(oc, r.direction());
+    const float c = dot(oc, oc) - squaredRadius;
+    const float discriminant = b*b - a*c;
+    if (discriminant <= 0)
+        return false;
+
+    // either root inside the interval will do, no need to know which one is closer
+    const float sqrt_discriminant = sqrt(discriminant);
+    const float near = (-b - sqrt_discriminant) / a;
+    const float far = (-b + sqrt_discriminant) / a;
+    return (near < t_max && near > t_min) || (far < t_max && far > t_min);
+}
+
+void sphere::hitPacket(const ray_packet& p, float t_min, packet_hit& hits) const {
+    int mask = packet::intersectSphere(p, center, squaredRadius, t_min, hits.t);
+    for (int lane = 0; mask != 0; ++lane, mask >>= 1) {
+        if (mask & 1) {
+            hit_record& rec = hits.rec[lane];
+            rec.t = hits.t[lane];
+            rec.p = vec3(p.ox[lane], p.oy[lane], p.oz[lane]) + rec.t * vec3(p.dx[lane], p.dy[lane], p.dz[lane]);
+            rec.normal = (rec.p - center) / radius;
+            rec.material_id = material_id;
+            hits.mask |= 1 << lane;
+        }
+    }
+}
+
+bool sphere::bounding_box(aabb& box) const {
+    const float r = fabs(radius);
+    box = aabb(center - vec3(r, r, r), center + vec3(r, r, r));
+    return true;
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,151 @@
+#ifndef THREADPOOLH
+#define THREADPOOLH
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace threading {
+
+    namespace detail {
+        // set on pool workers, and on a thread while it runs a job: a run from there goes inline
+        inline bool& inJob() {
+            static thread_local bool busy = false;
+            return busy;
+        }
+
+        inline unsigned& defaultThreads() {
+            static unsigned n = std::max(1u, std::thread::hardware_concurrency());
+            return n;
+        }
+    }
+
+    /**
+     * Threads the parallel parts of the program use when not told otherwise (the BVH builders):
+     * every hardware thread, until `setDefaultThreads`
+     **/
+    inline unsigned defaultThreads() { return detail::defaultThreads(); }
+    inline void setDefaultThreads(unsigned n) { detail::defaultThreads() = std::max(1u, n); }
+
+    /**
+     * Worker threads that live as long as the program, so the build, estimate, render and write
+     * phases (and every progressive pass) reuse the same threads instead of starting their own:
+     * no thread start up per phase, and thread_local state (random streams, wavefront paths) is
+     * set up once.
+     *
+     * `run(n, body)` runs body(0) ... body(n - 1) at the same time, body(0) on the calling thread
+     * and body(t) always on the same worker, and returns once they're all done. Workers are
+     * started as a run first needs them. One run goes at a time; a run from inside a job (or from
+     * a worker) can't get more threads and runs its tasks one after the other on the spot.
+     **/
+    class ThreadPool {
+        public:
+            ThreadPool() : job(nullptr), tasks(0), generation(0), pending(0), stopping(false) {}
+            ~ThreadPool();
+            ThreadPool(const ThreadPool&) = delete;
+            ThreadPool& operator=(const ThreadPool&) = delete;
+
+            // the pool everything shares
+            static ThreadPool& shared() {
+                static ThreadPool pool;
+                return pool;
+            }
+
+            void run(unsigned numTasks, const std::function<void(unsigned)>& body);
+
+        private:
+            void work(unsigned task);
+
+            std::mutex runLock;  // one run at a time
+            std::mutex lock;     // guards everything below
+            std::condition_variable wake, finished;
+            std::vector<std::thread> workers;  // worker k runs task k + 1
+            const std::function<void(unsigned)>* job;
+            unsigned tasks;
+            uint64_t generation;  // of the current job, workers wait for it to change
+            unsigned pending;     // tasks of the workers not done yet
+            bool stopping;
+    };
+
+    inline ThreadPool::~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    inline void ThreadPool::run(unsigned numTasks, const std::function<void(unsigned)>& body) {
+        if (numTasks <= 1 || detail::inJob()) {
+            for (unsigned t = 0; t < numTasks; ++t)
+                body(t);
+            return;
+        }
+
+        std::lock_guard<std::mutex> serial(runLock);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            while (workers.size() < numTasks - 1)
+                workers.emplace_back(&ThreadPool::work, this, unsigned(workers.size()) + 1);
+            job = &body;
+            tasks = numTasks;
+            pending = numTasks - 1;
+            ++generation;
+        }
+        wake.notify_all();
+
+        detail::inJob() = true;
+        body(0);
+        detail::inJob() = false;
+
+        std::unique_lock<std::mutex> guard(lock);
+        finished.wait(guard, [&] { return pending == 0; });
+        job = nullptr;
+    }
+
+    inline void ThreadPool::work(unsigned task) {
+        detail::inJob() = true;
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [&] { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+            if (task >= tasks)
+                continue;
+
+            const std::function<void(unsigned)>& body = *job;
+            guard.unlock();
+            body(task);
+            guard.lock();
+            if (--pending == 0)
+                finished.notify_one();
+        }
+    }
+
+    /**
+     * Runs `body(begin, end, thread)` over [0, n) split into one contiguous chunk per thread, on the
+     * shared pool. Small inputs (under `minChunk` items a thread) use fewer threads, down to
+     * running inline.
+     **/
+    template <typename Body>
+    void parallelChunks(unsigned numThreads, size_t n, const Body& body, size_t minChunk = 1024) {
+        const size_t chunks = std::max<size_t>(1, std::min<size_t>(numThreads, n / minChunk));
+        if (chunks == 1) {
+            body(size_t(0), n, 0u);
+            return;
+        }
+        ThreadPool::shared().run(unsigned(chunks), [&](unsigned t) {
+            body(n * t / chunks, n * (t + 1) / chunks, t);
+        });
+    }
+}
+
+#endif
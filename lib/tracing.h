@@ -1,12 +1,20 @@
 #ifndef TRACINGH
 #define TRACINGH
 
+#include <algorithm>
+#include <cstdint>
 #include <limits>
+#include <vector>
 #include "vec3.h"
+#include "adaptive.h"
 #include "hittable.h"
+#include "light.h"
 #include "ray.h"
 #include "camera.h"
 #include "material.h"
+#include "packet.h"
+#include "rand.h"
+#include "sampler.h"
 
 namespace tracing {
 
@@ -23,81 +31,286 @@ namespace tracing {
     };
 
     struct RayTracingConfig {
-        unsigned int height, width, max_depth, num_samples;
+        unsigned int height, width, max_depth, num_samples, tile_size;
+        bool russian_roulette;
+        unsigned int rr_depth;  // bounce at which Russian roulette kicks in
+        unsigned int packet_width;  // camera rays traced together, 1 for no packets
         std::unique_ptr<camera> cam;
         std::unique_ptr<hittable> world;
         std::string savepath;
+        std::string accel;
         float estimate;
+        uint64_t seed;
+        material_table materials;          // what the objects' material ids refer to
+        sampling::Method sampler;          // where the numbers of every sample come from
+        std::vector<sphere_light> lights;  // emitters that get sampled directly
+        bool nee;                          // next event estimation, see `colorFromHit`
+        float sky;                         // brightness of the background
+        bool adaptive;                     // sample each pixel until it converges, see `traceAdaptive`
+        unsigned int min_samples, max_samples;
+        float error_threshold;             // 95% confidence half width, in display units
+        bool wavefront;                    // trace whole waves of paths stage by stage, see wavefront.h
+        bool sort_rays;                    // and sort their rays and hits between the stages
     };
 
-    vec3 color(const ray& r, const RayTracingConfig& config, unsigned int depth) {
-        hit_record rec;
+    /**
+     * Sky gradient for rays that escape the scene
+     **/
+    vec3 background(const ray& r) {
+        vec3 unitDirection = unitVector(r.direction());
+        float t = unitDirection.y() / 2. + 0.5;
+        //   return (1. - t) * white + t * blue;
+        return (1. - t) * white + t * red;
+        //   return (1. - t) * red + t * white;
+    }
+
+    /**
+     * MIS weight of an emitter a path ran into. `scatterPdf` is the density of the bounce that
+     * found it if a light sample from `scatterOrigin` could have found it too, 0 otherwise.
+     **/
+    inline float emitterWeight(const hit_record& rec, float scatterPdf, const vec3& scatterOrigin,
+                               const RayTracingConfig& config) {
+        if (config.nee && !config.lights.empty() && scatterPdf > 0)
+            return lights::powerHeuristic(scatterPdf, lights::pdf(config.lights, scatterOrigin, rec));
+        return 1;
+    }
 
-        // if it's a valid (positive) time (in front of camera), then display a gradient
-        // based on the normal vector from the center of the circle to the intersection point
-        if (config.world->hit(r, 0.001, std::numeric_limits<float>::max(), rec)) {
+    /**
+     * Light sample of the diffuse hit `rec` at bounce `depth`: the shadow ray goes from `rec.p`
+     * along `direction` for `distance`, and `light` is what it brings if nothing's in the way.
+     * Returns false when there's nothing to sample.
+     **/
+    inline bool sampleLight(const hit_record& rec, const material& mat, unsigned int depth, const vec3& throughput,
+                            const RayTracingConfig& config, sampling::PixelSampler& sampler, vec3& direction,
+                            float& distance, vec3& light) {
+        vec3 lightEmission;
+        float lightPdf, u, v;
+        const float pick = sampler.get1D(sampling::bounceSlot(depth, sampling::LIGHT_PICK));
+        sampler.get2D(sampling::bounceSlot(depth, sampling::LIGHT_DIRECTION), u, v);
+        if (!lights::sample(config.lights, rec.p, pick, u, v, direction, distance, lightEmission, lightPdf) ||
+            dot(direction, rec.normal) <= 0)
+            return false;
+        const float weight = lights::powerHeuristic(lightPdf, mat.scatteringPdf(rec, direction));
+        light = (weight / lightPdf) * throughput * mat.evaluate(rec, direction) * lightEmission;
+        return true;
+    }
+
+    /**
+     * Scatters the path in `current` off the surface it hit at bounce `depth`: `current` becomes
+     * the scattered ray, `throughput` takes the attenuation (and Russian roulette's reweighting),
+     * and `scatterPdf` / `scatterOrigin` are set up for weighing the emitter it may hit next.
+     * Returns false when the path ends here, absorbed or cut by Russian roulette.
+     **/
+    inline bool bounce(ray& current, const hit_record& rec, const material& mat, unsigned int depth,
+                       const RayTracingConfig& config, sampling::PixelSampler& sampler, vec3& throughput,
+                       float& scatterPdf, vec3& scatterOrigin) {
         ray scattered;
         vec3 attenuation;
-
-        if (depth < config.max_depth && rec.mat_ptr->scatter(r, rec, attenuation, scattered)) {
-            // scattered
-            return attenuation * color(scattered, config, depth + 1);
-        
-        } else {
+        float u, v;
+        sampler.get2D(sampling::bounceSlot(depth, sampling::BSDF), u, v);
+        const float w = sampler.get1D(sampling::bounceSlot(depth, sampling::BSDF_CHOICE));
+        if (!mat.scatter(current, rec, u, v, w, attenuation, scattered)) {
             // absorbed
-            return vec3(0, 0, 0);
+            return false;
         }
 
-        } else {
-            // we didn't hit the sphere, so render the background
-            vec3 unitDirection = unitVector(r.direction());
-            float t = unitDirection.y() / 2. + 0.5;
-            //   return (1. - t) * white + t * blue;
-            return (1. - t) * white + t * red;
-            //   return (1. - t) * red + t * white;
+        scatterPdf = 0;
+        if (config.nee && !config.lights.empty() && mat.isDiffuse()) {
+            scatterPdf = mat.scatteringPdf(rec, unitVector(scattered.direction()));
+            scatterOrigin = rec.p;
         }
+
+        throughput *= attenuation;
+        current = scattered;
+
+        if (config.russian_roulette && depth + 1 >= config.rr_depth) {
+            float survive = std::min(1.f, std::max(throughput.r(), std::max(throughput.g(), throughput.b())));
+            if (sampler.get1D(sampling::bounceSlot(depth, sampling::ROULETTE)) >= survive)
+                return false;
+            throughput /= survive;
+        }
+        return true;
     }
 
     /**
-     * Traces a single pixel
+     * Follows one path through the scene and returns the light it carries back to the camera,
+     * starting from the result of intersecting its first ray (`hit` and `rec`). The light and
+     * Russian roulette decisions of every bounce take their numbers from `sampler`.
+     *
+     * Written as a loop instead of recursion: `throughput` is the product of the attenuations
+     * seen so far, so each bounce only costs one hit_record and one ray no matter how deep we go.
+     *
+     * With Russian roulette enabled, from bounce `rr_depth` on a path survives with probability
+     * equal to its brightest throughput channel and is reweighted by 1 / p when it does. Dim paths,
+     * which contribute almost nothing, get cut early while the image stays unbiased.
+     *
+     * With next event estimation, every diffuse hit also sends a shadow ray to a point on one of
+     * `config.lights`. Emitters are then reached two ways, by the shadow ray and by the scattered
+     * ray happening to run into them, and multiple importance sampling (power heuristic) weighs
+     * each by how likely the other strategy was to find the same direction. Light sampling wins on
+     * small lights, BSDF sampling on big ones, and the weights add up to one so nothing is counted
+     * twice. Hits on emitters right after the camera or a mirror / glass bounce count fully, since
+     * no shadow ray could have found them.
+     *
+     * The steps of a bounce are the helpers above, which the wavefront integrator (wavefront.h)
+     * runs as separate stages.
      **/
-    vec3 trace(int i, int j, const RayTracingConfig& config) {
-        vec3 c(0, 0, 0);
+    vec3 colorFromHit(const ray& r, bool hit, hit_record rec, const RayTracingConfig& config,
+                      sampling::PixelSampler& sampler) {
+        ray current = r;
+        vec3 throughput(1, 1, 1);
+        vec3 radiance(0, 0, 0);
+        const bool sampleLights = config.nee && !config.lights.empty();
+        float scatterPdf = 0;  // density of the last bounce if it was diffuse, 0 if it can't be light sampled
+        vec3 scatterOrigin;
+
+        for (unsigned int depth = 0;; ++depth) {
+            if (!hit) {
+                // we didn't hit anything, so render the background
+                return radiance + throughput * config.sky * background(current);
+            }
+
+            const material& mat = config.materials[rec.material_id];
+            const vec3 emitted = mat.emitted();
+            if (emitted.r() > 0 || emitted.g() > 0 || emitted.b() > 0)
+                radiance += emitterWeight(rec, scatterPdf, scatterOrigin, config) * throughput * emitted;
+
+            if (depth >= config.max_depth)
+                return radiance;
 
-        // decide our color with `config.num_samples` random rays
-        for (unsigned int s = 0; s < config.num_samples; ++s) {  // pre-increment doesn't need variable on stack!
-            float xPercent = float(i + random_double()) / float(config.width);
-            float yPercent = float(j + random_double()) / float(config.height);
-            ray r = config.cam->get_ray(xPercent, yPercent);
-            c += color(r, config, 0); // depth = 0
+            vec3 direction, light;
+            float distance;
+            if (sampleLights && mat.isDiffuse() &&
+                sampleLight(rec, mat, depth, throughput, config, sampler, direction, distance, light) &&
+                !config.world->occluded(ray(rec.p, direction), 0.001, distance * 0.999f)) {
+                radiance += light;
+            }
+
+            if (!bounce(current, rec, mat, depth, config, sampler, throughput, scatterPdf, scatterOrigin))
+                return radiance;
+
+            hit = config.world->hit(current, 0.001, std::numeric_limits<float>::max(), rec);
         }
-        c /= float(config.num_samples);
-        vec3 gamma_corrected(sqrt(c[0]), sqrt(c[1]), sqrt(c[2]));
+    }
 
-        // make our color
-        int ir = int(gamma_corrected[0] * 255.99);
-        int ig = int(gamma_corrected[1] * 255.99);
-        int ib = int(gamma_corrected[2] * 255.99);
-        return vec3(ir, ig, ib);
+    vec3 color(const ray& r, const RayTracingConfig& config, sampling::PixelSampler& sampler) {
+        hit_record rec;
+        bool hit = config.world->hit(r, 0.001, std::numeric_limits<float>::max(), rec);
+        return colorFromHit(r, hit, rec, config, sampler);
     }
 
     /**
-     * Batch of pixels to trace within a single thread
-     * 
-     * We use a lambda to set our Image object directly from threads. Each thread has a 
-     * non-overlapping set of pixels to compute, so no thread coorination is necessary.
+     * Camera ray of a sample: where it goes through the pixel (i, j) and where it leaves the lens
      **/
-    void tracePixelBatch(int start, int end, const std::vector<TracedPixel>& jobs, const RayTracingConfig& config, Image& img) {
-        std::for_each(
-            jobs.begin() + start,
-            jobs.begin() + end,
-            [&](TracedPixel pixel) {
-                vec3 c = trace(pixel.i, pixel.j, config);
-                img.setPixel(c, pixel.i, pixel.j);
+    ray cameraRay(int i, int j, const RayTracingConfig& config, sampling::PixelSampler& sampler) {
+        float u, v, lensU, lensV;
+        sampler.get2D(sampling::PIXEL, u, v);
+        sampler.get2D(sampling::LENS, lensU, lensV);
+        float xPercent = (i + u) / float(config.width);
+        float yPercent = (j + v) / float(config.height);
+        return config.cam->get_ray(xPercent, yPercent, lensU, lensV);
+    }
+
+    /**
+     * Traces `packet_width` samples of the pixel at once: the camera rays go through the world
+     * as one ray_packet and only the bounces after the first hit are traced ray by ray.
+     * Samples of one pixel are the most coherent rays we have, and keeping the packet inside
+     * one pixel keeps the pixel's random stream (and so the image) independent of scheduling.
+     * The lanes are samples `first` on. Returns the sum of the samples, and each one in
+     * `laneColors` if given.
+     **/
+    vec3 tracePacket(int i, int j, unsigned int first, const RayTracingConfig& config, vec3* laneColors = nullptr) {
+        ray_packet packet;
+        packet.width = config.packet_width;
+        packet_hit hits;
+        ray rays[ray_packet::MAX_WIDTH];
+        sampling::PixelSampler samplers[ray_packet::MAX_WIDTH];
+
+        for (int lane = 0; lane < packet.width; ++lane) {
+            samplers[lane] = sampling::PixelSampler(config.sampler, config.seed, i, j, first + lane);
+            rays[lane] = cameraRay(i, j, config, samplers[lane]);
+            packet.set(lane, rays[lane]);
+        }
+
+        hits.reset(std::numeric_limits<float>::max());
+        config.world->hitPacket(packet, 0.001, hits);
+
+        vec3 c(0, 0, 0);
+        for (int lane = 0; lane < packet.width; ++lane) {
+            const vec3 sample = colorFromHit(rays[lane], hits.hit(lane), hits.rec[lane], config, samplers[lane]);
+            if (laneColors)
+                laneColors[lane] = sample;
+            c += sample;
+        }
+        return c;
+    }
+
+    /**
+     * Sample number `index` of the pixel: a ray through it, traced on its own
+     **/
+    vec3 tracePixelSample(int i, int j, unsigned int index, const RayTracingConfig& config) {
+        sampling::PixelSampler sampler(config.sampler, config.seed, i, j, index);
+        return color(cameraRay(i, j, config, sampler), config, sampler);
+    }
+
+    /**
+     * Samples the pixel until we're confident enough in its value: at least `min_samples`, then
+     * until the 95% confidence interval of its mean is narrower than `error_threshold` (in display
+     * units, see adaptive::PixelStats) or `max_samples` is reached. The sky and flat walls stop
+     * near the minimum, and the samples they don't need go to the caustics and soft shadows that
+     * run up to the maximum. Sets `taken` to the number of samples that took.
+     **/
+    vec3 traceAdaptive(int i, int j, const RayTracingConfig& config, unsigned int& taken) {
+        adaptive::PixelStats stats;
+        vec3 lanes[ray_packet::MAX_WIDTH];
+
+        while (stats.count < config.max_samples) {
+            if (config.packet_width > 1 && stats.count + config.packet_width <= config.max_samples) {
+                tracePacket(i, j, stats.count, config, lanes);
+                for (unsigned int lane = 0; lane < config.packet_width; ++lane)
+                    stats.add(lanes[lane]);
+            } else {
+                stats.add(tracePixelSample(i, j, stats.count, config));
             }
-        );
+            if (stats.count >= config.min_samples && stats.error() < config.error_threshold)
+                break;
+        }
+        taken = stats.count;
+        return stats.mean;
+    }
+
+    /**
+     * Traces a single pixel, returning the average (linear) color of its samples and how many
+     * there were in `samplesTaken` if given
+     **/
+    vec3 trace(int i, int j, const RayTracingConfig& config, unsigned int* samplesTaken = nullptr) {
+        // every pixel gets its own random stream, so the image doesn't depend on thread scheduling
+        seed_random(config.seed, uint64_t(j) * config.width + i);
+
+        if (config.adaptive) {
+            unsigned int taken;
+            const vec3 c = traceAdaptive(i, j, config, taken);
+            if (samplesTaken)
+                *samplesTaken = taken;
+            return c;
+        }
+
+        // decide our color with `config.num_samples` random rays, as many as we can in packets
+        vec3 c(0, 0, 0);
+        unsigned int s = 0;
+        if (config.packet_width > 1) {
+            for (; s + config.packet_width <= config.num_samples; s += config.packet_width)
+                c += tracePacket(i, j, s, config);
+        }
+        for (; s < config.num_samples; ++s)  // pre-increment doesn't need variable on stack!
+            c += tracePixelSample(i, j, s, config);
+        // linear radiance, the framebuffer takes care of gamma and quantizing
+        c /= float(config.num_samples);
+        if (samplesTaken)
+            *samplesTaken = config.num_samples;
+        return c;
     }
 
 }
 
-#endif
\ No newline at end of file
+#endif
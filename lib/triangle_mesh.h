@@ -0,0 +1,168 @@
+#ifndef TRIANGLEMESHH
+#define TRIANGLEMESHH
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "bvh.h"
+#include "hittable.h"
+#include "material.h"
+#include "obj_loader.h"
+
+/**
+ * Indexed triangle mesh with its own BVH.
+ *
+ * Vertex positions and normals live in shared buffers and each triangle is three indices into
+ * them. At construction the triangles are sorted into the order of the BVH leaves, so a leaf is a
+ * contiguous run of index triples and there's no per-triangle object or virtual call.
+ *
+ * The whole mesh is a single hittable, so the scene's top level acceleration structure only sees
+ * its bounding box and hands rays that reach it to the mesh BVH.
+ **/
+class triangle_mesh : public hittable {
+    public:
+        static const int MAX_LEAF_SIZE = 4;
+
+        triangle_mesh(mesh_data data, uint32_t m, BuildMethod method = BuildMethod::SAH);
+
+        virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        virtual bool occluded(const ray& r, float t_min, float t_max) const;
+        virtual bool bounding_box(aabb& box) const;
+
+        inline size_t numTriangles() const { return mesh.numTriangles(); }
+
+        mesh_data mesh;
+        std::vector<bvh_node> nodes;
+        uint32_t material_id;
+
+    private:
+        inline bool intersectTriangle(const ray& r, size_t tri, float t_min, float& t_max, float& u, float& v) const;
+};
+
+triangle_mesh::triangle_mesh(mesh_data data, uint32_t m, BuildMethod method)
+    : mesh(std::move(data)), material_id(m) {
+    const size_t n = mesh.numTriangles();
+    std::vector<aabb> boxes(n);
+    for (size_t tri = 0; tri < n; ++tri) {
+        boxes[tri].grow(mesh.positions[mesh.indices[3 * tri]]);
+        boxes[tri].grow(mesh.positions[mesh.indices[3 * tri + 1]]);
+        boxes[tri].grow(mesh.positions[mesh.indices[3 * tri + 2]]);
+    }
+
+    std::vector<int> order;
+    buildHierarchy(boxes, MAX_LEAF_SIZE, 1., method, nodes, order);
+
+    // put the index triples in leaf order
+    const bool smooth = !mesh.normalIndices.empty();
+    std::vector<uint32_t> indices(mesh.indices.size());
+    std::vector<uint32_t> normalIndices(mesh.normalIndices.size());
+    for (size_t k = 0; k < order.size(); ++k) {
+        for (int c = 0; c < 3; ++c) {
+            indices[3 * k + c] = mesh.indices[3 * order[k] + c];
+            if (smooth)
+                normalIndices[3 * k + c] = mesh.normalIndices[3 * order[k] + c];
+        }
+    }
+    mesh.indices.swap(indices);
+    mesh.normalIndices.swap(normalIndices);
+}
+
+/**
+ * Möller-Trumbore ray / triangle test. Both sides of the triangle count as hits.
+ * On a hit lowers t_max and returns the barycentric coordinates of the hit point in u, v.
+ **/
+inline bool triangle_mesh::intersectTriangle(const ray& r, size_t tri, float t_min, float& t_max, float& u,
+                                             float& v) const {
+    const vec3& p0 = mesh.positions[mesh.indices[3 * tri]];
+    const vec3& p1 = mesh.positions[mesh.indices[3 * tri + 1]];
+    const vec3& p2 = mesh.positions[mesh.indices[3 * tri + 2]];
+
+    const vec3 edge1 = p1 - p0;
+    const vec3 edge2 = p2 - p0;
+    const vec3 pvec = cross(r.direction(), edge2);
+    const float det = dot(edge1, pvec);
+    if (fabs(det) < 1e-12)
+        return false;  // ray parallel to the triangle
+
+    const float invDet = 1. / det;
+    const vec3 tvec = r.origin() - p0;
+    const float bu = dot(tvec, pvec) * invDet;
+    if (bu < 0. || bu > 1.)
+        return false;
+
+    const vec3 qvec = cross(tvec, edge1);
+    const float bv = dot(r.direction(), qvec) * invDet;
+    if (bv < 0. || bu + bv > 1.)
+        return false;
+
+    const float t = dot(edge2, qvec) * invDet;
+    if (t <= t_min || t >= t_max)
+        return false;
+
+    t_max = t;
+    u = bu;
+    v = bv;
+    return true;
+}
+
+bool triangle_mesh::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    size_t closestTriangle = 0;
+    float closestU = 0., closestV = 0.;
+
+    bool hit_anything = traverseBvh(nodes, r, t_min, t_max, [&](const bvh_node& node, float& closest_so_far) {
+        bool found = false;
+        float u, v;
+        for (int tri = node.offset; tri < node.offset + node.count; ++tri) {
+            if (intersectTriangle(r, tri, t_min, closest_so_far, u, v)) {
+                found = true;
+                closestTriangle = tri;
+                closestU = u;
+                closestV = v;
+            }
+        }
+        if (found)
+            rec.t = closest_so_far;
+        return found;
+    });
+
+    if (!hit_anything)
+        return false;
+
+    // only work out the shading attributes for the hit we keep
+    const size_t tri = closestTriangle;
+    rec.p = r.pointAtParameter(rec.t);
+    if (!mesh.normalIndices.empty()) {
+        const float w = 1. - closestU - closestV;
+        rec.normal = unitVector(w * mesh.normals[mesh.normalIndices[3 * tri]] +
+                                closestU * mesh.normals[mesh.normalIndices[3 * tri + 1]] +
+                                closestV * mesh.normals[mesh.normalIndices[3 * tri + 2]]);
+    } else {
+        const vec3& p0 = mesh.positions[mesh.indices[3 * tri]];
+        const vec3& p1 = mesh.positions[mesh.indices[3 * tri + 1]];
+        const vec3& p2 = mesh.positions[mesh.indices[3 * tri + 2]];
+        rec.normal = unitVector(cross(p1 - p0, p2 - p0));
+    }
+    rec.material_id = material_id;
+    return true;
+}
+
+bool triangle_mesh::occluded(const ray& r, float t_min, float t_max) const {
+    return traverseBvh<true>(nodes, r, t_min, t_max, [&](const bvh_node& node, float& closest_so_far) {
+        float u, v;
+        for (int tri = node.offset; tri < node.offset + node.count; ++tri) {
+            if (intersectTriangle(r, tri, t_min, closest_so_far, u, v))
+                return true;
+        }
+        return false;
+    });
+}
+
+bool triangle_mesh::bounding_box(aabb& box) const {
+    if (nodes.empty())
+        return false;
+    box = nodes[0].bounds;
+    return true;
+}
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef WARPH
+#define WARPH
+
+#include <cstdint>
+#include <cstring>
+
+#define _USE_MATH_DEFINES  // for MSVC, for M_PI
+#include <cmath>
+
+#include "vec3.h"
+
+/**
+ * Closed-form mappings of uniform samples in [0, 1)^2 (or [0, 1)^3) onto the shapes the tracer
+ * samples directions and points from.
+ *
+ * The samples come in as arguments, so they can be the stratified / low-discrepancy numbers of
+ * a sampling::PixelSampler as well as plain random ones, and every mapping preserves their
+ * stratification: neighbouring samples land on neighbouring points. There's no rejection loop and
+ * no branch, only arithmetic and selects (the angles go through the polynomials below rather than
+ * std::sin / std::cos), so a loop over many samples compiles to straight vector code.
+ **/
+namespace warp {
+
+    namespace detail {
+        /**
+         * sin and cos of x in [-pi/4, pi/4], the minimax polynomials of Cephes' sinf / cosf
+         * (within an ulp or two of the library functions over that range)
+         **/
+        inline void sinCosQuarter(float x, float& s, float& c) {
+            const float x2 = x * x;
+            s = x + x * x2 * (-1.6666654611e-1f + x2 * (8.3321608736e-3f + x2 * -1.9515295891e-4f));
+            c = 1.f - 0.5f * x2 + x2 * x2 * (4.166664568298827e-2f + x2 * (-1.388731625493765e-3f +
+                                                                            x2 * 2.443315711809948e-5f));
+        }
+
+        /**
+         * Cube root of x >= 0: a first guess from dividing the exponent bits by three (Kahan's
+         * trick), good to a few percent, then three Newton steps
+         **/
+        inline float cubeRoot(float x) {
+            uint32_t bits;
+            std::memcpy(&bits, &x, sizeof(bits));
+            bits = bits / 3 + 709921077U;
+            float y;
+            std::memcpy(&y, &bits, sizeof(y));
+            for (int k = 0; k < 3; ++k)
+                y = (2.f * y + x / (y * y)) * (1.f / 3.f);
+            return y;
+        }
+    }
+
+    /**
+     * Shirley and Chiu's concentric mapping of the square onto the unit disk: squares around the
+     * center go to rings, so areas (and strata) keep their shape far better than with the polar
+     * mapping r = sqrt(u). Sets (x, y).
+     **/
+    inline void concentricDisk(float u, float v, float& x, float& y) {
+        const float a = 2.f * u - 1.f, b = 2.f * v - 1.f;
+        const bool wide = std::fabs(a) > std::fabs(b);  // in the left / right wedges
+        const float r = wide ? a : b;
+        // 2u - 1 is a multiple of 2^-23, so the tiny term only matters when r is 0 (then so is the
+        // numerator, and q is 0): no branch around the division
+        const float q = (wide ? b : a) / (r + 1e-30f);
+        float s, c;
+        detail::sinCosQuarter(0.25f * float(M_PI) * q, s, c);
+        const float rs = r * s, rc = r * c;
+        x = wide ? rc : rs;
+        y = wide ? rs : rc;
+    }
+
+    /**
+     * Unit vector around +z with density cos(theta) / pi: the concentric disk lifted onto the
+     * hemisphere (Malley's method)
+     **/
+    inline vec3 cosineHemisphere(float u, float v) {
+        float x, y;
+        concentricDisk(u, v, x, y);
+        return vec3(x, y, std::sqrt(std::fmax(0.f, 1.f - x * x - y * y)));
+    }
+
+    /**
+     * Unit vector, uniform over the sphere: the concentric disk mapped onto it with equal areas,
+     * radius r going to height z = 1 - 2 r^2
+     **/
+    inline vec3 uniformSphere(float u, float v) {
+        float x, y;
+        concentricDisk(u, v, x, y);
+        const float r2 = x * x + y * y;
+        const float scale = 2.f * std::sqrt(std::fmax(0.f, 1.f - r2));
+        return vec3(x * scale, y * scale, 1.f - 2.f * r2);
+    }
+
+    /**
+     * Point uniform within the unit ball: a direction from (u, v) at radius cbrt(w)
+     **/
+    inline vec3 uniformBall(float u, float v, float w) {
+        return detail::cubeRoot(w) * uniformSphere(u, v);
+    }
+
+    /**
+     * Orthonormal basis (s, t, n) around the unit vector `n`, without a branch on which axis
+     * it's closest to (Duff et al., "Building an Orthonormal Basis, Revisited", 2017)
+     **/
+    inline void frame(const vec3& n, vec3& s, vec3& t) {
+        const float sign = std::copysign(1.f, n.z());
+        const float a = -1.f / (sign + n.z());
+        const float b = n.x() * n.y() * a;
+        s = vec3(1.f + sign * n.x() * n.x() * a, sign * b, -sign * n.x());
+        t = vec3(b, sign + n.y() * n.y() * a, -n.y());
+    }
+
+    // `local`, given in the frame (s, t, n), in world space
+    inline vec3 toWorld(const vec3& local, const vec3& s, const vec3& t, const vec3& n) {
+        return local.x() * s + local.y() * t + local.z() * n;
+    }
+}
+
+#endif
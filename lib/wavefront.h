@@ -0,0 +1,399 @@
+#ifndef WAVEFRONTH
+#define WAVEFRONTH
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+#include "aabb.h"
+#include "adaptive.h"
+#include "image.h"
+#include "lbvh.h"
+#include "rand.h"
+#include "sampler.h"
+#include "scheduler.h"
+#include "tracing.h"
+
+/**
+ * Wavefront path tracing: instead of following one path to its end before starting the next
+ * (tracing::colorFromHit), a whole wave of paths advances one bounce at a time, stage by stage:
+ *
+ *  - generate: the camera rays of the wave's samples
+ *  - intersect: the closest hit of every live path, which splits the paths into a hit and a miss queue
+ *  - miss: the sky for the paths that escaped
+ *  - shade: emission, light sample and bounce of the paths that hit something. Paths that carry
+ *    on go into the next intersect queue, their shadow rays into the shadow queue
+ *  - shadow: traces the shadow rays, adding the light of those that get through
+ *
+ * Every stage is one tight loop over a compacted queue of path indices, running the same code
+ * for every entry, and path state is kept as structure of arrays so a stage only pulls in the
+ * components it uses. It's the layout GPU renderers use, and what batching rays (sorting them,
+ * tracing them in packets) builds on.
+ *
+ * With `config.sort_rays`, the queues get sorted between the stages: the bounced rays by
+ * direction octant and the Morton code of their origin before they're intersected, so rays that
+ * walk the same part of the tree follow each other, and the hits by material before they're
+ * shaded, so each material's code and data are used in one go. The stages count how often
+ * consecutive entries agree (see Stats), which shows what the sorting buys without hardware counters.
+ *
+ * A path goes through the same steps as in colorFromHit, in the same order and through the same
+ * helpers, so with a low discrepancy sampler the image comes out identical to the recursive
+ * integrator's. With the random sampler, the samples of a pixel are in flight at the same time
+ * rather than one after the other, so every (pixel, sample) path draws from its own stream, seeded
+ * like a progressive pass: progressive renders are identical too, tiled ones differ in noise only.
+ **/
+namespace wavefront {
+
+    // paths in flight per thread, enough for every stage to run long loops
+    static const uint32_t WAVE_SIZE = 4096;
+
+    /**
+     * One vec3 per path, as three arrays
+     **/
+    struct Float3s {
+        std::vector<float> x, y, z;
+
+        void resize(size_t n) {
+            x.resize(n);
+            y.resize(n);
+            z.resize(n);
+        }
+        inline vec3 get(uint32_t k) const { return vec3(x[k], y[k], z[k]); }
+        inline void set(uint32_t k, const vec3& v) {
+            x[k] = v.x();
+            y[k] = v.y();
+            z[k] = v.z();
+        }
+    };
+
+    /**
+     * How coherent the queues were: of the rays intersected, how many went into the same
+     * direction octant as the one before them, and of the hits shaded, how many had the same
+     * material as the one before them
+     **/
+    struct Stats {
+        uint64_t rays, sameOctant, hits, sameMaterial;
+
+        Stats& operator+=(const Stats& other) {
+            rays += other.rays;
+            sameOctant += other.sameOctant;
+            hits += other.hits;
+            sameMaterial += other.sameMaterial;
+            return *this;
+        }
+    };
+
+    namespace detail {
+        inline std::mutex& statsMutex() {
+            static std::mutex mutex;
+            return mutex;
+        }
+        inline Stats& totalStats() {
+            static Stats stats = {0, 0, 0, 0};
+            return stats;
+        }
+    }
+
+    // the stats of every tile traced so far, over all threads
+    inline Stats stats() {
+        std::lock_guard<std::mutex> lock(detail::statsMutex());
+        return detail::totalStats();
+    }
+
+    /**
+     * Everything the stages know about the paths of a wave, indexed by the path's slot, and the
+     * queues of slots that go through each stage next
+     **/
+    struct PathStates {
+        explicit PathStates(uint32_t capacity)
+            : pixel(capacity), depth(capacity), scatterPdf(capacity), shadowDistance(capacity), streams(capacity),
+              samplers(capacity), hits(capacity) {
+            for (Float3s* v : {&origin, &direction, &throughput, &radiance, &scatterOrigin, &shadowDirection,
+                               &shadowLight})
+                v->resize(capacity);
+            active.reserve(capacity);
+            hitQueue.reserve(capacity);
+            missQueue.reserve(capacity);
+            shadowQueue.reserve(capacity);
+        }
+
+        inline ray getRay(uint32_t k) const { return ray(origin.get(k), direction.get(k)); }
+        inline void setRay(uint32_t k, const ray& r) {
+            origin.set(k, r.origin());
+            direction.set(k, r.direction());
+        }
+
+        Float3s origin, direction;  // the ray to intersect next
+        Float3s throughput, radiance;
+        std::vector<uint32_t> pixel;  // which of the tile's pixels the path is a sample of
+        std::vector<uint32_t> depth;
+        std::vector<float> scatterPdf;  // see colorFromHit
+        Float3s scatterOrigin;
+        Float3s shadowDirection, shadowLight;  // shadow ray of the last shade stage
+        std::vector<float> shadowDistance;
+        std::vector<pcg32> streams;  // the random sampler's numbers
+        std::vector<sampling::PixelSampler> samplers;
+        std::vector<hit_record> hits;  // of the last intersect stage
+
+        std::vector<uint32_t> active, hitQueue, missQueue, shadowQueue;
+        std::vector<uint32_t> sortKeys;  // scratch space of the sorts
+        std::vector<int> sortSlots;
+        lbvh::RadixScratch radixScratch;
+        Stats stats;  // of the tile being traced
+    };
+
+    /**
+     * Paths of the calling thread, allocated once and reused for every tile
+     **/
+    inline PathStates& threadPaths() {
+        static thread_local PathStates paths(WAVE_SIZE);
+        return paths;
+    }
+
+    /**
+     * Pixel (i, j) of a tile and its position in the image
+     **/
+    struct TilePixel {
+        int i, j;
+        uint64_t index;
+    };
+
+    // --- stages -------------------------------------------------------------------------------
+
+    /**
+     * Starts path `k` as sample `sample` of `pixel`, local pixel `local` of the tile
+     **/
+    inline void generate(PathStates& paths, uint32_t k, const TilePixel& pixel, uint32_t local, unsigned int sample,
+                         const tracing::RayTracingConfig& config) {
+        const uint64_t pixels = uint64_t(config.width) * config.height;
+        paths.streams[k] = random_stream(config.seed, uint64_t(sample) * pixels + pixel.index);
+        paths.samplers[k] =
+            sampling::PixelSampler(config.sampler, config.seed, pixel.i, pixel.j, sample, &paths.streams[k]);
+        paths.setRay(k, tracing::cameraRay(pixel.i, pixel.j, config, paths.samplers[k]));
+        paths.throughput.set(k, vec3(1, 1, 1));
+        paths.radiance.set(k, vec3(0, 0, 0));
+        paths.scatterPdf[k] = 0;
+        paths.depth[k] = 0;
+        paths.pixel[k] = local;
+        paths.active.push_back(k);
+    }
+
+    // which of the 8 octants the direction of path `k` points into
+    inline uint32_t octant(const PathStates& paths, uint32_t k) {
+        return uint32_t(paths.direction.x[k] < 0) | uint32_t(paths.direction.y[k] < 0) << 1 |
+               uint32_t(paths.direction.z[k] < 0) << 2;
+    }
+
+    void intersect(PathStates& paths, const tracing::RayTracingConfig& config) {
+        paths.hitQueue.clear();
+        paths.missQueue.clear();
+        uint32_t previous = ~0u;
+        for (uint32_t k : paths.active) {
+            const uint32_t o = octant(paths, k);
+            paths.stats.sameOctant += o == previous;
+            previous = o;
+            if (config.world->hit(paths.getRay(k), 0.001, std::numeric_limits<float>::max(), paths.hits[k]))
+                paths.hitQueue.push_back(k);
+            else
+                paths.missQueue.push_back(k);
+        }
+        paths.stats.rays += paths.active.size();
+    }
+
+    void miss(PathStates& paths, const tracing::RayTracingConfig& config) {
+        for (uint32_t k : paths.missQueue) {
+            paths.radiance.set(k, paths.radiance.get(k) +
+                                      paths.throughput.get(k) * config.sky * tracing::background(paths.getRay(k)));
+        }
+    }
+
+    /**
+     * Shades every hit, refilling `active` with the paths that bounce on
+     **/
+    void shade(PathStates& paths, const tracing::RayTracingConfig& config) {
+        const bool sampleLights = config.nee && !config.lights.empty();
+        paths.active.clear();
+        paths.shadowQueue.clear();
+        paths.stats.hits += paths.hitQueue.size();
+        uint32_t previous = ~0u;
+        for (uint32_t k : paths.hitQueue) {
+            const hit_record& rec = paths.hits[k];
+            paths.stats.sameMaterial += rec.material_id == previous;
+            previous = rec.material_id;
+            const material& mat = config.materials[rec.material_id];
+            vec3 throughput = paths.throughput.get(k);
+            float scatterPdf = paths.scatterPdf[k];
+            vec3 scatterOrigin = paths.scatterOrigin.get(k);
+
+            const vec3 emitted = mat.emitted();
+            if (emitted.r() > 0 || emitted.g() > 0 || emitted.b() > 0) {
+                const float weight = tracing::emitterWeight(rec, scatterPdf, scatterOrigin, config);
+                paths.radiance.set(k, paths.radiance.get(k) + weight * throughput * emitted);
+            }
+
+            const unsigned int depth = paths.depth[k];
+            if (depth >= config.max_depth)
+                continue;
+
+            vec3 direction, light;
+            float distance;
+            if (sampleLights && mat.isDiffuse() &&
+                tracing::sampleLight(rec, mat, depth, throughput, config, paths.samplers[k], direction, distance,
+                                     light)) {
+                paths.shadowDirection.set(k, direction);
+                paths.shadowDistance[k] = distance;
+                paths.shadowLight.set(k, light);
+                paths.shadowQueue.push_back(k);
+            }
+
+            ray current = paths.getRay(k);
+            if (!tracing::bounce(current, rec, mat, depth, config, paths.samplers[k], throughput, scatterPdf,
+                                 scatterOrigin))
+                continue;
+            paths.setRay(k, current);
+            paths.throughput.set(k, throughput);
+            paths.scatterPdf[k] = scatterPdf;
+            paths.scatterOrigin.set(k, scatterOrigin);
+            paths.depth[k] = depth + 1;
+            paths.active.push_back(k);
+        }
+    }
+
+    void shadow(PathStates& paths, const tracing::RayTracingConfig& config) {
+        for (uint32_t k : paths.shadowQueue) {
+            const ray shadowRay(paths.hits[k].p, paths.shadowDirection.get(k));
+            if (!config.world->occluded(shadowRay, 0.001, paths.shadowDistance[k] * 0.999f))
+                paths.radiance.set(k, paths.radiance.get(k) + paths.shadowLight.get(k));
+        }
+    }
+
+    // --- sorting the queues -------------------------------------------------------------------
+
+    /**
+     * Sorts the slots of `queue` by `key(slot)`, a 30 bit code, keeping the order of equal keys
+     **/
+    template <typename Key>
+    void sortQueue(PathStates& paths, std::vector<uint32_t>& queue, const Key& key) {
+        paths.sortKeys.resize(queue.size());
+        paths.sortSlots.resize(queue.size());
+        for (size_t q = 0; q < queue.size(); ++q) {
+            paths.sortKeys[q] = key(queue[q]);
+            paths.sortSlots[q] = int(queue[q]);
+        }
+        lbvh::radixSort(paths.sortKeys, paths.sortSlots, 1, paths.radixScratch);
+        for (size_t q = 0; q < queue.size(); ++q)
+            queue[q] = uint32_t(paths.sortSlots[q]);
+    }
+
+    /**
+     * Orders the rays of `active` by direction octant, then along a Z-order curve through
+     * `bounds` (the scene's) by origin: 3 + 27 bits
+     **/
+    void sortRays(PathStates& paths, const aabb& bounds) {
+        const vec3 extent = bounds.extent();
+        const vec3 scale(extent.x() > 0 ? 1.f / extent.x() : 0.f, extent.y() > 0 ? 1.f / extent.y() : 0.f,
+                         extent.z() > 0 ? 1.f / extent.z() : 0.f);
+        sortQueue(paths, paths.active, [&](uint32_t k) {
+            const float x = (paths.origin.x[k] - bounds.pmin.x()) * scale.x();
+            const float y = (paths.origin.y[k] - bounds.pmin.y()) * scale.y();
+            const float z = (paths.origin.z[k] - bounds.pmin.z()) * scale.z();
+            return octant(paths, k) << 27 | lbvh::morton3(x, y, z) >> 3;
+        });
+    }
+
+    /**
+     * Orders the hits of `hitQueue` by material type, then material
+     **/
+    void sortHits(PathStates& paths, const tracing::RayTracingConfig& config) {
+        sortQueue(paths, paths.hitQueue, [&](uint32_t k) {
+            const uint32_t id = paths.hits[k].material_id;
+            return uint32_t(config.materials[id].type) << 28 | std::min<uint32_t>(id, (1u << 28) - 1);
+        });
+    }
+
+    // --- driving the stages -------------------------------------------------------------------
+
+    // called with the sum of the samples of every pixel of a tile once they're all done
+    typedef std::function<void(int i, int j, const vec3& sum)> PixelCallback;
+
+    /**
+     * Traces samples [firstSample, firstSample + numSamples) of every pixel of `tile` not marked in
+     * `done`, as many waves as they take, and hands each pixel's sum to `finished`. Waves take the
+     * samples pixel by pixel, and sums are added up in sample order like `tracing::trace` does.
+     * Paths don't depend on each other, so sorting the queues doesn't change the sums.
+     **/
+    void traceTile(const scheduler::Tile& tile, const tracing::RayTracingConfig& config, unsigned int firstSample,
+                   unsigned int numSamples, const scheduler::PixelMask* done, const PixelCallback& finished) {
+        std::vector<TilePixel> pixels;
+        for (int j = tile.y1 - 1; j >= tile.y0; --j) {
+            for (int i = tile.x0; i < tile.x1; ++i) {
+                const uint64_t index = uint64_t(j) * config.width + i;
+                if (!done || !(*done)[index])
+                    pixels.push_back(TilePixel{i, j, index});
+            }
+        }
+        std::vector<vec3> sums(pixels.size(), vec3(0, 0, 0));
+
+        PathStates& paths = threadPaths();
+        paths.stats = Stats{0, 0, 0, 0};
+        aabb bounds;
+        if (config.sort_rays)
+            config.world->bounding_box(bounds);
+        const uint64_t total = uint64_t(pixels.size()) * numSamples;
+        for (uint64_t next = 0; next < total;) {
+            paths.active.clear();
+            uint32_t n = 0;
+            for (; n < WAVE_SIZE && next < total; ++n, ++next) {
+                const uint32_t local = uint32_t(next / numSamples);
+                generate(paths, n, pixels[local], local, firstSample + unsigned(next % numSamples), config);
+            }
+
+            // camera rays come in pixel order, which is as coherent as they get
+            for (bool bounced = false; !paths.active.empty(); bounced = true) {
+                if (config.sort_rays && bounced)
+                    sortRays(paths, bounds);
+                intersect(paths, config);
+                miss(paths, config);
+                if (config.sort_rays)
+                    sortHits(paths, config);
+                shade(paths, config);
+                shadow(paths, config);
+            }
+
+            for (uint32_t k = 0; k < n; ++k)
+                sums[paths.pixel[k]] += paths.radiance.get(k);
+        }
+
+        for (size_t q = 0; q < pixels.size(); ++q)
+            finished(pixels[q].i, pixels[q].j, sums[q]);
+
+        std::lock_guard<std::mutex> lock(detail::statsMutex());
+        detail::totalStats() += paths.stats;
+    }
+
+    /**
+     * Renders the whole image like scheduler::renderTiles, every tile with the wavefront integrator
+     **/
+    void renderTiles(const tracing::RayTracingConfig& config, Image& img, unsigned numThreads,
+                     const scheduler::TileCallback& onTileDone = nullptr, const scheduler::PixelMask* done = nullptr,
+                     adaptive::SampleCounts* counts = nullptr) {
+        const std::vector<scheduler::Tile> tiles = scheduler::makeTiles(config.width, config.height, config.tile_size);
+        scheduler::runTiles(tiles, numThreads, [&](const scheduler::Tile& tile) {
+            traceTile(tile, config, 0, config.num_samples, done, [&](int i, int j, const vec3& sum) {
+                // linear radiance, the framebuffer takes care of gamma and quantizing
+                vec3 c = sum;
+                c /= float(config.num_samples);
+                img.setPixel(c, i, j);
+                if (counts)
+                    (*counts)[img.index(i, j)] = config.num_samples;
+            });
+            if (onTileDone)
+                onTileDone(tile);
+        });
+    }
+}
+
+#endif
@@ -0,0 +1,363 @@
+#ifndef WIDEBVHH
+#define WIDEBVHH
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "packed_spheres.h"
+#include "simd.h"
+
+/**
+ * Node of an N-wide BVH.
+ *
+ * The bounds of all N children are stored as structure of arrays (every child's min x together,
+ * then every min y, ...), so one 4 or 8 wide vector instruction does the same slab step for all
+ * children at once. Nodes live in a std::vector, which (before C++17) doesn't honour alignas,
+ * so the kernels use unaligned loads.
+ **/
+template <int N>
+struct wide_bvh_node {
+    float minX[N];
+    float minY[N];
+    float minZ[N];
+    float maxX[N];
+    float maxY[N];
+    float maxZ[N];
+    int child[N];  // interior child: index of its node. leaf child: index of its first primitive
+    int count[N];  // primitives in a leaf child, 0 for an interior one
+    int occupied;  // bitmask of the slots in use, a node can have fewer than N children
+
+    inline bool isLeaf(int slot) const { return count[slot] > 0; }
+};
+
+namespace widebvh {
+
+    /**
+     * Slab test of one ray against every child of a node. Returns the bitmask of the children the
+     * ray enters inside (t_min, t_max) and their entry distances in `tnear`.
+     *
+     * NaNs (0 * inf, for a ray starting on a slab plane and parallel to it) are dropped by the
+     * min / max order, the same way `aabb::hit` treats them.
+     **/
+    template <int N>
+    inline int intersectChildrenScalar(const wide_bvh_node<N>& node, const vec3& origin, const vec3& invDirection,
+                                       float t_min, float t_max, float* tnear) {
+        int mask = 0;
+        for (int c = 0; c < N; ++c) {
+            const float x0 = (node.minX[c] - origin.x()) * invDirection.x();
+            const float x1 = (node.maxX[c] - origin.x()) * invDirection.x();
+            const float y0 = (node.minY[c] - origin.y()) * invDirection.y();
+            const float y1 = (node.maxY[c] - origin.y()) * invDirection.y();
+            const float z0 = (node.minZ[c] - origin.z()) * invDirection.z();
+            const float z1 = (node.maxZ[c] - origin.z()) * invDirection.z();
+            const float enter = std::max(std::max(std::min(x0, x1), std::min(y0, y1)), std::max(std::min(z0, z1), t_min));
+            const float exit = std::min(std::min(std::max(x0, x1), std::max(y0, y1)), std::min(std::max(z0, z1), t_max));
+            tnear[c] = enter;
+            if (enter <= exit)
+                mask |= 1 << c;
+        }
+        return mask & node.occupied;
+    }
+
+#ifdef TRACER_X86
+    TARGET_SSE41 inline int intersectChildren4(const wide_bvh_node<4>& node, const vec3& origin,
+                                               const vec3& invDirection, float t_min, float t_max, float* tnear) {
+        const __m128 ox = _mm_set1_ps(origin.x()), oy = _mm_set1_ps(origin.y()), oz = _mm_set1_ps(origin.z());
+        const __m128 ix = _mm_set1_ps(invDirection.x()), iy = _mm_set1_ps(invDirection.y()),
+                     iz = _mm_set1_ps(invDirection.z());
+
+        const __m128 x0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minX), ox), ix);
+        const __m128 x1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxX), ox), ix);
+        const __m128 y0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minY), oy), iy);
+        const __m128 y1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxY), oy), iy);
+        const __m128 z0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minZ), oz), iz);
+        const __m128 z1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxZ), oz), iz);
+
+        // max/min return their second operand when either is NaN, so the running bound goes second
+        __m128 enter = _mm_set1_ps(t_min), exit = _mm_set1_ps(t_max);
+        enter = _mm_max_ps(_mm_min_ps(x0, x1), enter);
+        enter = _mm_max_ps(_mm_min_ps(y0, y1), enter);
+        enter = _mm_max_ps(_mm_min_ps(z0, z1), enter);
+        exit = _mm_min_ps(_mm_max_ps(x0, x1), exit);
+        exit = _mm_min_ps(_mm_max_ps(y0, y1), exit);
+        exit = _mm_min_ps(_mm_max_ps(z0, z1), exit);
+
+        _mm_storeu_ps(tnear, enter);
+        return _mm_movemask_ps(_mm_cmple_ps(enter, exit)) & node.occupied;
+    }
+
+    TARGET_AVX2 inline int intersectChildren8(const wide_bvh_node<8>& node, const vec3& origin,
+                                              const vec3& invDirection, float t_min, float t_max, float* tnear) {
+        const __m256 ox = _mm256_set1_ps(origin.x()), oy = _mm256_set1_ps(origin.y()), oz = _mm256_set1_ps(origin.z());
+        const __m256 ix = _mm256_set1_ps(invDirection.x()), iy = _mm256_set1_ps(invDirection.y()),
+                     iz = _mm256_set1_ps(invDirection.z());
+
+        const __m256 x0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.minX), ox), ix);
+        const __m256 x1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.maxX), ox), ix);
+        const __m256 y0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.minY), oy), iy);
+        const __m256 y1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.maxY), oy), iy);
+        const __m256 z0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.minZ), oz), iz);
+        const __m256 z1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.maxZ), oz), iz);
+
+        __m256 enter = _mm256_set1_ps(t_min), exit = _mm256_set1_ps(t_max);
+        enter = _mm256_max_ps(_mm256_min_ps(x0, x1), enter);
+        enter = _mm256_max_ps(_mm256_min_ps(y0, y1), enter);
+        enter = _mm256_max_ps(_mm256_min_ps(z0, z1), enter);
+        exit = _mm256_min_ps(_mm256_max_ps(x0, x1), exit);
+        exit = _mm256_min_ps(_mm256_max_ps(y0, y1), exit);
+        exit = _mm256_min_ps(_mm256_max_ps(z0, z1), exit);
+
+        _mm256_storeu_ps(tnear, enter);
+        return _mm256_movemask_ps(_mm256_cmp_ps(enter, exit, _CMP_LE_OQ)) & node.occupied;
+    }
+#endif
+
+    inline int intersectChildren(const wide_bvh_node<4>& node, simd::Level level, const vec3& origin,
+                                 const vec3& invDirection, float t_min, float t_max, float* tnear) {
+#ifdef TRACER_X86
+        if (level >= simd::SSE4)
+            return intersectChildren4(node, origin, invDirection, t_min, t_max, tnear);
+#endif
+        return intersectChildrenScalar(node, origin, invDirection, t_min, t_max, tnear);
+    }
+
+    inline int intersectChildren(const wide_bvh_node<8>& node, simd::Level level, const vec3& origin,
+                                 const vec3& invDirection, float t_min, float t_max, float* tnear) {
+#ifdef TRACER_X86
+        if (level >= simd::AVX2)
+            return intersectChildren8(node, origin, invDirection, t_min, t_max, tnear);
+#endif
+        return intersectChildrenScalar(node, origin, invDirection, t_min, t_max, tnear);
+    }
+}
+
+/**
+ * BVH with N (4 or 8) children per node, collapsed from the binary SAH tree.
+ *
+ * A binary tree tests one box per step and leaves most of a SIMD register idle. Collapsing pulls
+ * the grandchildren of each node up into it, always opening the child with the largest surface
+ * area (the one most rays enter) until the node has N children, so every node test fills a
+ * vector and the tree is about log2(N) times shallower.
+ *
+ * Leaves are the same as in `bvh`: ranges of a packed_spheres store for all-sphere scenes, tested
+ * with one SIMD kernel call, or of a list of hittables otherwise.
+ **/
+template <int N>
+class wide_bvh : public hittable {
+    public:
+        wide_bvh(std::vector<std::unique_ptr<hittable>> objects, BuildMethod method = BuildMethod::SAH);
+        // collapsed from a binary tree built earlier over spheres already stored in leaf order
+        wide_bvh(const std::vector<bvh_node>& binary, std::unique_ptr<packed_spheres> spheres);
+        virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        virtual bool occluded(const ray& r, float t_min, float t_max) const;
+        virtual bool bounding_box(aabb& box) const;
+
+        std::vector<wide_bvh_node<N>> nodes;
+        std::vector<std::unique_ptr<hittable>> list;
+        std::unique_ptr<packed_spheres> packed;  // set instead of `list` for all-sphere scenes
+        aabb bounds;
+        simd::Level level;
+
+    private:
+        int collapse(const std::vector<bvh_node>& binary, int index);
+        void setChild(wide_bvh_node<N>& node, int slot, const aabb& box);
+        // closest hit into `rec`, or with `anyHit` just whether there is one
+        template <bool anyHit>
+        bool traverse(const ray& r, float t_min, float t_max, hit_record* rec) const;
+
+        // traversal stack entry: a child slot's contents and the distance at which the ray enters it
+        struct entry {
+            int child;
+            int count;
+            float tnear;
+        };
+};
+
+typedef wide_bvh<4> bvh4;
+typedef wide_bvh<8> bvh8;
+
+template <int N>
+wide_bvh<N>::wide_bvh(std::vector<std::unique_ptr<hittable>> objects, BuildMethod method) : level(simd::detect()) {
+    std::vector<bvh_node> binary;
+    buildBvhLeaves(objects, binary, list, packed, bvh::MAX_LEAF_SIZE, bvh::MAX_PACKED_LEAF_SIZE, method);
+    if (binary.empty())
+        return;
+
+    bounds = binary[0].bounds;
+    nodes.reserve(binary.size() / (N - 1) + 1);
+    collapse(binary, 0);
+}
+
+template <int N>
+wide_bvh<N>::wide_bvh(const std::vector<bvh_node>& binary, std::unique_ptr<packed_spheres> spheres)
+    : packed(std::move(spheres)), level(simd::detect()) {
+    if (binary.empty())
+        return;
+
+    bounds = binary[0].bounds;
+    nodes.reserve(binary.size() / (N - 1) + 1);
+    collapse(binary, 0);
+}
+
+template <int N>
+void wide_bvh<N>::setChild(wide_bvh_node<N>& node, int slot, const aabb& box) {
+    node.minX[slot] = box.pmin.x();
+    node.minY[slot] = box.pmin.y();
+    node.minZ[slot] = box.pmin.z();
+    node.maxX[slot] = box.pmax.x();
+    node.maxY[slot] = box.pmax.y();
+    node.maxZ[slot] = box.pmax.z();
+    node.occupied |= 1 << slot;
+}
+
+/**
+ * Turns the binary subtree at `index` into a wide node (and its descendants), returns the node's index
+ **/
+template <int N>
+int wide_bvh<N>::collapse(const std::vector<bvh_node>& binary, int index) {
+    // binary nodes that become this node's children
+    int slots[N];
+    int used = 0;
+    if (binary[index].isLeaf()) {
+        slots[used++] = index;  // only for a root that's a leaf
+    } else {
+        slots[used++] = index + 1;
+        slots[used++] = binary[index].offset;
+    }
+
+    while (used < N) {
+        int widest = -1;
+        for (int s = 0; s < used; ++s) {
+            if (!binary[slots[s]].isLeaf() &&
+                (widest < 0 || binary[slots[s]].bounds.surfaceArea() > binary[slots[widest]].bounds.surfaceArea()))
+                widest = s;
+        }
+        if (widest < 0)
+            break;  // only leaves left
+        const int opened = slots[widest];
+        slots[widest] = opened + 1;
+        slots[used++] = binary[opened].offset;
+    }
+
+    const int self = int(nodes.size());
+    nodes.push_back(wide_bvh_node<N>());
+    wide_bvh_node<N> node;
+    node.occupied = 0;
+    for (int s = 0; s < N; ++s) {
+        // unused slots get an empty box, they're masked out by `occupied` anyway
+        node.minX[s] = node.minY[s] = node.minZ[s] = std::numeric_limits<float>::max();
+        node.maxX[s] = node.maxY[s] = node.maxZ[s] = -std::numeric_limits<float>::max();
+        node.child[s] = 0;
+        node.count[s] = 0;
+    }
+
+    for (int s = 0; s < used; ++s) {
+        const bvh_node& b = binary[slots[s]];
+        setChild(node, s, b.bounds);
+        if (b.isLeaf()) {
+            node.child[s] = b.offset;
+            node.count[s] = b.count;
+        } else {
+            node.child[s] = collapse(binary, slots[s]);
+        }
+    }
+
+    nodes[self] = node;
+    return self;
+}
+
+template <int N>
+template <bool anyHit>
+bool wide_bvh<N>::traverse(const ray& r, float t_min, float t_max, hit_record* rec) const {
+    if (nodes.empty())
+        return false;
+
+    const vec3 origin = r.origin();
+    const vec3 invDirection = inverseDirection(r);
+
+    bool hit_anything = false;
+    float closest_so_far = t_max;
+
+    // every level pushes at most N - 1 entries beyond the one it pops
+    entry stack[(bvh_builder::MAX_DEPTH + 4) * N];
+    int stackSize = 0;
+    stack[stackSize++] = entry{0, 0, t_min};
+
+    alignas(32) float tnear[N];
+
+    while (stackSize > 0) {
+        const entry e = stack[--stackSize];
+        if (e.tnear > closest_so_far)
+            continue;  // something we've hit since pushing it is in front of the whole box
+
+        if (e.count > 0 && anyHit) {
+            if (packed && packed->occludedRange(r, e.child, e.child + e.count, t_min, closest_so_far))
+                return true;
+            for (int i = e.child; !packed && i < e.child + e.count; ++i) {
+                if (list[i]->occluded(r, t_min, closest_so_far))
+                    return true;
+            }
+            continue;
+        }
+        if (e.count > 0) {
+            if (packed) {
+                int closest = packed->hitRange(r, e.child, e.child + e.count, t_min, closest_so_far);
+                if (closest >= 0) {
+                    packed->fillRecord(r, closest, closest_so_far, *rec);
+                    hit_anything = true;
+                }
+            } else {
+                for (int i = e.child; i < e.child + e.count; ++i) {
+                    if (list[i]->hit(r, t_min, closest_so_far, *rec)) {
+                        hit_anything = true;
+                        closest_so_far = rec->t;
+                    }
+                }
+            }
+            continue;
+        }
+
+        const wide_bvh_node<N>& node = nodes[e.child];
+        int mask = widebvh::intersectChildren(node, level, origin, invDirection, t_min, closest_so_far, tnear);
+
+        // push the children we enter farthest first, so the nearest one is visited next
+        const int first = stackSize;
+        for (int c = 0; mask != 0; ++c, mask >>= 1) {
+            if (!(mask & 1))
+                continue;
+            entry child{node.child[c], node.count[c], tnear[c]};
+            int k = stackSize++;
+            for (; k > first && stack[k - 1].tnear < child.tnear; --k)
+                stack[k] = stack[k - 1];
+            stack[k] = child;
+        }
+    }
+
+    return hit_anything;
+}
+
+template <int N>
+bool wide_bvh<N>::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    return traverse<false>(r, t_min, t_max, &rec);
+}
+
+template <int N>
+bool wide_bvh<N>::occluded(const ray& r, float t_min, float t_max) const {
+    return traverse<true>(r, t_min, t_max, nullptr);
+}
+
+template <int N>
+bool wide_bvh<N>::bounding_box(aabb& box) const {
+    if (nodes.empty())
+        return false;
+    box = bounds;
+    return true;
+}
+
+#endif
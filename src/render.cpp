@@ -1,18 +1,33 @@
 #include <algorithm>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
 #include <memory>
-#include <random>
 #include <string>
-#include <thread>
 #include <vector>
 
+#include "adaptive.h"
 #include "args.hpp"
 #include "camera.h"
+#include "checkpoint.h"
+#include "estimator.h"
 #include "image.h"
+#include "image_stream.h"
+#include "light.h"
+#include "packet.h"
+#include "perf_counters.h"
+#include "progressive.h"
+#include "rand.h"
 #include "scene.h"
+#include "sampler.h"
+#include "scene_file.h"
+#include "scheduler.h"
+#include "simd.h"
+#include "thread_pool.h"
 #include "tracing.h"
+#include "triangle_mesh.h"
 #include "vec3.h"
+#include "wavefront.h"
 
 // timing imports
 using std::milli;
@@ -23,8 +38,15 @@ using std::chrono::high_resolution_clock;
 // static const vars
 static const int DEFAULT_MAX_DEPTH = 25;
 static const int DEFAULT_NUM_SAMPLES = 25;
-static const unsigned NUM_THREADS = std::max(std::thread::hardware_concurrency() - 1, (unsigned)1);
 static const float DEFAULT_ESTIMATE = 0.0;
+static const char* const DEFAULT_ACCEL = "bvh";
+static const uint64_t DEFAULT_SEED = 0;
+static const int DEFAULT_TILE_SIZE = 16;
+static const float DEFAULT_LIGHT_INTENSITY = 20;
+static const float DEFAULT_SKY = 1;
+static const int DEFAULT_MIN_SAMPLES = 16;
+static const float DEFAULT_ERROR_THRESHOLD = 0.01;
+static const float DEFAULT_CHECKPOINT_SECONDS = 60;
 
 float printStats(const char* const tag, high_resolution_clock::time_point start, high_resolution_clock::time_point end,
                  bool output) {
@@ -35,8 +57,49 @@ float printStats(const char* const tag, high_resolution_clock::time_point start,
 }
 
 int main(int argc, char** argv) {
+    // a compiled scene is rendered straight from its mapping, which has to outlive the world
+    scenefile::CompiledScene compiledScene;
     tracing::RayTracingConfig config;
 
+    // a resumed render carries on with the command line it was started with, from its checkpoint
+    std::vector<std::string> arguments(argv + 1, argv + argc);
+    std::string resumePath;
+    for (size_t k = 0; k < arguments.size(); ++k) {
+        if (arguments[k] == "--resume" && k + 1 < arguments.size())
+            resumePath = arguments[k + 1];
+        else if (arguments[k].compare(0, 9, "--resume=") == 0)
+            resumePath = arguments[k].substr(9);
+    }
+    checkpoint::State resumed;
+    if (!resumePath.empty()) {
+        std::string error;
+        if (!checkpoint::load(resumePath, resumed, error)) {
+            std::cerr << "Error resuming: " << error << std::endl;
+            return 1;
+        }
+        // but how many threads it gets is up to the command line resuming it
+        auto threadOption = [](const std::vector<std::string>& a, size_t k) -> size_t {
+            if (a[k] == "--threads")
+                return k + 1 < a.size() ? 2 : 1;
+            return a[k].compare(0, 10, "--threads=") == 0 ? 1 : 0;
+        };
+        std::vector<std::string> resumedArguments;
+        for (size_t k = 0; k < resumed.args.size(); ++k) {
+            const size_t n = threadOption(resumed.args, k);
+            if (n == 0)
+                resumedArguments.push_back(resumed.args[k]);
+            else
+                k += n - 1;
+        }
+        for (size_t k = 0; k < arguments.size(); ++k) {
+            const size_t n = threadOption(arguments, k);
+            resumedArguments.insert(resumedArguments.end(), arguments.begin() + k, arguments.begin() + k + n);
+            k += n > 0 ? n - 1 : 0;
+        }
+        arguments = resumedArguments;
+        std::cout << "Resuming from " << resumePath << " (" << resumed.elapsedMs / 1000. << "s rendered)" << std::endl;
+    }
+
     // parse command line arguments
     args::ArgumentParser parser("DREVO Ray Tracer", "This goes after the options.");
     args::HelpFlag help(parser, "help", "Display this help menu", {"help"});
@@ -46,11 +109,98 @@ int main(int argc, char** argv) {
     args::ValueFlag<int> sampling(parser, "sampling", "Number of rays to sample per pixel, for antialiasing purposes",
                                   {'s'});
     args::ValueFlag<std::string> output(parser, "output", "Output PPM filepath", {'o'});
-    args::ValueFlag<float> estimate(parser, "estimate",
-                                    "Percentage of pixels to render to get estimate before rendering fully", {'e'});
+    args::ValueFlag<float> estimate(
+        parser, "estimate", "Fraction of pixels (e.g. 0.01) to trace for a time estimate before rendering the rest",
+        {'e'});
+    args::ValueFlag<std::string> accel(
+        parser, "accel", "Acceleration structure for the scene: bvh (default), bvh4, bvh8, list or packed",
+        {'a', "accel"});
+    args::ValueFlag<std::string> builder(
+        parser, "builder", "How BVHs are built: sah (default, best trees), lbvh (fastest, parallel) or hlbvh",
+        {"builder"});
+    args::ValueFlag<uint64_t> seed(parser, "seed", "Seed for the scene layout and sampling, same seed gives same image",
+                                   {"seed"});
+    args::ValueFlag<int> rrDepth(parser, "rr-depth",
+                                 "Enable Russian roulette path termination starting at this bounce", {"rr-depth"});
+    args::ValueFlag<std::string> packets(
+        parser, "packets", "Trace camera rays in SIMD packets: off (default), auto, sse or avx2", {"packets"});
+    args::ValueFlag<std::string> objPath(parser, "obj", "OBJ mesh to put in place of the big metal sphere", {"obj"});
+    args::ValueFlag<std::string> format(parser, "format", "PPM flavour to write: p3 (text, default) or p6 (binary)",
+                                        {"format"});
+    args::Flag stream(parser, "stream", "Write finished tiles to the output while still rendering, always as P6",
+                      {"stream"});
+    args::ValueFlag<std::string> framebuffer(
+        parser, "framebuffer", "Framebuffer pixel format: rgb8 (default, 3 bytes/pixel), float or half", {"framebuffer"});
+    args::ValueFlag<int> threadCount(
+        parser, "threads",
+        "Threads for every phase: BVH build, estimate, render and writing the image (default: one per hardware thread)",
+        {"threads"});
+    args::ValueFlag<int> tileSize(parser, "tile", "Size in pixels of the square tiles threads pick up and steal",
+                                  {"tile"});
+    args::ValueFlag<int> numLights(parser, "lights", "Number of emissive spheres to hang over the scene", {"lights"});
+    args::ValueFlag<float> lightIntensity(parser, "intensity", "Radiance of the emissive spheres (default 20)",
+                                          {"light-intensity"});
+    args::ValueFlag<float> sky(parser, "sky", "Brightness of the sky, 0 for a scene lit only by its emitters",
+                               {"sky"});
+    args::Flag adaptiveFlag(parser, "adaptive",
+                            "Sample each pixel until its error is below --error, between --min-samples and "
+                            "--max-samples (default 4x -s) samples",
+                            {"adaptive"});
+    args::ValueFlag<int> minSamples(parser, "min-samples", "Samples every pixel gets in adaptive mode (default 16)",
+                                    {"min-samples"});
+    args::ValueFlag<int> maxSamples(parser, "max-samples", "Most samples a pixel gets in adaptive mode",
+                                    {"max-samples"});
+    args::ValueFlag<float> errorThreshold(
+        parser, "error", "Adaptive mode stops sampling a pixel once its 95% error is below this (0-1, default 0.01)",
+        {"error"});
+    args::ValueFlag<std::string> heatmapPath(parser, "heatmap", "Write the samples taken per pixel as a PPM heatmap",
+                                             {"heatmap"});
+    args::Flag progressiveFlag(parser, "progressive",
+                               "Render one sample of every pixel per pass into a float buffer, -s passes in all",
+                               {"progressive"});
+    args::ValueFlag<float> timeLimit(parser, "seconds",
+                                     "Progressive: stop after this many seconds instead of at -s passes (unless -s "
+                                     "is also given)",
+                                     {"time-limit"});
+    args::ValueFlag<int> snapshotEvery(parser, "passes", "Progressive: write the image every this many passes",
+                                       {"snapshot-every"});
+    args::ValueFlag<float> snapshotSeconds(parser, "seconds", "Progressive: write the image every this many seconds",
+                                           {"snapshot-seconds"});
+    args::ValueFlag<std::string> checkpointPath(
+        parser, "checkpoint", "Save the render's progress to this file every --checkpoint-seconds, for --resume",
+        {"checkpoint"});
+    args::ValueFlag<float> checkpointSeconds(parser, "seconds", "How often to write the checkpoint (default 60)",
+                                             {"checkpoint-seconds"});
+    args::ValueFlag<std::string> resume(
+        parser, "checkpoint", "Continue the render saved in this checkpoint, with the options it was started with",
+        {"resume"});
+    args::ValueFlag<std::string> samplerName(
+        parser, "sampler", "Where sample numbers come from: random (default), sobol, halton or bluenoise",
+        {"sampler"});
+    args::ValueFlag<std::string> scenePath(
+        parser, "scene", "Scene file to render instead of the random scene, text or compiled", {"scene"});
+    args::ValueFlag<std::string> exportScene(
+        parser, "path", "Write the scene (the random one by default) as a text scene file and exit", {"export-scene"});
+    args::ValueFlag<std::string> compileScene(
+        parser, "path", "Write the scene as a compiled scene file, for fast loading, and exit", {"compile-scene"});
+    args::Flag noNee(parser, "no-nee", "Don't sample the emitters directly, only find them by bouncing around",
+                     {"no-nee"});
+    args::ValueFlag<std::string> integrator(
+        parser, "integrator",
+        "How paths are traced: recursive (default, one path at a time) or wavefront (waves of paths, stage by stage)",
+        {"integrator"});
+    args::Flag sortRays(parser, "sort-rays",
+                        "With the wavefront integrator, sort rays by direction and origin and hits by material "
+                        "between bounces",
+                        {"sort-rays"});
+    args::Flag countersFlag(parser, "counters",
+                            "Print cache and branch miss counters of the render (and how coherent the wavefront "
+                            "integrator's rays and hits were)",
+                            {"counters"});
 
     try {
-        parser.ParseCLI(argc, argv);
+        parser.Prog(argv[0]);
+        parser.ParseCLI(arguments);
     } catch (args::Help) {
         std::cout << parser;
         return 0;
@@ -64,6 +214,69 @@ int main(int argc, char** argv) {
         return 1;
     }
 
+    if (scenePath && (objPath || numLights)) {
+        std::cerr << "--obj and --lights are for the random scene, put meshes and lights in the scene file" << std::endl;
+        return 1;
+    }
+    // one pool of threads does all the parallel work, the BVH builders take their count from it too
+    if (threadCount && args::get(threadCount) < 1) {
+        std::cerr << "--threads needs at least one thread" << std::endl;
+        return 1;
+    }
+    const unsigned numThreads = threadCount ? unsigned(args::get(threadCount)) : threading::defaultThreads();
+    threading::setDefaultThreads(numThreads);
+    BuildMethod buildMethod = BuildMethod::SAH;
+    if (builder && !parseBuildMethod(args::get(builder), buildMethod)) {
+        std::cerr << "Unknown BVH builder '" << args::get(builder) << "'" << std::endl;
+        return 1;
+    }
+
+    // writing out a scene file replaces rendering
+    if (exportScene || compileScene) {
+        scenefile::Description description;
+        std::string error;
+        if (scenePath) {
+            if (scenefile::isCompiled(args::get(scenePath))) {
+                std::cerr << args::get(scenePath) << " is compiled already" << std::endl;
+                return 1;
+            }
+            if (!scenefile::parse(args::get(scenePath), description, error)) {
+                std::cerr << "Error reading scene: " << error << std::endl;
+                return 1;
+            }
+        } else {
+            // the random scene as it would be rendered, the mesh in place of the big metal sphere
+            seed_random(seed ? args::get(seed) : DEFAULT_SEED, scene::SEED_STREAM);
+            material_table materials;
+            std::vector<std::unique_ptr<hittable>> objects = scene::random_scene_objects(materials, true, !objPath);
+            if (numLights) {
+                scene::add_lights(objects, materials, args::get(numLights),
+                                  lightIntensity ? args::get(lightIntensity) : DEFAULT_LIGHT_INTENSITY);
+            }
+            if (!scenefile::describe(objects, materials, scenefile::defaultCamera(), description, error)) {
+                std::cerr << "Error exporting scene: " << error << std::endl;
+                return 1;
+            }
+            if (objPath) {
+                description.materialNames.push_back("mesh");
+                description.materials.push_back(lambertian(vec3(0.6, 0.6, 0.6)));
+                description.meshes.push_back(scenefile::MeshRecord{
+                    args::get(objPath), vec3(4, 1, 0), 2., uint32_t(description.materials.size() - 1)});
+            }
+        }
+        if (exportScene && !scenefile::writeText(args::get(exportScene), description, error)) {
+            std::cerr << "Error exporting scene: " << error << std::endl;
+            return 1;
+        }
+        if (compileScene && !scenefile::compile(description, args::get(compileScene), buildMethod, error)) {
+            std::cerr << "Error compiling scene: " << error << std::endl;
+            return 1;
+        }
+        std::cout << "Wrote " << description.spheres.size() << " spheres, " << description.meshes.size()
+                  << " meshes and " << description.materials.size() << " materials" << std::endl;
+        return 0;
+    }
+
     // validate the input from the command line
     if (!width || !height) {
         throw args::ValidationError("Requires a height and a width to render image.");
@@ -81,10 +294,137 @@ int main(int argc, char** argv) {
     config.max_depth = depth ? args::get(depth) : DEFAULT_MAX_DEPTH;
     config.num_samples = sampling ? args::get(sampling) : DEFAULT_NUM_SAMPLES;
     config.estimate = estimate ? args::get(estimate) : DEFAULT_ESTIMATE;
+    config.accel = accel ? args::get(accel) : DEFAULT_ACCEL;
+    config.seed = seed ? args::get(seed) : DEFAULT_SEED;
+    PixelFormat pixelFormat = PixelFormat::RGB8;
+    if (framebuffer) {
+        const std::string& name = args::get(framebuffer);
+        if (name == "float") {
+            pixelFormat = PixelFormat::RGB32F;
+        } else if (name == "half") {
+            pixelFormat = PixelFormat::RGBA16F;
+        } else if (name != "rgb8") {
+            std::cerr << "Unknown framebuffer format '" << name << "'" << std::endl;
+            return 1;
+        }
+    }
+    ImageFormat imageFormat = ImageFormat::P3;
+    if (stream && format && args::get(format) == "p3") {
+        std::cerr << "--stream writes tiles in place, which takes fixed size pixels: it needs --format p6" << std::endl;
+        return 1;
+    }
+    if (stream || (format && args::get(format) == "p6")) {
+        imageFormat = ImageFormat::P6;
+    } else if (format && args::get(format) != "p3") {
+        std::cerr << "Unknown image format '" << args::get(format) << "'" << std::endl;
+        return 1;
+    }
+    if (tileSize && args::get(tileSize) <= 0) {
+        std::cerr << "Tile size must be positive" << std::endl;
+        return 1;
+    }
+    config.tile_size = tileSize ? args::get(tileSize) : DEFAULT_TILE_SIZE;
+    simd::Level packetLevel = simd::SCALAR;
+    if (packets && !simd::parse(args::get(packets), packetLevel)) {
+        std::cerr << "Unknown packet mode '" << args::get(packets) << "'" << std::endl;
+        return 1;
+    }
+    config.packet_width = packet::widthFor(packetLevel);
+    config.sampler = sampling::Method::RANDOM;
+    if (samplerName && !sampling::parse(args::get(samplerName), config.sampler)) {
+        std::cerr << "Unknown sampler '" << args::get(samplerName) << "'" << std::endl;
+        return 1;
+    }
+    if (numLights && args::get(numLights) < 0) {
+        std::cerr << "Number of lights can't be negative" << std::endl;
+        return 1;
+    }
+    config.adaptive = adaptiveFlag || minSamples || maxSamples || errorThreshold;
+    // checked as ints, a negative count would wrap around to billions of samples as unsigned
+    if ((minSamples && args::get(minSamples) < 1) || (maxSamples && args::get(maxSamples) < 1)) {
+        std::cerr << "--min-samples and --max-samples need at least one sample" << std::endl;
+        return 1;
+    }
+    config.max_samples = maxSamples ? args::get(maxSamples) : 4 * config.num_samples;
+    config.min_samples = minSamples ? args::get(minSamples) : std::min<unsigned>(DEFAULT_MIN_SAMPLES, config.max_samples);
+    config.error_threshold = errorThreshold ? args::get(errorThreshold) : DEFAULT_ERROR_THRESHOLD;
+    if (config.adaptive && (config.min_samples < 1 || config.max_samples < config.min_samples)) {
+        std::cerr << "Adaptive sampling needs 1 <= --min-samples <= --max-samples" << std::endl;
+        return 1;
+    }
+    config.wavefront = false;
+    if (integrator) {
+        const std::string& name = args::get(integrator);
+        if (name == "wavefront") {
+            config.wavefront = true;
+        } else if (name != "recursive") {
+            std::cerr << "Unknown integrator '" << name << "'" << std::endl;
+            return 1;
+        }
+    }
+    config.sort_rays = sortRays;
+    if (config.sort_rays && !config.wavefront) {
+        std::cerr << "--sort-rays sorts the queues of the wavefront integrator, it needs --integrator wavefront"
+                  << std::endl;
+        return 1;
+    }
+    if (config.wavefront && (config.adaptive || estimate || config.packet_width > 1)) {
+        std::cerr << "The wavefront integrator traces whole tiles at once, it doesn't go with --adaptive, --estimate "
+                     "or --packets"
+                  << std::endl;
+        return 1;
+    }
+    const bool progressiveMode = progressiveFlag || timeLimit || snapshotEvery || snapshotSeconds;
+    if (progressiveMode && (config.adaptive || stream || estimate)) {
+        std::cerr << "Progressive rendering doesn't go with --adaptive, --stream or --estimate" << std::endl;
+        return 1;
+    }
+    progressive::Settings progressiveSettings;
+    progressiveSettings.maxPasses = (timeLimit && !sampling) ? 0 : config.num_samples;
+    progressiveSettings.timeBudgetMs = timeLimit ? 1000. * std::max(0.f, args::get(timeLimit)) : 0.;
+    progressiveSettings.snapshotPasses = snapshotEvery ? std::max(0, args::get(snapshotEvery)) : 0;
+    progressiveSettings.snapshotMs = snapshotSeconds ? 1000. * std::max(0.f, args::get(snapshotSeconds)) : 0.;
+    const double checkpointMs = 1000. * (checkpointSeconds ? std::max(0.f, args::get(checkpointSeconds))
+                                                           : DEFAULT_CHECKPOINT_SECONDS);
+    if (!resumePath.empty()) {
+        const checkpoint::Mode mode = progressiveMode ? checkpoint::Mode::Progressive : checkpoint::Mode::Tiles;
+        if (resumed.mode != mode || resumed.width != int(config.width) || resumed.height != int(config.height) ||
+            (mode == checkpoint::Mode::Tiles && resumed.pixelFormat != uint8_t(pixelFormat))) {
+            std::cerr << "Checkpoint " << resumePath << " doesn't match its own options" << std::endl;
+            return 1;
+        }
+    }
+    config.sky = sky ? std::max(0.f, args::get(sky)) : DEFAULT_SKY;
+    config.nee = !noNee;
+    config.russian_roulette = bool(rrDepth);
+    config.rr_depth = rrDepth ? std::max(0, args::get(rrDepth)) : config.max_depth;
 
-    std::cout << "Rendering '" << config.savepath << "' [" << NUM_THREADS << " threads]: height=" << config.height
+    std::cout << "Rendering '" << config.savepath << "' [" << numThreads << " threads]: height=" << config.height
               << ", width=" << config.width << ", maxdepth=" << config.max_depth << ", sampling=" << config.num_samples
-              << ", estimate=" << config.estimate << std::endl;
+              << ", estimate=" << config.estimate << ", accel=" << config.accel << ", seed=" << config.seed
+              << ", tile=" << config.tile_size << ", builder=" << buildMethodName(buildMethod);
+    if (config.packet_width > 1)
+        std::cout << ", packets=" << config.packet_width << "x " << simd::name(packetLevel);
+    if (config.russian_roulette)
+        std::cout << ", rr-depth=" << config.rr_depth;
+    if (config.sampler != sampling::Method::RANDOM)
+        std::cout << ", sampler=" << sampling::name(config.sampler);
+    if (config.wavefront)
+        std::cout << ", integrator=wavefront" << (config.sort_rays ? " (sorted)" : "");
+    if (progressiveMode) {
+        std::cout << ", progressive";
+        if (progressiveSettings.timeBudgetMs > 0)
+            std::cout << " for " << progressiveSettings.timeBudgetMs / 1000. << "s";
+    }
+    if (config.adaptive)
+        std::cout << ", adaptive=" << config.min_samples << "-" << config.max_samples << " @ " << config.error_threshold;
+    if (numLights)
+        std::cout << ", lights=" << args::get(numLights) << (config.nee ? " (nee)" : "");
+    if (config.sky != DEFAULT_SKY)
+        std::cout << ", sky=" << config.sky;
+    if (scenePath)
+        std::cout << ", scene=" << args::get(scenePath);
+    std::cout << std::endl;
 
     /*
       hittable objects in the scene.
@@ -98,98 +438,267 @@ int main(int argc, char** argv) {
       is delegated to some other operation, at some other time.
     */
     bool floating = true;
-    config.world = scene::random_scene(floating);
+    seed_random(config.seed, scene::SEED_STREAM);
+    const high_resolution_clock::time_point startSceneTime = high_resolution_clock::now();
+    scenefile::CameraSetup cameraSetup = scenefile::defaultCamera();
+    scenefile::Description description;
+    const bool compiled = scenePath && scenefile::isCompiled(args::get(scenePath));
+    std::vector<std::unique_ptr<hittable>> objects;
+    if (compiled) {
+        std::string error;
+        if (!compiledScene.open(args::get(scenePath), error)) {
+            std::cerr << "Error reading scene: " << error << std::endl;
+            return 1;
+        }
+        cameraSetup = compiledScene.camera();
+        config.materials = compiledScene.materials();
+        std::cout << "Mapped " << compiledScene.numSpheres() << " spheres from " << args::get(scenePath) << std::endl;
+    } else if (scenePath) {
+        std::string error;
+        if (!scenefile::parse(args::get(scenePath), description, error)) {
+            std::cerr << "Error reading scene: " << error << std::endl;
+            return 1;
+        }
+        cameraSetup = description.camera;
+        std::cout << "Read " << description.spheres.size() << " spheres and " << description.meshes.size()
+                  << " meshes from " << args::get(scenePath) << std::endl;
+    } else {
+        objects = scene::random_scene_objects(config.materials, floating, !objPath);
+        if (numLights) {
+            scene::add_lights(objects, config.materials, args::get(numLights),
+                              lightIntensity ? args::get(lightIntensity) : DEFAULT_LIGHT_INTENSITY);
+        }
+        config.lights = lights::collect(objects, config.materials);
+    }
+    mesh_data meshData;
+    if (objPath) {
+        std::string error;
+        if (!scene::load_mesh_data(args::get(objPath), vec3(4, 1, 0), 2., meshData, error)) {
+            std::cerr << "Error loading mesh: " << error << std::endl;
+            return 1;
+        }
+        std::cout << "Loaded " << meshData.numTriangles() << " triangles from " << args::get(objPath) << std::endl;
+    }
+    printStats("Scene setup took", startSceneTime, high_resolution_clock::now(), true);
+
+    // acceleration structures, the mesh's own BVH included, timed on their own
+    const high_resolution_clock::time_point startBuildTime = high_resolution_clock::now();
+    if (objPath) {
+        objects.push_back(std::make_unique<triangle_mesh>(
+            std::move(meshData), config.materials.add(lambertian(vec3(0.6, 0.6, 0.6))), buildMethod));
+    }
+    if (compiled) {
+        // the stored tree over the mapped spheres, no per sphere work but finding the lights
+        std::unique_ptr<packed_spheres> spheres = compiledScene.spheres();
+        config.lights = lights::collect(*spheres, config.materials);
+        std::string error;
+        config.world = scenefile::buildWorld(compiledScene, std::move(spheres), config.accel, buildMethod, error);
+        if (!config.world) {
+            std::cerr << "Error building scene: " << error << std::endl;
+            return 1;
+        }
+    } else {
+        if (scenePath) {
+            std::string error;
+            if (!scenefile::instantiate(description, config.materials, buildMethod, objects, error)) {
+                std::cerr << "Error loading mesh: " << error << std::endl;
+                return 1;
+            }
+            config.lights = lights::collect(objects, config.materials);
+        }
+        config.world = scene::build_world(std::move(objects), config.accel, buildMethod);
+        if (!config.world) {
+            std::cerr << "Unknown acceleration structure '" << config.accel << "'" << std::endl;
+            return 1;
+        }
+    }
+    printStats("Acceleration structure build took", startBuildTime, high_resolution_clock::now(), true);
 
-    // set up camera
-    vec3 up = vec3(0, 1, 0);
-    vec3 lookFrom(7.8, 1.5, 1.95);
-    vec3 lookAt(0, 1, 0);
+    // set up camera, the scene file's or the one looking at the random scene
     float aspect = float(config.width) / float(config.height);
-    float distToFocusAt = (lookFrom - lookAt).length();
-    float aperture = 0.;
-    float fieldOfViewDegrees = 45;
-    config.cam = std::make_unique<camera>(lookFrom, lookAt, up, fieldOfViewDegrees, aspect, aperture, distToFocusAt);
+    config.cam = scenefile::makeCamera(cameraSetup, aspect);
+
+    sampling::prepare(config.sampler);
 
     // for status updates, have some stats about the image
     int totalPixels = config.width * config.height;
     std::cout.precision(3);
 
     // allocate image
-    Image img(config.height, config.width);
+    Image img(config.height, config.width, pixelFormat);
 
-    // create pixel tracing jobs
-    std::vector<tracing::TracedPixel> jobs;
-    for (int j = (int)config.height - 1; j >= 0; j--) {
-        for (unsigned int i = 0; i < config.width; i++) {
-            tracing::TracedPixel p(i, j);
-            jobs.push_back(p);
+    // pick up a resumed tiled render: its finished pixels are kept and skipped like the estimate's
+    scheduler::PixelMask done;
+    adaptive::SampleCounts sampleCounts(size_t(totalPixels), 0);
+    if (!resumePath.empty() && resumed.mode == checkpoint::Mode::Tiles) {
+        if (resumed.pixels.size() != img.data.size()) {
+            std::cerr << "Checkpoint " << resumePath << " doesn't match its own options" << std::endl;
+            return 1;
         }
+        img.data = resumed.pixels;
+        done = resumed.done;
+        sampleCounts = resumed.counts;
     }
 
-    // shuffle for better parallelism since some regions of image are more costly than others
-    auto rng = std::default_random_engine{};
-    std::shuffle(std::begin(jobs), std::end(jobs), rng);
-
-    // should we estimate our performance?
-    if (config.estimate > 0.0) {
-        float estimateFraction = 0.01;
-        int estimatePixels = int(totalPixels * estimateFraction);
-        const high_resolution_clock::time_point startEstimateTime = high_resolution_clock::now();
-
-        for (int i = 0; i < estimatePixels; ++i) {
-            tracing::TracedPixel* job = &jobs.at(i);
-            vec3 c = trace(job->i, job->j, config);
-            img.setPixel(c, job->i, job->j);
-        }
-
-        const high_resolution_clock::time_point endEstimateTime = high_resolution_clock::now();
-
-        // TODO: probably need this per platform/thread count, hardcoding for my desktop with 8 cores...
-        float threadingFactor = 1.;
-        if (NUM_THREADS == 7) {
-            threadingFactor = 3.5;
-        }
-
-        float renderingMs = printStats("Rendering estimate", startEstimateTime, endEstimateTime, false);
-        float msPerPixel = renderingMs / estimatePixels / threadingFactor;
-        float secondsTaken = estimatePixels * msPerPixel / 1000.;
-        float secondsLeftEta = (totalPixels - estimatePixels) * msPerPixel / 1000.;
+    // should we estimate our performance? the estimate pixels are kept, the render skips them
+    if (config.estimate > 0.0 && resumePath.empty()) {
+        done.assign(size_t(totalPixels), 0);
+        estimator::Estimate e = estimator::run(config, img, numThreads, done, &sampleCounts);
 
         std::cout << "[Estimation complete]"
-                  << "\tTime taken: " << secondsTaken << "s \tRender ETA: " << secondsLeftEta << "s ("
-                  << (secondsLeftEta / 60.) << " min) "
-                  << " \tPer pixel: " << msPerPixel << "ms" << std::endl;
+                  << "\tTraced " << e.sampledPixels << " pixels in " << (e.wallMs / 1000.) << "s"
+                  << " \tPer pixel: " << e.msPerPixel << " +/- " << e.msPerPixelCI << "ms"
+                  << " \tThreads: " << e.parallelism << "x"
+                  << " \tRender ETA: " << (e.etaMs / 1000.) << "s (" << (e.etaMs / 60000.) << " min)"
+                  << ", 95% CI " << (e.etaLowMs / 1000.) << "s - " << (e.etaHighMs / 1000.) << "s" << std::endl;
     }
 
+    // counters go on every thread of the pool the render runs on
+    perf::PoolCounters counters;
+    std::string countersError;
+    const bool haveCounters = countersFlag && counters.open(numThreads, countersError);
+
     // start rendering time
     const high_resolution_clock::time_point startRenderTime = high_resolution_clock::now();
+    if (haveCounters)
+        counters.start();
 
-    // create list of thread pointers
-    std::vector<std::thread*> threads;
+    // stream tiles into the output file as they finish, so a killed render still leaves an image behind
+    ImageStream imageStream;
+    std::vector<scheduler::TileCallback> tileCallbacks;
+    if (stream) {
+        if (!imageStream.open(config.savepath, img) ||
+            (!done.empty() && !imageStream.writeRegion(img, 0, 0, img.width, img.height))) {
+            std::cerr << "Error opening " << config.savepath << " for streaming" << std::endl;
+            return 1;
+        }
+        // a failed write is remembered by the stream and reported when it's closed
+        tileCallbacks.push_back([&](const scheduler::Tile& tile) {
+            imageStream.writeRegion(img, tile.x0, tile.y0, tile.x1, tile.y1);
+        });
+    }
 
-    // spin off threads
-    int itemsPerThread = int(totalPixels / NUM_THREADS);
-    for (unsigned int i = 0; i < NUM_THREADS; ++i) {
-        int start = i * itemsPerThread;
-        int end = (i == NUM_THREADS - 1) ? totalPixels - 1 : start + itemsPerThread;
-        std::thread* th =
-            new std::thread(tracing::tracePixelBatch, start, end, std::ref(jobs), std::ref(config), std::ref(img));
-        threads.push_back(th);
+    // checkpoints remember the command line, so `--resume` alone is enough to continue
+    checkpoint::State saved;
+    saved.args = arguments;
+    saved.mode = progressiveMode ? checkpoint::Mode::Progressive : checkpoint::Mode::Tiles;
+    saved.width = config.width;
+    saved.height = config.height;
+    saved.elapsedMs = resumePath.empty() ? 0. : resumed.elapsedMs;
+    saved.pixelFormat = uint8_t(pixelFormat);
+    saved.passes = 0;
+    std::unique_ptr<checkpoint::TileCheckpointer> tileCheckpointer;
+    if (checkpointPath && !progressiveMode) {
+        saved.done = done.empty() ? scheduler::PixelMask(size_t(totalPixels), 0) : done;
+        saved.counts.assign(size_t(totalPixels), 0);
+        tileCheckpointer = std::make_unique<checkpoint::TileCheckpointer>(args::get(checkpointPath), checkpointMs,
+                                                                          std::move(saved), img, sampleCounts);
+        tileCallbacks.push_back([&](const scheduler::Tile& tile) { tileCheckpointer->tileDone(tile); });
     }
+    scheduler::TileCallback onTileDone = nullptr;
+    if (!tileCallbacks.empty()) {
+        onTileDone = [&](const scheduler::Tile& tile) {
+            for (const scheduler::TileCallback& callback : tileCallbacks)
+                callback(tile);
+        };
+    }
+
+    if (progressiveMode) {
+        // whole frame passes into the float buffer, snapshots written as we go
+        progressive::Accumulator accumulator(config.width, config.height);
+        if (!resumePath.empty()) {
+            accumulator.sums = resumed.sums;
+            accumulator.passes = resumed.passes;
+            if (progressiveSettings.timeBudgetMs > 0)
+                progressiveSettings.timeBudgetMs = std::max(1e-3, progressiveSettings.timeBudgetMs - resumed.elapsedMs);
+        }
 
-    // join threads
-    for (auto thread : threads) {
-        thread->join();
-        delete thread;
+        // checkpoints go between passes, when the buffer holds a whole number of them
+        progressive::PassCallback afterPass = nullptr;
+        high_resolution_clock::time_point lastCheckpoint = startRenderTime;
+        if (checkpointPath) {
+            afterPass = [&](const progressive::Accumulator& acc) {
+                const high_resolution_clock::time_point now = high_resolution_clock::now();
+                if (duration<double, milli>(now - lastCheckpoint).count() < checkpointMs)
+                    return;
+                saved.passes = acc.passes;
+                saved.sums = acc.sums;
+                saved.elapsedMs = (resumePath.empty() ? 0. : resumed.elapsedMs) +
+                                  duration<double, milli>(now - startRenderTime).count();
+                std::string error;
+                if (!checkpoint::save(args::get(checkpointPath), saved, error))
+                    std::cerr << "Error writing checkpoint: " << error << std::endl;
+                lastCheckpoint = now;
+            };
+        }
+        progressive::render(config, accumulator, img, numThreads, progressiveSettings, imageFormat, afterPass);
+        accumulator.resolve(img, numThreads);
+        std::fill(sampleCounts.begin(), sampleCounts.end(), accumulator.passes);
+        std::cout << "Progressive render stopped after " << accumulator.passes << " passes" << std::endl;
+    } else {
+        // threads pull tiles from their own queue and steal from the others when they run dry
+        if (config.wavefront)
+            wavefront::renderTiles(config, img, numThreads, onTileDone, done.empty() ? nullptr : &done, &sampleCounts);
+        else
+            scheduler::renderTiles(config, img, numThreads, onTileDone, done.empty() ? nullptr : &done, &sampleCounts);
     }
 
     // report time back to user
     const high_resolution_clock::time_point endRenderTime = high_resolution_clock::now();
+    if (haveCounters)
+        counters.stop();
     float renderingMs = printStats("\nRendering took", startRenderTime, endRenderTime, true);
     float perPixel = renderingMs / totalPixels;
     std::cout << "Per pixel render ms (" << totalPixels << "): " << perPixel << " ms" << std::endl;
+    if (countersFlag) {
+        if (haveCounters) {
+            uint64_t values[perf::NUM_EVENTS];
+            std::cout << "Counters:";
+            for (int e = 0; e < perf::NUM_EVENTS; ++e) {
+                values[e] = counters.read(perf::Event(e));
+                std::cout << " " << perf::name(perf::Event(e)) << "=" << values[e];
+            }
+            if (values[perf::CACHE_REFERENCES] > 0)
+                std::cout << " (" << 100. * values[perf::CACHE_MISSES] / values[perf::CACHE_REFERENCES]
+                          << "% of references missed)";
+            std::cout << std::endl;
+        } else {
+            std::cout << "Hardware counters unavailable (" << countersError << ")" << std::endl;
+        }
+        if (config.wavefront) {
+            const wavefront::Stats stats = wavefront::stats();
+            std::cout << "Coherence: " << stats.rays << " rays, "
+                      << (stats.rays ? 100. * stats.sameOctant / stats.rays : 0.)
+                      << "% in the octant of the one before; " << stats.hits << " hits, "
+                      << (stats.hits ? 100. * stats.sameMaterial / stats.hits : 0.)
+                      << "% with the material of the one before" << std::endl;
+        }
+    }
+    if (config.adaptive) {
+        uint64_t totalSamples = 0;
+        for (uint32_t n : sampleCounts)
+            totalSamples += n;
+        std::cout << "Samples per pixel: " << double(totalSamples) / totalPixels << " on average" << std::endl;
+    }
+    if (heatmapPath) {
+        const Image heat = adaptive::heatmap(sampleCounts, config.width, config.height,
+                                             config.adaptive ? config.min_samples : 0,
+                                             config.adaptive ? config.max_samples : config.num_samples);
+        if (!heat.writeToFile(args::get(heatmapPath), imageFormat, numThreads))
+            std::cout << "Error writing heatmap to " << args::get(heatmapPath) << "\n";
+    }
 
-    // then write to disk
-    if (!img.writeToFile(config.savepath))
-        std::cout << "Error writing file to " << config.savepath << "\n";
+    // then write to disk, streamed images are already there
+    bool written;
+    if (stream) {
+        written = imageStream.close();
+    } else {
+        written = img.writeToFile(config.savepath, imageFormat, numThreads);
+    }
+    if (!written) {
+        std::cerr << "Error writing file to " << config.savepath << std::endl;
+        return 1;
+    }
+    if (checkpointPath)
+        std::remove(args::get(checkpointPath).c_str());  // the render is finished, nothing left to resume
 }
\ No newline at end of file